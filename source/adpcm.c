@@ -12,11 +12,21 @@
 
 // Thanks GBATEK for the ima-adpcm specification
 
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "defs.h"
 #include "deftypes.h"
 #include "mas.h"
+#include "adpcm.h"
+
+// Number of paths kept by the trellis encoder at each sample
+#define ADPCM_TRELLIS_NODES 16
+
+// Number of samples after which the trellis encoder keeps only the best path
+#define ADPCM_TRELLIS_BLOCK 4096
+
+bool adpcm_trellis = false;
 
 const s8 IndexTable[8] = {
     -1, -1, -1, -1, 2, 4, 6, 8
@@ -89,48 +99,50 @@ static int calc_delta(int diff, int step)
     return delta;
 }
 
-// Compresses a sample with IMA-ADPCM.
-// Make sure the data has proper alignment/length!
-void adpcm_compress_sample(Sample *sample)
+// Adds the difference of a 4-bit code to the decoder state, the same way the
+// DS hardware does it.
+static void decode_code(int code, int *value, int *index)
 {
-    // Allocate space for sample (compressed size)
-    u8 *output = malloc(sample->sample_length / 2 + 4);
-
-    // Determine best (or close to best) initial table value
-
-    int prev_value = read_sample(sample, 0);
-    int index = 0;
-
-    {
-        int smallest_error = 9999999;
-
-        int diff = read_sample(sample, 1) - read_sample(sample, 0);
-
-        for (int i = 0; i < 88; i++)
-        {
-            int tmp_error = calc_delta(diff, i) - diff;
-            if (tmp_error < smallest_error)
-            {
-                smallest_error = tmp_error;
-                index = i;
-            }
-        }
-    }
+    int step = AdpcmTable[*index];
+
+    /*
+      difference calculation:
+      Diff = AdpcmTable[Index]/8
+      IF (data4bit AND 1) THEN Diff = Diff + AdpcmTable[Index]/4
+      IF (data4bit AND 2) THEN Diff = Diff + AdpcmTable[Index]/2
+      IF (data4bit AND 4) THEN Diff = Diff + AdpcmTable[Index]/1
+    */
+
+    int delta = step >> 3;
+    if (code & 4)
+        delta += step;
+    if (code & 2)
+        delta += step >> 1;
+    if (code & 1)
+        delta += step >> 2;
 
-    // Set data header
+    *value = minmax(*value + ((code & 8) ? -delta : delta), -0x7FFF, 0x7FFF);
+    *index = minmax(*index + IndexTable[code & 7], 0, 88);
+}
 
-    (*((u32 *)output)) = prev_value    // Initial PCM16 value
-                      | (index << 16); // Initial table index value
+static void write_code(u8 *output, u32 position, int code)
+{
+    u8 *byte = &output[(position >> 1) + 4];
 
-    int step = AdpcmTable[index];
+    if (position & 1)
+        *byte = (*byte & 0x0F) | (code << 4);
+    else
+        *byte = (*byte & 0xF0) | code;
+}
 
+// Picks the code closest to each sample, one sample at a time
+static void encode_greedy(Sample *sample, u8 *output, int value, int index)
+{
     for (u32 x = 0; x < sample->sample_length; x++)
     {
         int data;
 
-        int curr_value = read_sample(sample, x);
-
-        int diff = curr_value - prev_value;
+        int diff = read_sample(sample, x) - value;
         if (diff < 0)
         {
             // Negate difference & set negative bit
@@ -143,54 +155,200 @@ void adpcm_compress_sample(Sample *sample)
             data = 0;
         }
 
-        /*
-          difference calculation:
-          Diff = AdpcmTable[Index]/8
-          IF (data4bit AND 1) THEN Diff = Diff + AdpcmTable[Index]/4
-          IF (data4bit AND 2) THEN Diff = Diff + AdpcmTable[Index]/2
-          IF (data4bit AND 4) THEN Diff = Diff + AdpcmTable[Index]/1
-        */
-
-        int delta = step >> 3;      // t / 8 (always)
+        int step = AdpcmTable[index];
 
         if (diff >= step)           // t / 1
         {
             data |= 4;
             diff -= step;
-            delta += step;
         }
         if (diff >= (step >> 1))    // t / 2
         {
             data |= 2;
             diff -= step >> 1;
-            delta += step >> 1;
         }
         if (diff >= (step >> 2))    // t / 4
         {
             data |= 1;
             diff -= step >> 2;
-            delta += step >> 2;
         }
 
-        // Add/subtract delta
-        prev_value += (data & 8) ? -delta : delta;
+        decode_code(data, &value, &index);
 
-        // Clamp output
-        prev_value = minmax(prev_value, -0x7FFF, 0x7FFF);
+        write_code(output, x, data);
+    }
+}
 
-        // Add index table value (and clamp)
-        index = minmax(index + IndexTable[data & 7], 0, 88);
+typedef struct tTrellisNode
+{
+    u64     error;      // Sum of the squared errors of the path
+    int     value;      // State of the decoder at the end of the path
+    int     index;
+    int     code;       // Last code of the path
+    int     parent;     // Node of the previous sample that the path comes from
+}
+TrellisNode;
+
+// Adds a path to the list of nodes of a sample, which is sorted by error and
+// has at most ADPCM_TRELLIS_NODES entries. Paths that end in the same decoder
+// state as a better one are discarded, as they can't do better from there.
+static void trellis_insert(TrellisNode *nodes, int *count, const TrellisNode *node)
+{
+    int pos = *count;
 
-        // Read new step value
-        step = AdpcmTable[index];
+    for (int i = 0; i < *count; i++)
+    {
+        if (nodes[i].value == node->value && nodes[i].index == node->index)
+        {
+            if (nodes[i].error <= node->error)
+                return;
+            pos = i;
+            break;
+        }
+    }
 
-        // Write output
-        if (x & 1)
-            output[(x >> 1) + 4] |= data << 4;
+    if (pos == *count)
+    {
+        if (*count < ADPCM_TRELLIS_NODES)
+            (*count)++;
+        else if (nodes[pos - 1].error <= node->error)
+            return;
         else
-            output[(x >> 1) + 4] = data;
+            pos--;
+    }
+
+    while (pos > 0 && nodes[pos - 1].error > node->error)
+    {
+        nodes[pos] = nodes[pos - 1];
+        pos--;
     }
 
+    nodes[pos] = *node;
+}
+
+// Keeps the best ADPCM_TRELLIS_NODES paths at each sample, and tries the codes
+// around the one that the greedy encoder would pick from the end of each path.
+// Every ADPCM_TRELLIS_BLOCK samples the best path is written to the output and
+// the search starts again from its end.
+static void encode_trellis(Sample *sample, u8 *output, int value, int index)
+{
+    TrellisNode (*history)[ADPCM_TRELLIS_NODES] =
+        malloc(ADPCM_TRELLIS_BLOCK * sizeof(*history));
+    int *counts = malloc(ADPCM_TRELLIS_BLOCK * sizeof(int));
+
+    if (history == NULL || counts == NULL)
+    {
+        printf("Not enough memory to compress sample\n");
+        exit(EXIT_FAILURE);
+    }
+
+    TrellisNode start = { 0, value, index, 0, 0 };
+
+    for (u32 base = 0; base < sample->sample_length; base += ADPCM_TRELLIS_BLOCK)
+    {
+        u32 length = sample->sample_length - base;
+        if (length > ADPCM_TRELLIS_BLOCK)
+            length = ADPCM_TRELLIS_BLOCK;
+
+        for (u32 x = 0; x < length; x++)
+        {
+            const TrellisNode *prev = (x == 0) ? &start : history[x - 1];
+            int prev_count = (x == 0) ? 1 : counts[x - 1];
+            int target = read_sample(sample, base + x);
+
+            counts[x] = 0;
+
+            for (int n = 0; n < prev_count; n++)
+            {
+                int diff = target - prev[n].value;
+                int sign = (diff < 0) ? 8 : 0;
+                int step = AdpcmTable[prev[n].index];
+
+                // Magnitude picked by the greedy encoder
+                int ideal = (abs(diff) * 4) / step;
+                if (ideal > 7)
+                    ideal = 7;
+
+                // Magnitude -1 is the smallest code with the other sign,
+                // which can be closer when the difference is small.
+                for (int mag = ideal - 1; mag <= ideal + 1; mag++)
+                {
+                    if (mag > 7)
+                        continue;
+
+                    TrellisNode node;
+                    node.code = (mag < 0) ? (sign ^ 8) : (sign | mag);
+                    node.value = prev[n].value;
+                    node.index = prev[n].index;
+                    node.parent = n;
+
+                    decode_code(node.code, &node.value, &node.index);
+
+                    s64 error = target - node.value;
+                    node.error = prev[n].error + error * error;
+
+                    trellis_insert(history[x], &counts[x], &node);
+                }
+            }
+        }
+
+        // The best path of the block is the first node of its last sample
+        int n = 0;
+        for (u32 x = length; x-- > 0; )
+        {
+            write_code(output, base + x, history[x][n].code);
+            n = history[x][n].parent;
+        }
+
+        start = history[length - 1][0];
+        start.error = 0;
+    }
+
+    free(counts);
+    free(history);
+}
+
+// Compresses a sample with IMA-ADPCM.
+// Make sure the data has proper alignment/length!
+void adpcm_compress_sample(Sample *sample)
+{
+    // Allocate space for sample (compressed size)
+    u8 *output = calloc(sample->sample_length / 2 + 4, 1);
+
+    // Determine best (or close to best) initial table value
+
+    int prev_value = read_sample(sample, 0);
+    int index = 0;
+
+    if (sample->sample_length > 1)
+    {
+        int smallest_error = 9999999;
+
+        int diff = abs(read_sample(sample, 1) - read_sample(sample, 0));
+
+        for (int i = 0; i < 89; i++)
+        {
+            int tmp_error = abs(calc_delta(diff, AdpcmTable[i]) - diff);
+            if (tmp_error < smallest_error)
+            {
+                smallest_error = tmp_error;
+                index = i;
+            }
+        }
+    }
+
+    // Set data header
+
+    output[0] = prev_value & 0xFF; // Initial PCM16 value
+    output[1] = (prev_value >> 8) & 0xFF;
+    output[2] = index;             // Initial table index value
+    output[3] = 0;
+
+    if (adpcm_trellis)
+        encode_trellis(sample, output, prev_value, index);
+    else
+        encode_greedy(sample, output, prev_value, index);
+
     // Delete old sample
     free(sample->data);
 
@@ -209,3 +367,20 @@ void adpcm_compress_sample(Sample *sample)
     sample->loop_start += 4;
     sample->loop_end += 4;
 }
+
+// Decodes "length" samples of IMA-ADPCM data created by adpcm_compress_sample()
+// (header included) as signed 16-bit values.
+void adpcm_decode_sample(const u8 *data, u32 length, s16 *output)
+{
+    int value = (s16)(data[0] | (data[1] << 8));
+    int index = minmax(data[2] & 0x7F, 0, 88);
+
+    for (u32 x = 0; x < length; x++)
+    {
+        int code = (data[(x >> 1) + 4] >> ((x & 1) * 4)) & 0xF;
+
+        decode_code(code, &value, &index);
+
+        output[x] = value;
+    }
+}
@@ -13,6 +13,11 @@
 #ifndef ADPCM_H__
 #define ADPCM_H__
 
+// If set, samples are compressed with a trellis search that minimizes the
+// error of the decoded sample instead of picking the closest code each time.
+extern bool adpcm_trellis;
+
 void adpcm_compress_sample(Sample *sample);
+void adpcm_decode_sample(const u8 *data, u32 length, s16 *output);
 
 #endif // ADPCM_H__
@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+// Cache of converted input files. Each entry is stored in a separate file in
+// the cache directory, and its name is the key of the entry. Entries are never
+// modified after being created, so several instances of mmutil can share the
+// same cache directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "defs.h"
+#include "cache.h"
+#include "mas.h"
+#include "adpcm.h"
+#include "samplefix.h"
+#include "simple.h"
+#include "systems.h"
+#include "version.h"
+
+// Increase this when the format of the entries or the conversion code changes
+#define CACHE_FORMAT_VERSION 6
+
+#define CACHE_MAGIC "MMCACHE"
+
+// Magic, key of the entry and checksum of the contents
+#define CACHE_HEADER_SIZE (8 + 16 + 8)
+
+// Entries are checked when they are loaded in case they have been corrupted
+#define CACHE_CHECKSUM_SEED 0x4D4D43414348454BULL
+
+static char *cache_dir = NULL;
+
+void cache_init(const char *dir)
+{
+    free(cache_dir);
+    cache_dir = NULL;
+
+    if (dir == NULL || dir[0] == 0)
+        return;
+
+#ifdef _WIN32
+    _mkdir(dir);
+#else
+    mkdir(dir, 0777);
+#endif
+
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        printf("Can't use cache directory: %s\n", dir);
+        return;
+    }
+
+    cache_dir = strdup(dir);
+}
+
+bool cache_enabled(void)
+{
+    return cache_dir != NULL;
+}
+
+// The options string contains the settings specific to this file (like the
+// ones set in manifest files).
+CacheKey cache_key(const void *data, size_t size, int type, const char *options)
+{
+    char settings[256];
+    CacheKey key;
+
+    // Everything that can change the result of converting a file must be here
+    snprintf(settings, sizeof(settings), "%d|%s|%d|%d|%d|%d|%d|%d|%d|%d|%d|%d|%u|%s",
+             CACHE_FORMAT_VERSION, VERSION_STRING, MAS_VERSION, type,
+             target_system, ignore_sflags ? 1 : 0, strip_unused ? 1 : 0,
+             downsample_notes ? 1 : 0, trim_samples ? 1 : 0,
+             fix_resample_sinc ? 1 : 0, adpcm_trellis ? 1 : 0, PANNING_SEP,
+             (unsigned int)fix_max_rate, options);
+
+    u64 seed = hash_data(settings, strlen(settings), 0);
+
+    key.hash[0] = hash_data(data, size, seed);
+    key.hash[1] = hash_data(data, size, ~seed * 0x9E3779B97F4A7C15ULL);
+
+    return key;
+}
+
+static void cache_put64(u8 *dst, u64 value)
+{
+    for (int i = 0; i < 8; i++)
+        dst[i] = value >> (i * 8);
+}
+
+static void cache_make_header(u8 *header, const CacheKey *key,
+                              const void *data, size_t size)
+{
+    memcpy(header, CACHE_MAGIC, 8);
+    cache_put64(&header[8], key->hash[0]);
+    cache_put64(&header[16], key->hash[1]);
+    cache_put64(&header[24], hash_data(data, size, CACHE_CHECKSUM_SEED));
+}
+
+static char *cache_entry_path(const CacheKey *key)
+{
+    size_t len = strlen(cache_dir) + 1 + 32 + 4 + 1;
+    char *path = malloc(len);
+    if (path == NULL)
+        return NULL;
+
+    snprintf(path, len, "%s/%016llx%016llx.mmc", cache_dir,
+             (unsigned long long)key->hash[0], (unsigned long long)key->hash[1]);
+
+    return path;
+}
+
+// Returns the contents of the entry (without the header), or NULL if there is
+// no valid entry for this key. The caller must free the buffer.
+u8 *cache_load(const CacheKey *key, size_t *size)
+{
+    char *path = cache_entry_path(key);
+    if (path == NULL)
+        return NULL;
+
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (f == NULL)
+        return NULL;
+
+    u8 header[CACHE_HEADER_SIZE];
+    u8 expected[CACHE_HEADER_SIZE];
+    u8 *data = NULL;
+
+    if (fread(header, 1, sizeof(header), f) != sizeof(header))
+        goto fail;
+
+    if (fseek(f, 0, SEEK_END) != 0)
+        goto fail;
+
+    long end = ftell(f);
+    if (end < (long)sizeof(header))
+        goto fail;
+
+    *size = end - sizeof(header);
+    data = malloc(*size + 1);
+    if (data == NULL)
+        goto fail;
+
+    if (fseek(f, sizeof(header), SEEK_SET) != 0)
+        goto fail;
+
+    if (fread(data, 1, *size, f) != *size)
+        goto fail;
+
+    cache_make_header(expected, key, data, *size);
+    if (memcmp(header, expected, sizeof(header)) != 0)
+        goto fail;
+
+    fclose(f);
+    return data;
+
+fail:
+    free(data);
+    fclose(f);
+    return NULL;
+}
+
+// The entry is written to a temporary file and renamed when it's complete, so
+// other processes never see entries that are only partially written.
+void cache_store(const CacheKey *key, const void *data, size_t size)
+{
+    char *path = cache_entry_path(key);
+    if (path == NULL)
+        return;
+
+    size_t len = strlen(path) + 8;
+    char *tmp_path = malloc(len);
+    if (tmp_path == NULL)
+    {
+        free(path);
+        return;
+    }
+    snprintf(tmp_path, len, "%sXXXXXX", path);
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1)
+        goto end;
+
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL)
+    {
+        close(fd);
+        remove(tmp_path);
+        goto end;
+    }
+
+    u8 header[CACHE_HEADER_SIZE];
+    cache_make_header(header, key, data, size);
+
+    bool ok = (fwrite(header, 1, sizeof(header), f) == sizeof(header)) &&
+              (fwrite(data, 1, size, f) == size);
+
+    if (fclose(f) != 0)
+        ok = false;
+
+    if (ok)
+    {
+#ifdef _WIN32
+        // rename() fails on Windows if the destination exists
+        remove(path);
+#endif
+        if (rename(tmp_path, path) != 0)
+            ok = false;
+    }
+
+    if (!ok)
+        remove(tmp_path);
+
+end:
+    free(tmp_path);
+    free(path);
+}
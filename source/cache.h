@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+#ifndef CACHE_H__
+#define CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "deftypes.h"
+
+// Key of an entry of the conversion cache. It's calculated from the contents
+// of the input file and all the settings that affect how it's converted.
+typedef struct tCacheKey
+{
+    u64 hash[2];
+}
+CacheKey;
+
+void cache_init(const char *dir);
+bool cache_enabled(void);
+CacheKey cache_key(const void *data, size_t size, int type, const char *options);
+u8 *cache_load(const CacheKey *key, size_t *size);
+void cache_store(const CacheKey *key, const void *data, size_t size);
+
+#endif // CACHE_H__
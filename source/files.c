@@ -12,25 +12,22 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "defs.h"
 #include "files.h"
 
-static FILE *fin;
-static FILE *fout;
-
-static int file_byte_count;
-
-// Only report read errors once per file
-static bool read_error_reported = false;
-
 bool file_exists(char *filename)
 {
-    fin = fopen(filename, "rb");
-    if (!fin)
+    FILE *f = fopen(filename, "rb");
+    if (!f)
         return false;
 
-    file_close_read();
+    fclose(f);
     return true;
 }
 
@@ -49,230 +46,326 @@ int file_size(char *filename)
     return a;
 }
 
-int file_open_read(char *filename)
+int file_open_read(char *filename, FileReader *fr)
 {
-    fin = fopen(filename, "rb");
-    if (!fin)
+    FILE *f = fopen(filename, "rb");
+    if (!f)
     {
         printf("Can't open file for reading: %s\n", filename);
         exit(EXIT_FAILURE);
     }
 
-    read_error_reported = false;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (size < 0)
+    {
+        printf("Can't check size of file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    fr->data = NULL;
+    fr->size = size;
+    fr->pos = 0;
+    fr->mapped = false;
+    fr->error_reported = false;
+
+#ifndef _WIN32
+    if (size > 0)
+    {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (map != MAP_FAILED)
+        {
+            fr->data = map;
+            fr->mapped = true;
+        }
+    }
+#endif
+
+    // Fall back to reading the whole file with one call if it can't be mapped
+    if (!fr->mapped)
+    {
+        fr->data = malloc(size > 0 ? size : 1);
+        if (fr->data == NULL)
+        {
+            printf("Not enough memory to load file: %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+
+        if (fread(fr->data, 1, size, f) != (size_t)size)
+        {
+            printf("Can't read file: %s\n", filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    fclose(f);
+
     printf("File opened for reading: %s\n", filename);
 
     return FILE_OPEN_OKAY;
 }
 
-int file_open_write(char *filename)
+static void file_writer_init(FileWriter *fw, FILE *file)
+{
+    fw->data = NULL;
+    fw->size = 0;
+    fw->capacity = 0;
+    fw->pos = 0;
+    fw->file = file;
+    fw->byte_count = 0;
+}
+
+void file_write_grow(FileWriter *fw, size_t size)
 {
-    fout = fopen(filename, "wb");
-    if (!fout)
+    size_t capacity = fw->capacity > 0 ? fw->capacity : 64 * 1024;
+
+    while (capacity < fw->pos + size)
+        capacity *= 2;
+
+    u8 *data = realloc(fw->data, capacity);
+    if (data == NULL)
     {
-        printf("Can't open file for writing: %s\n", filename);
+        printf("Not enough memory for output buffer\n");
         exit(EXIT_FAILURE);
     }
 
-    printf("File opened for writing: %s\n", filename);
-
-    return FILE_OPEN_OKAY;
+    fw->data = data;
+    fw->capacity = capacity;
 }
 
-int file_open_write_end(char *filename)
+int file_open_write(char *filename, FileWriter *fw)
 {
-    fout = fopen(filename, "r+b");
-    if (!fout)
+    FILE *f = fopen(filename, "wb");
+    if (!f)
     {
-        printf("Can't open file for appending: %s\n", filename);
+        printf("Can't open file for writing: %s\n", filename);
         exit(EXIT_FAILURE);
     }
 
-    fseek(fout, 0, SEEK_END);
+    file_writer_init(fw, f);
 
-    // This is too verbose to be enabled. Temporary files are opened in append
-    // mode many times, so this ends up being printed on the terminal a lot.
-    //printf("File opened for appending: %s\n", filename);
+    printf("File opened for writing: %s\n", filename);
 
     return FILE_OPEN_OKAY;
 }
 
-void file_close_read(void)
+void file_close_read(FileReader *fr)
 {
-    fclose(fin);
+#ifndef _WIN32
+    if (fr->mapped)
+        munmap(fr->data, fr->size);
+    else
+#endif
+        free(fr->data);
+
+    fr->data = NULL;
+    fr->size = 0;
+    fr->pos = 0;
 }
 
-void file_close_write(void)
+void file_open_write_buffer(FileWriter *fw)
 {
-    fclose(fout);
+    file_writer_init(fw, NULL);
 }
 
-int file_seek_read(int offset, int mode)
+void file_close_write(FileWriter *fw)
 {
-    return fseek(fin, offset, mode);
-}
+    if (fwrite(fw->data, 1, fw->size, fw->file) != fw->size)
+    {
+        printf("Can't write output file\n");
+        exit(EXIT_FAILURE);
+    }
 
-int file_seek_write(int offset, int mode)
-{
-    return fseek(fout, offset, mode);
-}
+    fclose(fw->file);
+    free(fw->data);
 
-int file_tell_read(void)
-{
-    return ftell(fin);
+    file_writer_init(fw, NULL);
 }
 
-int file_tell_write(void)
+// Closes a buffer opened with file_open_write_buffer() and returns it. The
+// caller is responsible for freeing it.
+u8 *file_close_write_buffer(size_t *size, FileWriter *fw)
 {
-    return ftell(fout);
-}
+    u8 *data = fw->data;
+    *size = fw->size;
 
-int file_tell_size(void)
-{
-    int pos = ftell(fin);
-    fseek(fin, 0, SEEK_END);
-    int size = ftell(fin);
-    fseek(fin, pos, SEEK_SET);
-    return size;
-}
+    file_writer_init(fw, NULL);
 
-// The following functions are used to read from music files that may have small
-// format issues. Some games depend on those broken files, so let's just print
-// an error message (and return 0 instead of an undefined value) to warn the
-// developers.
+    return data;
+}
 
-u8 read8(void)
+// Writes a file only if its current contents are different, so that its
+// modification time doesn't change if the contents are the same (build systems
+// won't rebuild the files that depend on it). Returns true if the file has been
+// written.
+bool file_write_if_changed(char *filename, const void *data, size_t size)
 {
-    u8 a;
-    if (fread(&a, 1, 1, fin) != 1)
+    FILE *f = fopen(filename, "rb");
+    if (f != NULL)
     {
-        if (!read_error_reported)
+        bool same = true;
+        size_t pos = 0;
+        u8 buffer[4096];
+
+        while (same)
         {
-            read_error_reported = true;
-            printf("ERROR: Can't read input file\n");
+            size_t count = fread(buffer, 1, sizeof(buffer), f);
+            if (count == 0)
+                break;
+
+            if (count > size - pos || memcmp(buffer, (const u8 *)data + pos, count) != 0)
+                same = false;
+
+            pos += count;
         }
-        return 0;
+
+        fclose(f);
+
+        if (same && pos == size)
+            return false;
     }
-    return a;
-}
 
-u16 read16(void)
-{
-    u16 a;
-    a  = read8();
-    a |= ((u16)read8()) << 8;
-    return a;
-}
+    f = fopen(filename, "wb");
+    if (f == NULL)
+    {
+        printf("Can't open file for writing: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
 
-u32 read24(void)
-{
-    u32 a;
-    a  = read8();
-    a |= ((u32)read8()) << 8;
-    a |= ((u32)read8()) << 16;
-    return a;
+    if (fwrite(data, 1, size, f) != size)
+    {
+        printf("Can't write file: %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(f);
+
+    return true;
 }
 
-u32 read32(void)
+int file_seek_read(int offset, int mode, FileReader *fr)
 {
-    u32 a;
-    a  = read16();
-    a |= ((u32)read16()) << 16;
-    return a;
+    // Like fseek(), this allows seeking past the end of the file. Any read
+    // after that will fail.
+    long base;
+
+    if (mode == SEEK_SET)
+        base = 0;
+    else if (mode == SEEK_CUR)
+        base = fr->pos;
+    else if (mode == SEEK_END)
+        base = fr->size;
+    else
+        return -1;
+
+    if (base + offset < 0)
+        return -1;
+
+    fr->pos = base + offset;
+    return 0;
 }
 
-// The following functions are currently used to generate MSL files, so the
-// files are expected to be created properly, and we can crash on any error we
-// find.
 
-u8 read8f(FILE *p_fin)
+int file_tell_read(FileReader *fr)
 {
-    u8 a;
-    if (fread(&a, 1, 1, p_fin) != 1)
-    {
-        printf("Unable to read file\n");
-        exit(EXIT_FAILURE);
-    }
-    return a;
+    return fr->pos;
 }
 
-u16 read16f(FILE *p_fin)
+int file_tell_write(FileWriter *fw)
 {
-    u16 a;
-    a  = read8f(p_fin);
-    a |= ((u16)read8f(p_fin)) << 8;
-    return a;
+    return fw->pos;
 }
 
-u32 read32f(FILE *p_fin)
+int file_tell_size(FileReader *fr)
 {
-    u32 a;
-    a  = read16f(p_fin);
-    a |= ((u32)read16f(p_fin)) << 16;
-    return a;
+    return fr->size;
 }
 
-void write8(u8 p_v)
+// Called by the read functions when they try to read past the end of the file.
+// Only report read errors once per file.
+u8 file_read_error(FileReader *fr)
 {
-    fwrite(&p_v, 1, 1, fout);
-    file_byte_count++;
+    if (!fr->error_reported)
+    {
+        fr->error_reported = true;
+        printf("ERROR: Can't read input file\n");
+    }
+    return 0;
 }
 
-void write16(u16 p_v)
+// Discard everything written after "offset". It must only be used when writing
+// at the end of the buffer.
+void file_truncate_write(int offset, FileWriter *fw)
 {
-    write8(p_v & 0xFF);
-    write8(p_v >> 8);
-    file_byte_count += 2;
+    fw->byte_count -= fw->size - offset;
+    fw->size = offset;
+    fw->pos = offset;
 }
 
-void write24( u32 p_v )
+void write_bytes(const void *data, size_t size, FileWriter *fw)
 {
-    write8(p_v & 0xFF);
-    write8((p_v >> 8) & 0xFF);
-    write8((p_v >> 16) & 0xFF);
-    file_byte_count += 3;
+    if (size == 0)
+        return;
+
+    memcpy(write_reserve(size, fw), data, size);
 }
 
-void write32(u32 p_v)
+// The following functions overwrite data that has already been written to the
+// output buffer (like headers that depend on the size of the data after them).
+// The offset is an offset in the file, like the one returned by
+// file_tell_write().
+
+void write_patch16(int offset, u16 p_v, FileWriter *fw)
 {
-    write16(p_v & 0xFFFF);
-    write16(p_v >> 16);
-    file_byte_count += 4;
+    u8 *p = &fw->data[offset];
+    p[0] = p_v & 0xFF;
+    p[1] = p_v >> 8;
 }
 
-void align16(void)
+void write_patch32(int offset, u32 p_v, FileWriter *fw)
 {
-    if (ftell(fout) & 1)
-        write8(BYTESMASHER);
+    u8 *p = &fw->data[offset];
+    p[0] = p_v & 0xFF;
+    p[1] = (p_v >> 8) & 0xFF;
+    p[2] = (p_v >> 16) & 0xFF;
+    p[3] = p_v >> 24;
 }
 
-void align32(void)
+void align16(FileWriter *fw)
 {
-    if (ftell(fout) & 3)
-        write8(BYTESMASHER);
-    if (ftell(fout) & 3)
-        write8(BYTESMASHER);
-    if (ftell(fout) & 3)
-        write8(BYTESMASHER);
+    if (file_tell_write(fw) & 1)
+        write8(BYTESMASHER, fw);
 }
 
-void align32f(FILE *p_file)
+void align32(FileWriter *fw)
 {
-    if (ftell(p_file) & 3)
-        write8(BYTESMASHER);
-    if (ftell(p_file) & 3)
-        write8(BYTESMASHER);
-    if (ftell(p_file) & 3)
-        write8(BYTESMASHER);
+    while (file_tell_write(fw) & 3)
+        write8(BYTESMASHER, fw);
 }
 
-void skip8(u32 count)
+// Copies "size" bytes of the input file. If the file ends before that, the
+// missing bytes are set to 0 and the error is reported, like with read8().
+void read_bytes(void *data, size_t size, FileReader *fr)
 {
-    fseek(fin, count, SEEK_CUR);
+    size_t available = (fr->pos < fr->size) ? fr->size - fr->pos : 0;
+    size_t count = (size < available) ? size : available;
+
+    if (count > 0)
+        memcpy(data, &fr->data[fr->pos], count);
+    fr->pos += count;
+
+    if (count < size)
+    {
+        memset((u8 *)data + count, 0, size - count);
+        file_read_error(fr);
+    }
 }
 
-void skip8f(u32 count, FILE *p_file)
+void skip8(u32 count, FileReader *fr)
 {
-    fseek(p_file, count, SEEK_CUR);
+    fr->pos += count;
 }
 
 void file_delete(char *filename)
@@ -281,9 +374,9 @@ void file_delete(char *filename)
         remove(filename);
 }
 
-int file_get_byte_count(void)
+int file_get_byte_count(FileWriter *fw)
 {
-    int a = file_byte_count;
-    file_byte_count = 0;
+    int a = fw->byte_count;
+    fw->byte_count = 0;
     return a;
 }
@@ -13,45 +13,175 @@
 #ifndef FILES_H__
 #define FILES_H__
 
+#include <stddef.h>
 #include <stdio.h>
 
+#include "deftypes.h"
+
+// Input files are loaded in memory in one go (mapped when the OS allows it)
+// instead of being read byte by byte with fread().
+typedef struct tFileReader
+{
+    u8     *data;
+    size_t  size;
+    size_t  pos;
+    bool    mapped;
+    bool    error_reported;
+}
+FileReader;
+
+// Output files are built in a growable memory buffer. The buffer is written to
+// the file with one call when it's closed, or it can be handed to the caller.
+typedef struct tFileWriter
+{
+    u8     *data;
+    size_t  size;       // Size of the data written to the buffer
+    size_t  capacity;   // Size of the allocated buffer
+    size_t  pos;        // Write position in the buffer
+    FILE   *file;       // Destination file (NULL for memory buffers)
+    int     byte_count;
+}
+FileWriter;
+
+u8 file_read_error(FileReader *fr);
+void file_write_grow(FileWriter *fw, size_t size);
+
 int file_size(char *filename);
-int file_open_read(char *filename);
-int file_open_write(char *filename);
-int file_open_write_end(char *filename);
-void file_close_read(void);
-void file_close_write(void);
-u8 read8(void);
-u16 read16(void);
-u32 read24(void);
-u32 read32(void);
-void write8(u8 p_v);
-void write16(u16 p_v);
-void write24(u32 p_v);
-void write32(u32 p_v);
-void align16(void);
-void align32(void);
-void skip8(u32 count);
-int file_seek_read(int offset, int mode);
-int file_seek_write(int offset, int mode);
-int file_tell_read(void);
-int file_tell_write(void);
-
-u8 read8f(FILE *p_fin);
-u16 read16f(FILE *p_fin);
-u32 read32f(FILE *p_fin);
-void align32f(FILE *p_file);
-void skip8f(u32 count, FILE *p_file);
+int file_open_read(char *filename, FileReader *fr);
+int file_open_write(char *filename, FileWriter *fw);
+void file_open_write_buffer(FileWriter *fw);
+void file_close_read(FileReader *fr);
+void file_close_write(FileWriter *fw);
+u8 *file_close_write_buffer(size_t *size, FileWriter *fw);
+bool file_write_if_changed(char *filename, const void *data, size_t size);
+void write_bytes(const void *data, size_t size, FileWriter *fw);
+void file_truncate_write(int offset, FileWriter *fw);
+void write_patch16(int offset, u16 p_v, FileWriter *fw);
+void write_patch32(int offset, u32 p_v, FileWriter *fw);
+void align16(FileWriter *fw);
+void align32(FileWriter *fw);
+void read_bytes(void *data, size_t size, FileReader *fr);
+void skip8(u32 count, FileReader *fr);
+int file_seek_read(int offset, int mode, FileReader *fr);
+int file_tell_read(FileReader *fr);
+int file_tell_write(FileWriter *fw);
 
 void file_delete(char *filename);
 
 bool file_exists(char *filename);
 
-int file_get_byte_count(void);
+int file_get_byte_count(FileWriter *fw);
 
-int file_tell_size(void);
+int file_tell_size(FileReader *fr);
 
 #define FILE_OPEN_OKAY      0
 #define FILE_OPEN_ERROR    -1
 
+// The following functions are used to read from music files that may have
+// small format issues. Some games depend on those broken files, so let's just
+// print an error message (and return 0 instead of an undefined value) to warn
+// the developers.
+
+static inline u8 read8(FileReader *fr)
+{
+    if (fr->pos < fr->size)
+        return fr->data[fr->pos++];
+
+    return file_read_error(fr);
+}
+
+static inline u16 read16(FileReader *fr)
+{
+    if (fr->pos + 2 <= fr->size)
+    {
+        const u8 *p = &fr->data[fr->pos];
+        fr->pos += 2;
+        return p[0] | (p[1] << 8);
+    }
+
+    u16 a;
+    a  = read8(fr);
+    a |= ((u16)read8(fr)) << 8;
+    return a;
+}
+
+static inline u32 read24(FileReader *fr)
+{
+    if (fr->pos + 3 <= fr->size)
+    {
+        const u8 *p = &fr->data[fr->pos];
+        fr->pos += 3;
+        return p[0] | (p[1] << 8) | ((u32)p[2] << 16);
+    }
+
+    u32 a;
+    a  = read8(fr);
+    a |= ((u32)read8(fr)) << 8;
+    a |= ((u32)read8(fr)) << 16;
+    return a;
+}
+
+static inline u32 read32(FileReader *fr)
+{
+    if (fr->pos + 4 <= fr->size)
+    {
+        const u8 *p = &fr->data[fr->pos];
+        fr->pos += 4;
+        return p[0] | (p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+    }
+
+    u32 a;
+    a  = read16(fr);
+    a |= ((u32)read16(fr)) << 16;
+    return a;
+}
+
+// Make sure that there is space for "size" bytes at the current write position
+// of the output buffer and return a pointer to it.
+static inline u8 *write_reserve(size_t size, FileWriter *fw)
+{
+    if (fw->pos + size > fw->capacity)
+        file_write_grow(fw, size);
+
+    u8 *p = &fw->data[fw->pos];
+
+    fw->pos += size;
+    if (fw->pos > fw->size)
+        fw->size = fw->pos;
+
+    fw->byte_count += size;
+
+    return p;
+}
+
+static inline void write8(u8 p_v, FileWriter *fw)
+{
+    u8 *p = write_reserve(1, fw);
+    p[0] = p_v;
+}
+
+static inline void write16(u16 p_v, FileWriter *fw)
+{
+    u8 *p = write_reserve(2, fw);
+    p[0] = p_v & 0xFF;
+    p[1] = p_v >> 8;
+}
+
+static inline void write24(u32 p_v, FileWriter *fw)
+{
+    u8 *p = write_reserve(3, fw);
+    p[0] = p_v & 0xFF;
+    p[1] = (p_v >> 8) & 0xFF;
+    p[2] = (p_v >> 16) & 0xFF;
+}
+
+static inline void write32(u32 p_v, FileWriter *fw)
+{
+    u8 *p = write_reserve(4, fw);
+    p[0] = p_v & 0xFF;
+    p[1] = (p_v >> 8) & 0xFF;
+    p[2] = (p_v >> 16) & 0xFF;
+    p[3] = p_v >> 24;
+}
+
 #endif // FILES_H__
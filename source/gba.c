@@ -19,9 +19,8 @@ const u8 GBA_ROM[] = {
 #embed "maxmod_demo.gba"
 };
 
-void Write_GBA(void)
+void Write_GBA(FileWriter *fw)
 {
-    for (size_t x = 0; x < sizeof(GBA_ROM); x++)
-        write8(GBA_ROM[x]);
+    write_bytes(GBA_ROM, sizeof(GBA_ROM), fw);
 }
 
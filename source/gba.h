@@ -13,6 +13,6 @@
 #ifndef GBA_H__
 #define GBA_H__
 
-void Write_GBA(void);
+void Write_GBA(FileWriter *fw);
 
 #endif // GBA_H__
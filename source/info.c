@@ -0,0 +1,415 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+// Information about input files (--info). Only the headers and patterns of the
+// files are loaded, the sample data is skipped and nothing is converted, so
+// this is much faster than building a soundbank.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "mas.h"
+#include "info.h"
+#include "errors.h"
+#include "files.h"
+#include "simple.h"
+#include "samplefix.h"
+#include "mod.h"
+#include "s3m.h"
+#include "xm.h"
+#include "it.h"
+#include "wav.h"
+
+typedef struct tInfo_Stats
+{
+    int     orders;
+    int     rows;
+    int     unused_patterns;
+    int     channels;
+    u32     sample_bytes;
+}
+Info_Stats;
+
+static const char *info_types[] = { "mod", "s3m", "xm", "it", "wav" };
+
+static void Info_Printf(FileWriter *fw, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(line))
+        len = sizeof(line) - 1;
+
+    write_bytes(line, len, fw);
+}
+
+// Names in modules aren't always ASCII, and they are treated as Latin-1
+static void Info_WriteJSONString(const char *str, FileWriter *fw)
+{
+    write8('"', fw);
+
+    for (const u8 *c = (const u8 *)str; *c != 0; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            write8('\\', fw);
+            write8(*c, fw);
+        }
+        else if (*c < 0x20 || *c >= 0x7F)
+        {
+            Info_Printf(fw, "\\u%04x", *c);
+        }
+        else
+        {
+            write8(*c, fw);
+        }
+    }
+
+    write8('"', fw);
+}
+
+static u32 Info_SampleBytes(const Sample *samp)
+{
+    return samp->sample_length * ((samp->format & SAMPF_16BIT) ? 2 : 1);
+}
+
+static const char *Info_LoopName(u8 loop_type)
+{
+    if (loop_type == 1)
+        return "forward";
+    else if (loop_type == 2)
+        return "bidi";
+    else
+        return "none";
+}
+
+static void Info_GetStats(const MAS_Module *mod, Info_Stats *stats)
+{
+    bool used_patt[256] = { 0 };
+    bool used_chan[MAX_CHANNELS] = { 0 };
+
+    memset(stats, 0, sizeof(Info_Stats));
+
+    // The rows of the patterns in the order list, without following jumps
+    for (int x = 0; x < mod->order_count; x++)
+    {
+        u8 patt = mod->orders[x];
+
+        if (patt == 255)
+            break;
+        if (patt == 254)
+            continue;
+
+        stats->orders++;
+        if (patt < mod->patt_count)
+        {
+            used_patt[patt] = true;
+            stats->rows += mod->patterns[patt].nrows;
+        }
+    }
+
+    for (int x = 0; x < mod->patt_count; x++)
+    {
+        const Pattern *patt = &mod->patterns[x];
+
+        if (!used_patt[x])
+            stats->unused_patterns++;
+
+        for (int r = 0; r < patt->nrows; r++)
+        {
+            for (int c = 0; c < patt->nchannels && c < MAX_CHANNELS; c++)
+            {
+                if (patt->data[r * patt->nchannels + c].note != 250)
+                    used_chan[c] = true;
+            }
+        }
+    }
+
+    for (int c = 0; c < MAX_CHANNELS; c++)
+    {
+        if (used_chan[c])
+            stats->channels++;
+    }
+
+    for (int x = 0; x < mod->samp_count; x++)
+        stats->sample_bytes += Info_SampleBytes(&mod->samples[x]);
+}
+
+static void Info_WriteSamplesText(const Sample *samples, int count, FileWriter *fw)
+{
+    Info_Printf(fw, "  %3s  %-10s %-4s %-8s %-21s %s\n",
+                "#", "Length", "Bits", "Rate", "Loop", "Name");
+
+    for (int x = 0; x < count; x++)
+    {
+        const Sample *samp = &samples[x];
+        char loop[32] = "none";
+
+        if (samp->loop_type)
+        {
+            snprintf(loop, sizeof(loop), "%s %u-%u", Info_LoopName(samp->loop_type),
+                     (unsigned int)samp->loop_start, (unsigned int)samp->loop_end);
+        }
+
+        Info_Printf(fw, "  %3d  %-10u %-4d %-8u %-21s %s\n", x + 1,
+                    (unsigned int)samp->sample_length,
+                    (samp->format & SAMPF_16BIT) ? 16 : 8,
+                    (unsigned int)samp->frequency, loop, samp->name);
+    }
+}
+
+static void Info_WriteSamplesJSON(const Sample *samples, int count, FileWriter *fw)
+{
+    Info_Printf(fw, "    \"samples\": [");
+
+    for (int x = 0; x < count; x++)
+    {
+        const Sample *samp = &samples[x];
+
+        Info_Printf(fw, "%s\n      {\n        \"index\": %d,\n        \"name\": ",
+                    x == 0 ? "" : ",", x + 1);
+        Info_WriteJSONString(samp->name, fw);
+        Info_Printf(fw, ",\n        \"length\": %u,\n", (unsigned int)samp->sample_length);
+        Info_Printf(fw, "        \"bits\": %d,\n", (samp->format & SAMPF_16BIT) ? 16 : 8);
+        Info_Printf(fw, "        \"rate\": %u,\n", (unsigned int)samp->frequency);
+        Info_Printf(fw, "        \"loop\": \"%s\",\n", Info_LoopName(samp->loop_type));
+        Info_Printf(fw, "        \"loop_start\": %u,\n", (unsigned int)samp->loop_start);
+        Info_Printf(fw, "        \"loop_end\": %u,\n", (unsigned int)samp->loop_end);
+        Info_Printf(fw, "        \"bytes\": %u\n      }", (unsigned int)Info_SampleBytes(samp));
+    }
+
+    Info_Printf(fw, "%s]\n", count == 0 ? "" : "\n    ");
+}
+
+static void Info_WriteModule(const char *filename, int type, const MAS_Module *mod,
+                             bool json, FileWriter *fw)
+{
+    Info_Stats stats;
+    Info_GetStats(mod, &stats);
+
+    if (json)
+    {
+        Info_WriteJSONString(filename, fw);
+        Info_Printf(fw, ",\n    \"type\": \"%s\",\n    \"title\": ", info_types[type]);
+        Info_WriteJSONString(mod->title, fw);
+        Info_Printf(fw, ",\n    \"orders\": %d,\n", stats.orders);
+        Info_Printf(fw, "    \"rows\": %d,\n", stats.rows);
+        Info_Printf(fw, "    \"patterns\": %d,\n", mod->patt_count);
+        Info_Printf(fw, "    \"unused_patterns\": %d,\n", stats.unused_patterns);
+        Info_Printf(fw, "    \"channels\": %d,\n", stats.channels);
+        Info_Printf(fw, "    \"instruments\": %d,\n", mod->inst_count);
+        Info_Printf(fw, "    \"initial_speed\": %d,\n", mod->initial_speed);
+        Info_Printf(fw, "    \"initial_tempo\": %d,\n", mod->initial_tempo);
+        Info_Printf(fw, "    \"global_volume\": %d,\n", mod->global_volume);
+        Info_Printf(fw, "    \"sample_bytes\": %u,\n", (unsigned int)stats.sample_bytes);
+        Info_WriteSamplesJSON(mod->samples, mod->samp_count, fw);
+    }
+    else
+    {
+        Info_Printf(fw, "%s\n", filename);
+        Info_Printf(fw, "  Type..........%s\n", info_types[type]);
+        Info_Printf(fw, "  Title.........%s\n", mod->title);
+        Info_Printf(fw, "  Orders........%d (%d rows)\n", stats.orders, stats.rows);
+        Info_Printf(fw, "  Patterns......%d (%d unused)\n", mod->patt_count,
+                    stats.unused_patterns);
+        Info_Printf(fw, "  Channels......%d\n", stats.channels);
+        Info_Printf(fw, "  Instruments...%d\n", mod->inst_count);
+        Info_Printf(fw, "  Samples.......%d (%u bytes)\n", mod->samp_count,
+                    (unsigned int)stats.sample_bytes);
+        Info_Printf(fw, "  Speed.........%d\n", mod->initial_speed);
+        Info_Printf(fw, "  Tempo.........%d\n", mod->initial_tempo);
+        Info_Printf(fw, "  Volume........%d\n", mod->global_volume);
+        Info_WriteSamplesText(mod->samples, mod->samp_count, fw);
+    }
+}
+
+static void Info_WriteWAV(const char *filename, const Sample *samp, bool json,
+                          FileWriter *fw)
+{
+    if (json)
+    {
+        Info_WriteJSONString(filename, fw);
+        Info_Printf(fw, ",\n    \"type\": \"wav\",\n");
+        Info_Printf(fw, "    \"sample_bytes\": %u,\n", (unsigned int)Info_SampleBytes(samp));
+        Info_WriteSamplesJSON(samp, 1, fw);
+    }
+    else
+    {
+        Info_Printf(fw, "%s\n", filename);
+        Info_Printf(fw, "  Type..........wav\n");
+        Info_WriteSamplesText(samp, 1, fw);
+    }
+}
+
+// Loads the headers of an input file and writes its information. Returns false
+// if the file can't be loaded.
+static bool Info_WriteFile(char *filename, bool json, FileWriter *fw)
+{
+    int type = get_ext(filename);
+    const char *error = NULL;
+    FileReader fr;
+
+    if (json)
+        Info_Printf(fw, "  {\n    \"file\": ");
+
+    if (!file_exists(filename))
+    {
+        error = "can't open file";
+    }
+    else if (type > INPUT_TYPE_WAV)
+    {
+        error = "unsupported file type";
+    }
+    else if (type == INPUT_TYPE_WAV)
+    {
+        Sample wav;
+
+        file_open_read(filename, &fr);
+        if (Load_WAV(&wav, &fr, false, false) == LOADWAV_OK)
+            Info_WriteWAV(filename, &wav, json, fw);
+        else
+            error = "can't load file";
+        file_close_read(&fr);
+    }
+    else
+    {
+        MAS_Module mod = { 0 };
+        int ret = ERR_NONE;
+
+        file_open_read(filename, &fr);
+
+        if (type == INPUT_TYPE_MOD)
+            ret = Load_MOD(&mod, &fr, false);
+        else if (type == INPUT_TYPE_S3M)
+            ret = Load_S3M(&mod, &fr, false);
+        else if (type == INPUT_TYPE_XM)
+            ret = Load_XM(&mod, &fr, false);
+        else if (type == INPUT_TYPE_IT)
+            ret = Load_IT(&mod, &fr, false);
+
+        if (ret == ERR_NONE)
+        {
+            Info_WriteModule(filename, type, &mod, json, fw);
+            Delete_Module(&mod);
+        }
+        else
+        {
+            error = "can't load file";
+        }
+
+        file_close_read(&fr);
+    }
+
+    if (error != NULL)
+    {
+        if (json)
+        {
+            Info_WriteJSONString(filename, fw);
+            Info_Printf(fw, ",\n    \"error\": \"%s\"\n", error);
+        }
+        else
+        {
+            Info_Printf(fw, "%s\n  Error.........%s\n", filename, error);
+        }
+    }
+
+    if (json)
+        Info_Printf(fw, "  }");
+
+    return error == NULL;
+}
+
+// Writes the information of all the input files in the command line to the
+// output file, or to stdout if there is no output file. Returns 0 if all of
+// them could be loaded.
+int Info_Write(char *argv[], int argc, char *output, bool json)
+{
+    FileWriter fw;
+    bool ok = true;
+    bool first = true;
+
+    fix_lazy_load = true;
+
+    // The loaders print progress messages and warnings to stdout. When the
+    // information goes to stdout they are sent to stderr instead, so that they
+    // don't get mixed with it (and the JSON output can be parsed).
+    int stdout_fd = -1;
+    if (output == NULL)
+    {
+        fflush(stdout);
+        stdout_fd = dup(fileno(stdout));
+        if (stdout_fd != -1)
+            dup2(fileno(stderr), fileno(stdout));
+    }
+
+    file_open_write_buffer(&fw);
+
+    if (json)
+        Info_Printf(&fw, "[\n");
+
+    for (int a = 1; a < argc; a++)
+    {
+        if (argv[a][0] == '-')
+            continue;
+
+        if (json)
+            Info_Printf(&fw, first ? "" : ",\n");
+        else if (!first)
+            Info_Printf(&fw, "\n");
+        first = false;
+
+        if (!Info_WriteFile(argv[a], json, &fw))
+            ok = false;
+    }
+
+    if (json)
+        Info_Printf(&fw, "\n]\n");
+
+    size_t size;
+    u8 *data = file_close_write_buffer(&size, &fw);
+
+    if (stdout_fd != -1)
+    {
+        fflush(stdout);
+        dup2(stdout_fd, fileno(stdout));
+        close(stdout_fd);
+    }
+
+    if (output != NULL)
+    {
+        FILE *f = fopen(output, "wb");
+        if (f == NULL || fwrite(data, 1, size, f) != size)
+        {
+            printf("Can't write file: %s\n", output);
+            exit(EXIT_FAILURE);
+        }
+        fclose(f);
+    }
+    else
+    {
+        fwrite(data, 1, size, stdout);
+    }
+
+    free(data);
+
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+#ifndef INFO_H__
+#define INFO_H__
+
+#include <stdbool.h>
+
+int Info_Write(char *argv[], int argc, char *output, bool json);
+
+#endif // INFO_H__
@@ -57,7 +57,7 @@
 #define vstr_it_pattern " * %2i"
 #endif
 
-bool Load_IT_Envelope(Instrument_Envelope *env, bool unsign)
+bool Load_IT_Envelope(Instrument_Envelope *env, FileReader *fr, bool unsign)
 {
     // Read envelopes
 
@@ -68,7 +68,7 @@ bool Load_IT_Envelope(Instrument_Envelope *env, bool unsign)
 
     memset(env, 0, sizeof(Instrument_Envelope));
 
-    u8 a = read8();
+    u8 a = read8(fr);
 
     if (a & 1)
         env_enabled = true;
@@ -100,7 +100,7 @@ bool Load_IT_Envelope(Instrument_Envelope *env, bool unsign)
         env->env_filter = env_filter;
     }
 
-    u8 node_count = read8();
+    u8 node_count = read8(fr);
     if(node_count != 0)
         env->env_valid = true;
 
@@ -108,40 +108,40 @@ bool Load_IT_Envelope(Instrument_Envelope *env, bool unsign)
 
     if (env_loop)
     {
-        env->loop_start = read8();
-        env->loop_end = read8();
+        env->loop_start = read8(fr);
+        env->loop_end = read8(fr);
     }
     else
     {
-        skip8(2);
+        skip8(2, fr);
     }
 
     if (env_sus)
     {
-        env->sus_start = read8();
-        env->sus_end = read8();
+        env->sus_start = read8(fr);
+        env->sus_end = read8(fr);
     }
     else
     {
-        skip8(2);
+        skip8(2, fr);
     }
 
     for (int x = 0; x < 25; x++)
     {
-        env->node_y[x] = read8();
+        env->node_y[x] = read8(fr);
         if (unsign)
             env->node_y[x] += 32;
-        env->node_x[x] = read16();
+        env->node_x[x] = read16(fr);
 
     }
 
-    read8(); // Unused byte
+    read8(fr); // Unused byte
     env->env_enabled = env_enabled;
 
     return env_enabled;
 }
 
-int Load_IT_Instrument(Instrument *inst, bool verbose, int index)
+int Load_IT_Instrument(Instrument *inst, FileReader *fr, bool verbose, int index)
 {
     u16 a;
 
@@ -149,50 +149,50 @@ int Load_IT_Instrument(Instrument *inst, bool verbose, int index)
 
     inst->is_valid = true;
 
-    skip8(17);
+    skip8(17, fr);
 
-    inst->nna = read8();
-    inst->dct = read8();
-    inst->dca = read8();
+    inst->nna = read8(fr);
+    inst->dct = read8(fr);
+    inst->dca = read8(fr);
 
-    a = read16();
+    a = read16(fr);
     if (a > 255)
         a = 255;
     inst->fadeout = (u8)a;
 
-    skip8(2);
+    skip8(2, fr);
 
-    inst->global_volume = read8();
+    inst->global_volume = read8(fr);
 
-    a = read8();
+    a = read8(fr);
     a = (a & 128) | ((a & 127) * 2 > 127 ? 127 : (a & 127) * 2);
     inst->setpan = a ^ 128;
 
-    inst->random_volume = read8();
+    inst->random_volume = read8(fr);
 
-    skip8(5);
+    skip8(5, fr);
 
     for (int x = 0; x < 26; x++)
-        inst->name[x] = read8();
+        inst->name[x] = read8(fr);
 
-    skip8(6);
+    skip8(6, fr);
 
     for (int x = 0; x < 120; x++)
-        inst->notemap[x] = read16();
+        inst->notemap[x] = read16(fr);
 
     inst->env_flags = 0;
 
-    Load_IT_Envelope(&inst->envelope_volume, false);
+    Load_IT_Envelope(&inst->envelope_volume, fr, false);
     if (inst->envelope_volume.env_valid)
         inst->env_flags |= MAS_INSTR_FLAG_VOL_ENV_EXISTS;
     if (inst->envelope_volume.env_enabled)
         inst->env_flags |= MAS_INSTR_FLAG_VOL_ENV_ENABLED;
 
-    Load_IT_Envelope(&inst->envelope_pan, true);
+    Load_IT_Envelope(&inst->envelope_pan, fr, true);
     if (inst->envelope_pan.env_enabled)
         inst->env_flags |= MAS_INSTR_FLAG_PAN_ENV_EXISTS;
 
-    Load_IT_Envelope(&inst->envelope_pitch, true);
+    Load_IT_Envelope(&inst->envelope_pitch, fr, true);
     if (inst->envelope_pitch.env_enabled)
         inst->env_flags |= MAS_INSTR_FLAG_PITCH_ENV_EXISTS;
 
@@ -246,7 +246,7 @@ int Load_IT_Instrument(Instrument *inst, bool verbose, int index)
     */
     }
 
-    skip8(7);
+    skip8(7, fr);
     return 0;
 }
 
@@ -262,59 +262,59 @@ void Create_IT_Instrument(Instrument *inst, int sample)
         inst->notemap[x] = x + sample * 256;
 }
 
-int Load_IT_Sample(Sample *samp)
+int Load_IT_Sample(Sample *samp, FileReader *fr)
 {
     u8 a;
 
     memset(samp, 0, sizeof(Sample));
     samp->msl_index = 0xFFFF;
 
-    if (read32() != 'SPMI')
+    if (read32(fr) != 'SPMI')
         return ERR_UNKNOWNSAMPLE;
 
     for (int x = 0; x < 12; x++) // DOS filename
-        samp->filename[x] = read8();
+        samp->filename[x] = read8(fr);
 
-    if (read8() != 0)
+    if (read8(fr) != 0)
         return ERR_UNKNOWNSAMPLE;
 
-    samp->global_volume = read8();
-    a = read8();
+    samp->global_volume = read8(fr);
+    a = read8(fr);
     samp->it_compression = a & 8 ? 1 : 0;
 
     bool bit16 = a & 2;
     bool hasloop = a & 16;
     bool pingpong = a & 64;
 
-    samp->default_volume = read8();
+    samp->default_volume = read8(fr);
     for (int x = 0; x < 26; x++)
-        samp->name[x] = read8();
+        samp->name[x] = read8(fr);
 
     bool samp_unsigned = false;
-    a = read8();
-    samp->default_panning = read8();
+    a = read8(fr);
+    samp->default_panning = read8(fr);
     samp->default_panning = (((samp->default_panning & 127) == 64) ?
                 127 : (samp->default_panning << 1)) | (samp->default_panning & 128);
     if (!(a & 1))
         samp_unsigned = true;
 
-    u32 samp_length = read32();
-    u32 loop_start = read32();
-    u32 loop_end = read32();
-    u32 c5spd = read32();
+    u32 samp_length = read32(fr);
+    u32 loop_start = read32(fr);
+    u32 loop_end = read32(fr);
+    u32 c5spd = read32(fr);
 
     samp->frequency = c5spd;
     samp->sample_length = samp_length;
     samp->loop_start = loop_start;
     samp->loop_end = loop_end;
 
-    skip8(8); // Susloop start/end
+    skip8(8, fr); // Susloop start/end
 
-    u32 data_address = read32();
-    samp->vibspeed = read8();
-    samp->vibdepth = read8();
-    samp->vibrate = read8();
-    samp->vibtype = read8();
+    u32 data_address = read32(fr);
+    samp->vibspeed = read8(fr);
+    samp->vibdepth = read8(fr);
+    samp->vibrate = read8(fr);
+    samp->vibtype = read8(fr);
     samp->datapointer = data_address;
 
     if (hasloop)
@@ -339,55 +339,25 @@ int Load_IT_Sample(Sample *samp)
     return 0;
 }
 
-int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16);
+int Load_IT_Sample_CMP(u8 *p_dest_buffer, FileReader *fr, int samp_len, u16 cmwt, bool bit16);
 
-int Load_IT_SampleData(Sample *samp, u16 cwmt)
+int Load_IT_SampleData(Sample *samp, FileReader *fr, u16 cwmt)
 {
     if (samp->sample_length == 0)
         return 0;
 
-    if (samp->format & SAMPF_16BIT)
-        samp->data = (u16 *)malloc(((u32)samp->sample_length) * 2);
-    else
-        samp->data = (u8 *)malloc(samp->sample_length);
-
     if (!samp->it_compression)
     {
-        for (u32 x = 0; x < samp->sample_length; x++)
-        {
-            int a;
-
-            if (samp->format & SAMPF_16BIT)
-            {
-                if (!(samp->format & SAMPF_SIGNED))
-                {
-                    a = (unsigned short)read16();
-                }
-                else
-                {
-                    a = (signed short)read16();
-                    a += 32768;
-                }
-                ((u16 *)samp->data)[x] = (u16)a;
-            }
-            else
-            {
-                if (!(samp->format & SAMPF_SIGNED))
-                {
-                    a = (unsigned char)read8();
-                }
-                else
-                {
-                    a = (signed char)read8();
-                    a += 128;
-                }
-                ((u8 *)samp->data)[x] = (u8)a;
-            }
-        }
+        Sample_ReadData(samp, fr, samp->format & (SAMPF_16BIT | SAMPF_SIGNED), false);
     }
-    else
+    else if (!fix_lazy_load)
     {
-        Load_IT_Sample_CMP(samp->data, samp->sample_length, cwmt,
+        if (samp->format & SAMPF_16BIT)
+            samp->data = (u16 *)malloc(((u32)samp->sample_length) * 2);
+        else
+            samp->data = (u8 *)malloc(samp->sample_length);
+
+        Load_IT_Sample_CMP(samp->data, fr, samp->sample_length, cwmt,
                            (bool)(samp->format & SAMPF_16BIT));
     }
 
@@ -395,21 +365,20 @@ int Load_IT_SampleData(Sample *samp, u16 cwmt)
     return 0;
 }
 
+// Special clears for vol and note
+static const PatternEntry it_empty_entry = { .note = 250, .vol = 255 };
+
 int Empty_IT_Pattern(Pattern *patt)
 {
     memset(patt, 0, sizeof(Pattern));
-    patt->nrows = 64;
 
-    for (int x = 0; x < patt->nrows*MAX_CHANNELS; x++)
-    {
-        patt->data[x].note = 250; // Special clears for vol and note
-        patt->data[x].vol = 255;
-    }
+    // Empty patterns don't need to store any channel
+    Pattern_Alloc(patt, 64, 0, &it_empty_entry);
 
     return ERR_NONE;
 }
 
-int Load_IT_Pattern(Pattern *patt)
+int Load_IT_Pattern(Pattern *patt, FileReader *fr)
 {
     u8 old_maskvar[MAX_CHANNELS];
     u8 old_note[MAX_CHANNELS];
@@ -420,17 +389,15 @@ int Load_IT_Pattern(Pattern *patt)
 
     memset(patt, 0, sizeof(Pattern));
 
-    int clength = read16();
-    patt->nrows = read16();
-    skip8(4);
+    int clength = read16(fr);
+    int nrows = read16(fr);
+    skip8(4, fr);
 
     patt->clength = clength;
 
-    for (int x = 0; x < patt->nrows*MAX_CHANNELS; x++)
-    {
-        patt->data[x].note = 250; // special clears for vol&note
-        patt->data[x].vol = 255;
-    }
+    // The number of channels used by the pattern isn't known until it has been
+    // decompressed, so unused channels are removed at the end.
+    Pattern_Alloc(patt, nrows, MAX_CHANNELS, &it_empty_entry);
 
     // DECOMPRESS IT PATTERN
 
@@ -442,7 +409,7 @@ int Load_IT_Pattern(Pattern *patt)
     {
 GetNextChannelMarker:
         // Read byte into channelvariable.
-        chanvar = read8();
+        chanvar = read8(fr);
 
         // if (channelvariable = 0) then end of row
         if (chanvar == 0)
@@ -455,90 +422,92 @@ GetNextChannelMarker:
 
         // if (channelvariable & 128) then read byte into maskvariable
         if (chanvar & 128)
-            old_maskvar[chan] = read8();
+            old_maskvar[chan] = read8(fr);
 
         maskvar = old_maskvar[chan];
 
         // if (maskvariable & 1), then read note. (byte value)
         if (maskvar & 1)
         {
-            old_note[chan] = read8();
-            patt->data[x * MAX_CHANNELS + chan].note = old_note[chan];
+            old_note[chan] = read8(fr);
+            patt->data[x * patt->nchannels + chan].note = old_note[chan];
         }
 
         // if (maskvariable & 2), then read instrument (byte value)
         if (maskvar & 2)
         {
-            old_inst[chan] = read8();
-            patt->data[x * MAX_CHANNELS + chan].inst = old_inst[chan];
+            old_inst[chan] = read8(fr);
+            patt->data[x * patt->nchannels + chan].inst = old_inst[chan];
         }
 
         // if (maskvariable & 4), then read volume/panning (byte value)
         if (maskvar & 4)
         {
-            old_vol[chan] = read8();
-            patt->data[x * MAX_CHANNELS + chan].vol = old_vol[chan];
+            old_vol[chan] = read8(fr);
+            patt->data[x * patt->nchannels + chan].vol = old_vol[chan];
         }
 
         // if (maskvariable & 8), then read command (byte value) and commandvalue
         if (maskvar & 8)
         {
-            old_fx[chan] = read8();
-            patt->data[x * MAX_CHANNELS + chan].fx = old_fx[chan];
-            old_param[chan] = read8();
-            patt->data[x * MAX_CHANNELS + chan].param = old_param[chan];
+            old_fx[chan] = read8(fr);
+            patt->data[x * patt->nchannels + chan].fx = old_fx[chan];
+            old_param[chan] = read8(fr);
+            patt->data[x * patt->nchannels + chan].param = old_param[chan];
         }
 
         // if (maskvariable & 16), then note = lastnote for channel
         if (maskvar & 16)
-            patt->data[x * MAX_CHANNELS + chan].note = old_note[chan];
+            patt->data[x * patt->nchannels + chan].note = old_note[chan];
 
         // if (maskvariable & 32), then instrument = lastinstrument for channel
         if (maskvar & 32)
-            patt->data[x * MAX_CHANNELS + chan].inst = old_inst[chan];
+            patt->data[x * patt->nchannels + chan].inst = old_inst[chan];
 
         // if (maskvariable & 64), then volume/pan = lastvolume/pan for channel
         if (maskvar & 64)
-            patt->data[x * MAX_CHANNELS + chan].vol = old_vol[chan];
+            patt->data[x * patt->nchannels + chan].vol = old_vol[chan];
 
         // if (maskvariable & 128), then {
         if (maskvar & 128)
         {
             // command = lastcommand for channel and
-            patt->data[x * MAX_CHANNELS + chan].fx = old_fx[chan];
+            patt->data[x * patt->nchannels + chan].fx = old_fx[chan];
             // commandvalue = lastcommandvalue for channel
-            patt->data[x * MAX_CHANNELS + chan].param = old_param[chan];
+            patt->data[x * patt->nchannels + chan].param = old_param[chan];
         }
         goto GetNextChannelMarker;
     }
 
+    Pattern_Trim(patt, &it_empty_entry);
+
     return ERR_NONE;
 }
 
-int Load_IT(MAS_Module *itm, bool verbose)
+int Load_IT(MAS_Module *itm, FileReader *fr, bool verbose)
 {
     int cc;
 
     memset(itm, 0, sizeof(MAS_Module));
 
-    if (read32() != 'MPMI')
+    if (read32(fr) != 'MPMI')
         return ERR_INVALID_MODULE;
 
     for (int x = 0; x < 28; x++)
-        itm->title[x] = read8();
+        itm->title[x] = read8(fr);
 
-    itm->order_count = (u16)read16();
-    itm->inst_count  = (u8)read16();
-    itm->samp_count  = (u8)read16();
-    itm->patt_count  = (u8)read16();
+    itm->order_count = (u16)read16(fr);
+    itm->inst_count  = (u8)read16(fr);
+    itm->samp_count  = (u8)read16(fr);
+    itm->patt_count  = (u8)read16(fr);
 
-    u16 cwt = read16();
+    u16 cwt = read16(fr);
     (void)cwt; // Unused
-    u16 cmwt = read16(); // upward compatible
-    //skip8(4);          // created with tracker / upward compatible
+    u16 cmwt = read16(fr); // upward compatible
+    //skip8(4, fr);          // created with tracker / upward compatible
 
     // Flags
-    u16 w = read16();
+    u16 w = read16(fr);
     itm->stereo = w & 1;
     bool instr_mode = w & 4;
     itm->inst_mode = instr_mode;
@@ -546,11 +515,11 @@ int Load_IT(MAS_Module *itm, bool verbose)
     itm->old_effects = w & 16;
     itm->link_gxx = w & 32;
 
-    skip8(2); // special
-    itm->global_volume = read8();
-    skip8(1); // mix volume
-    itm->initial_speed = read8();
-    itm->initial_tempo = read8();
+    skip8(2, fr); // special
+    itm->global_volume = read8(fr);
+    skip8(1, fr); // mix volume
+    itm->initial_speed = read8(fr);
+    itm->initial_tempo = read8(fr);
 
     if (verbose)
     {
@@ -571,34 +540,34 @@ int Load_IT(MAS_Module *itm, bool verbose)
         printf(vstr_it_div);
     }
 
-    skip8(12); // SEP, PWD, MSGLENGTH, MESSAGE OFFSET, [RESERVED]
+    skip8(12, fr); // SEP, PWD, MSGLENGTH, MESSAGE OFFSET, [RESERVED]
     for (int x = 0; x < 64; x++)
     {
-        u8 b = read8();
+        u8 b = read8(fr);
         if (x < MAX_CHANNELS)
             itm->channel_panning[x] = b * 4 > 255 ? 255 : b * 4; // map 0->64 to 0->255
     }
 
     for (int x = 0; x < 64; x++)
     {
-        u8 b = read8();
+        u8 b = read8(fr);
         if (x < MAX_CHANNELS)
             itm->channel_volume[x] = b;
     }
 
     for (int x = 0; x < itm->order_count; x++)
-        itm->orders[x] = read8();
+        itm->orders[x] = read8(fr);
 
     u32 *parap_inst = malloc(itm->inst_count * sizeof(u32));
     u32 *parap_samp = malloc(itm->samp_count * sizeof(u32));
     u32 *parap_patt = malloc(itm->patt_count * sizeof(u32));
 
     for (int x = 0; x < itm->inst_count; x++)
-        parap_inst[x] = read32();
+        parap_inst[x] = read32(fr);
     for (int x = 0; x < itm->samp_count; x++)
-        parap_samp[x] = read32();
+        parap_samp[x] = read32(fr);
     for (int x = 0; x < itm->patt_count; x++)
-        parap_patt[x] = read32();
+        parap_patt[x] = read32(fr);
 
     itm->samples = (Sample *)calloc(itm->samp_count, sizeof(Sample));
     itm->patterns = (Pattern *)calloc(itm->patt_count, sizeof(Pattern));
@@ -622,8 +591,8 @@ int Load_IT(MAS_Module *itm, bool verbose)
         {
             //if (verbose)
             //    printf("%i    ", x + 1);
-            file_seek_read(parap_inst[x], SEEK_SET);
-            Load_IT_Instrument(&itm->instruments[x], verbose, x);
+            file_seek_read(parap_inst[x], SEEK_SET, fr);
+            Load_IT_Instrument(&itm->instruments[x], fr, verbose, x);
         }
 
         if (verbose)
@@ -646,8 +615,8 @@ int Load_IT(MAS_Module *itm, bool verbose)
     // read samples
     for (int x = 0; x < itm->samp_count; x++)
     {
-        file_seek_read(parap_samp[x], SEEK_SET);
-        Load_IT_Sample(&itm->samples[x]);
+        file_seek_read(parap_samp[x], SEEK_SET, fr);
+        Load_IT_Sample(&itm->samples[x], fr);
 
         if (verbose)
         {
@@ -720,7 +689,7 @@ int Load_IT(MAS_Module *itm, bool verbose)
     cc = 0;
     for (int x = 0; x < itm->patt_count; x++)
     {
-        file_seek_read(parap_patt[x], SEEK_SET);
+        file_seek_read(parap_patt[x], SEEK_SET, fr);
 
         if (parap_patt[x] != 0)
         {
@@ -734,7 +703,7 @@ int Load_IT(MAS_Module *itm, bool verbose)
                     printf("\n");
                 }
             }
-            Load_IT_Pattern(&itm->patterns[x]);
+            Load_IT_Pattern(&itm->patterns[x], fr);
         }
         else
         {
@@ -753,8 +722,8 @@ int Load_IT(MAS_Module *itm, bool verbose)
     // read sample data
     for (int x = 0; x < itm->samp_count; x++)
     {
-        file_seek_read(itm->samples[x].datapointer, SEEK_SET);
-        Load_IT_SampleData(&itm->samples[x], cmwt);
+        file_seek_read(itm->samples[x].datapointer, SEEK_SET, fr);
+        Load_IT_SampleData(&itm->samples[x], fr, cmwt);
     }
 
     if (verbose)
@@ -781,26 +750,80 @@ The following sample decompression code is based on CHIBITRACKER's code
 NOTICE * NOTICE * NOTICE * NOTICE * NOTICE * NOTICE * NOTICE * NOTICE * NOTICE
 */
 
-int Load_IT_CompressedSampleBlock(u8 **buffer)
+// Reads the bits of a block of compressed sample data, LSB first. The bits are
+// loaded from the input file 64 bits at a time. Bits after the end of the block
+// are read as 0.
+typedef struct tIT_BitReader
 {
-    u32 size = read16();
+    const u8   *data;   // Start of the block
+    u32         size;   // Size of the block in bytes
+    u32         pos;    // Next byte of the block to load
+    u64         bits;   // Bits loaded but not read yet
+    u32         count;  // Number of bits in "bits"
+}
+IT_BitReader;
 
-    (*buffer) = malloc(size + 4);
-    (*buffer)[size + 0] = 0;
-    (*buffer)[size + 1] = 0;
-    (*buffer)[size + 2] = 0;
-    (*buffer)[size + 3] = 0;
+static void IT_BitReader_Init(IT_BitReader *br, FileReader *fr)
+{
+    u32 size = read16(fr);
+    size_t available = (fr->pos < fr->size) ? fr->size - fr->pos : 0;
 
-    for (u32 x = 0; x < size; x++)
-        (*buffer)[x] = read8();
+    if (size > available)
+    {
+        file_read_error(fr);
+        size = available;
+    }
 
-    return ERR_NONE;
+    br->data = fr->data + fr->pos;
+    br->size = size;
+    br->pos = 0;
+    br->bits = 0;
+    br->count = 0;
+
+    fr->pos += size;
 }
 
-int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
+static inline void IT_BitReader_Refill(IT_BitReader *br)
 {
-    u8 *c_buffer = NULL;
+    if (br->pos + 8 <= br->size)
+    {
+        const u8 *p = &br->data[br->pos];
+        u64 word = (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) |
+                   ((u64)p[3] << 24) | ((u64)p[4] << 32) | ((u64)p[5] << 40) |
+                   ((u64)p[6] << 48) | ((u64)p[7] << 56);
 
+        // Only the bytes that fit completely in the buffer are consumed
+        br->bits |= word << br->count;
+        br->pos += (63 - br->count) >> 3;
+        br->count |= 56;
+    }
+    else
+    {
+        while (br->count <= 56)
+        {
+            u64 byte = (br->pos < br->size) ? br->data[br->pos] : 0;
+            br->bits |= byte << br->count;
+            br->pos++;
+            br->count += 8;
+        }
+    }
+}
+
+// Reads up to 32 bits
+static inline u32 IT_BitReader_Read(IT_BitReader *br, u32 size)
+{
+    if (br->count < size)
+        IT_BitReader_Refill(br);
+
+    u32 value = br->bits & ((1ULL << size) - 1);
+    br->bits >>= size;
+    br->count -= size;
+
+    return value;
+}
+
+int Load_IT_Sample_CMP(u8 *p_dest_buffer, FileReader *fr, int samp_len, u16 cmwt, bool bit16)
+{
     u8 *dest8_write = (u8 *)p_dest_buffer;
     u16 *dest16_write = (u16 *)p_dest_buffer;
 
@@ -820,8 +843,8 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
         s16 v16; // sample value 16 bit
 
         // read a new block of compressed data and reset variables
-        Load_IT_CompressedSampleBlock(&c_buffer);
-        u32 bit_readpos = 0;
+        IT_BitReader br;
+        IT_BitReader_Init(&br, fr);
 
         u16 block_length;   // length of compressed data block in samples
         u16 block_position; // position in block
@@ -843,8 +866,10 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
         // now uncompress the data block
         while (block_position < block_length)
         {
-            u32 aux_value = readbits(c_buffer, bit_readpos, bit_width); // read bits
-            bit_readpos += bit_width;
+            if (bit_width > nbits + 1) // illegal width, abort
+                return ERR_UNKNOWNSAMPLE;
+
+            u32 aux_value = IT_BitReader_Read(&br, bit_width); // read bits
 
             if (bit_width < 7) // method 1 (1-6 bits)
             {
@@ -853,8 +878,7 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
                     if ((signed)aux_value == (1 << (bit_width - 1))) // check for "100..."
                     {
                         //read_n_bits_from_IT_compressed_block(3) + 1; // yes -> read new width;
-                        aux_value = readbits(c_buffer, bit_readpos, dsize) + 1;
-                        bit_readpos += dsize;
+                        aux_value = IT_BitReader_Read(&br, dsize) + 1;
                         bit_width = (aux_value < bit_width) ? aux_value : aux_value + 1;
                         // and expand it
                         continue; // ... next value
@@ -865,8 +889,7 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
                     if (aux_value == ((u32)1 << ((u32)bit_width - 1))) // check for "100..."
                     {
                         //read_n_bits_from_IT_compressed_block(3) + 1; // yes -> read new width;
-                        aux_value = readbits(c_buffer, bit_readpos, dsize) + 1;
-                        bit_readpos += dsize;
+                        aux_value = IT_BitReader_Read(&br, dsize) + 1;
                         bit_width = (aux_value < bit_width) ? aux_value : aux_value + 1;
                         // and expand it
                         continue; // ... next value
@@ -903,7 +926,7 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
                     }
                 }
             }
-            else if (bit_width == nbits + 1) // method 3 (9 bits)
+            else // method 3 (9 bits)
             {
                 if (aux_value & (1 << nbits)) // bit 8 set?
                 {
@@ -911,15 +934,6 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
                     continue;                           // ... and next value
                 }
             }
-            else // illegal width, abort
-            {
-                if (c_buffer)
-                {
-                    free(c_buffer);
-                    c_buffer = NULL;
-                }
-                return ERR_UNKNOWNSAMPLE;
-            }
 
             // now expand value to signed byte
             if (bit_width < nbits)
@@ -968,11 +982,6 @@ int Load_IT_Sample_CMP(u8 *p_dest_buffer, int samp_len, u16 cmwt, bool bit16)
         }
 
         // now subtract block lenght from total length and go on
-        if (c_buffer)
-        {
-            free(c_buffer);
-            c_buffer = NULL;
-        }
         samp_len -= block_length;
     }
 
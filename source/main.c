@@ -17,6 +17,7 @@
 
 #include "defs.h"
 #include "mas.h"
+#include "adpcm.h"
 #include "mod.h"
 #include "s3m.h"
 #include "xm.h"
@@ -30,10 +31,15 @@
 #include "systems.h"
 #include "wav.h"
 #include "samplefix.h"
+#include "cache.h"
+#include "info.h"
 
 int target_system;
 
 bool ignore_sflags;
+bool strip_unused;
+bool downsample_notes;
+bool trim_samples;
 int PANNING_SEP;
 
 void print_usage(void)
@@ -48,6 +54,8 @@ void print_usage(void)
         "  mmutil [options] input files ...\n"
         "\n"
         " Input may be MOD, S3M, XM, IT, and/or WAV\n"
+        " Soundbanks (.msl or .bin) are merged into the output\n"
+        " Manifests (.txt) list more input files, one per line\n"
         "\n"
         ".------------.----------------------------------------------------.\n"
         "| Option     | Description                                        |\n"
@@ -58,10 +66,24 @@ void print_usage(void)
         "| -d         | Use for NDS projects.                              |\n"
         "| -b         | Create test ROM. (use -d for .nds, otherwise .gba) |\n"
         "| -i         | Ignore sample flags.                               |\n"
+        "| -u         | Remove unused patterns, instruments and samples.   |\n"
+        "| -a         | Downsample samples to the notes songs play.        |\n"
+        "| -t         | Trim sample data that songs never play.            |\n"
         "| -v         | Enable verbose output.                             |\n"
         "| -p         | Set initial panning separation for MOD/S3M.        |\n"
         "| -z         | Export raw WAV data (8-bit format)                 |\n"
+        "| -q         | Use band-limited (sinc) resampling.                |\n"
+        "| -A         | Use slower ADPCM compression with less noise.      |\n"
+        "| -R<hz>     | Resample samples above this sample rate.           |\n"
+        "| -j<jobs>   | Number of threads used to build soundbanks.        |\n"
+        "| -c<dir>    | Cache converted files in this directory.           |\n"
+        "| -MD        | Write dependency file (output name with .d).       |\n"
+        "| -MF<file>  | Write dependency file with this name.              |\n"
+        "| -r<file>   | Write JSON report with the sizes of the soundbank. |\n"
+        "| -B<size>   | Fit soundbank in this size (k/m suffix allowed).   |\n"
+        "| -S<size>   | Fit each song and its samples in this size.        |\n"
         "| -V         | Print version string and exit.                     |\n"
+        "| --info     | Print info of the inputs and exit (=json: JSON).   |\n"
         "`-----------------------------------------------------------------'\n"
         "\n"
         ".-----------------------------------------------------------------.\n"
@@ -112,6 +134,47 @@ void print_error(int err)
     }
 }
 
+u32 parse_rate(const char *str)
+{
+    char *end;
+    unsigned long rate = strtoul(str, &end, 10);
+
+    // The sample rate is stored divided by 4 in 16 bits
+    if (end == str || *end != 0 || rate == 0 || rate > 0xFFFF * 4)
+    {
+        printf("Invalid sample rate for -R: %s\n", str);
+        exit(EXIT_FAILURE);
+    }
+
+    return rate;
+}
+
+// Sizes can use the suffixes k (KiB) and m (MiB)
+u32 parse_size(const char *str, const char *option)
+{
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+
+    if (*end == 'k' || *end == 'K')
+    {
+        size *= 1024;
+        end++;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size *= 1024 * 1024;
+        end++;
+    }
+
+    if (end == str || *end != 0 || size == 0 || size > 0xFFFFFFFF)
+    {
+        printf("Invalid size for %s: %s\n", option, str);
+        exit(EXIT_FAILURE);
+    }
+
+    return size;
+}
+
 int GetYesNo(void)
 {
     char c = tolower(getchar());
@@ -132,18 +195,29 @@ int main(int argc, char *argv[])
     char *str_input = NULL;
     char *str_output = NULL;
     char *str_header = NULL;
+    char *str_depfile = NULL;
+    char *str_report = NULL;
 
     MAS_Module mod = { 0 };
     Sample samp = { 0 };
 
+    FileReader fr;
+    FileWriter fw;
+
     bool g_flag = false;
     bool v_flag = false;
     bool m_flag = false;
     bool z_flag = false;
+    bool md_flag = false;
+    bool info_flag = false;
+    bool info_json = false;
 
     int output_size;
 
     ignore_sflags = false;
+    strip_unused = false;
+    downsample_notes = false;
+    trim_samples = false;
 
     PANNING_SEP = 128;
 
@@ -157,7 +231,11 @@ int main(int argc, char *argv[])
     {
         if (argv[a][0] == '-')
         {
-            if (argv[a][1] == 'V')
+            if (strcmp(argv[a], "--info") == 0)
+                info_flag = true;
+            else if (strcmp(argv[a], "--info=json") == 0)
+                info_flag = info_json = true;
+            else if (argv[a][1] == 'V')
                 print_version_and_exit();
             else if (argv[a][1] == 'b')
                 g_flag = true;
@@ -167,6 +245,12 @@ int main(int argc, char *argv[])
                 target_system = SYSTEM_NDS;
             else if (argv[a][1] == 'i')
                 ignore_sflags = true;
+            else if (argv[a][1] == 'u')
+                strip_unused = true;
+            else if (argv[a][1] == 'a')
+                downsample_notes = true;
+            else if (argv[a][1] == 't')
+                trim_samples = true;
             else if (argv[a][1] == 'p')
                 PANNING_SEP = ((argv[a][2] - '0') * 256) / 9;
             else if (argv[a][1] == 'o')
@@ -177,6 +261,26 @@ int main(int argc, char *argv[])
                 m_flag = true;
             else if (argv[a][1] == 'z')
                 z_flag = true;
+            else if (argv[a][1] == 'j')
+                MSL_JOBS = atoi(argv[a] + 2);
+            else if (argv[a][1] == 'c')
+                cache_init(argv[a] + 2);
+            else if (argv[a][1] == 'M' && argv[a][2] == 'D')
+                md_flag = true;
+            else if (argv[a][1] == 'M' && argv[a][2] == 'F')
+                str_depfile = argv[a] + 3;
+            else if (argv[a][1] == 'r')
+                str_report = argv[a] + 2;
+            else if (argv[a][1] == 'q')
+                fix_resample_sinc = true;
+            else if (argv[a][1] == 'A')
+                adpcm_trellis = true;
+            else if (argv[a][1] == 'R')
+                fix_max_rate = parse_rate(argv[a] + 2);
+            else if (argv[a][1] == 'B')
+                MSL_BUDGET = parse_size(argv[a] + 2, "-B");
+            else if (argv[a][1] == 'S')
+                MSL_SONG_BUDGET = parse_size(argv[a] + 2, "-S");
         }
         else if (!str_input)
         {
@@ -189,12 +293,20 @@ int main(int argc, char *argv[])
         }
     }
 
+    // Samples are resampled or trimmed from the original data after analyzing
+    // the songs.
+    if (downsample_notes || trim_samples)
+        fix_keep_source = true;
+
     if (number_of_inputs == 0)
     {
         print_usage();
         return 0;
     }
 
+    if (info_flag)
+        return Info_Write(argv, argc, str_output, info_json);
+
     if (str_output == NULL)
     {
         printf("No output file specified with -o\n");
@@ -203,10 +315,10 @@ int main(int argc, char *argv[])
 
     if (z_flag)
     {
-        file_open_read(str_input);
+        file_open_read(str_input, &fr);
         Sample s;
 
-        Load_WAV(&s, v_flag, false);
+        Load_WAV(&s, &fr, v_flag, false);
 
         s.name[0] = '%';
         s.name[1] = 'c';
@@ -214,13 +326,12 @@ int main(int argc, char *argv[])
 
         FixSample(&s);
 
-        file_close_read();
-        file_open_write(str_output);
+        file_close_read(&fr);
+        file_open_write(str_output, &fw);
 
-        for (size_t i = 0; i < s.sample_length; i++)
-            write8(((u8 *)s.data)[i]);
+        write_bytes(s.data, s.sample_length, &fw);
 
-        file_close_write();
+        file_close_write(&fw);
         printf("okay\n");
         return 0;
     }
@@ -317,7 +428,7 @@ int main(int argc, char *argv[])
 
     if (m_flag)
     {
-        if (file_open_read(str_input))
+        if (file_open_read(str_input, &fr))
         {
             printf("Cannot open %s for reading!\n", str_input);
             return -1;
@@ -329,10 +440,10 @@ int main(int argc, char *argv[])
         {
             case INPUT_TYPE_MOD:
             {
-                if (Load_MOD(&mod, v_flag))
+                if (Load_MOD(&mod, &fr, v_flag))
                 {
                     print_error(ERR_INVALID_MODULE);
-                    file_close_read();
+                    file_close_read(&fr);
                     return -1;
                 }
                 break;
@@ -340,10 +451,10 @@ int main(int argc, char *argv[])
 
             case INPUT_TYPE_S3M:
             {
-                if (Load_S3M(&mod, v_flag))
+                if (Load_S3M(&mod, &fr, v_flag))
                 {
                     print_error(ERR_INVALID_MODULE);
-                    file_close_read();
+                    file_close_read(&fr);
                     return -1;
                 }
                 break;
@@ -351,10 +462,10 @@ int main(int argc, char *argv[])
 
             case INPUT_TYPE_XM:
             {
-                if (Load_XM(&mod, v_flag))
+                if (Load_XM(&mod, &fr, v_flag))
                 {
                     print_error(ERR_INVALID_MODULE);
-                    file_close_read();
+                    file_close_read(&fr);
                     return -1;
                 }
                 break;
@@ -362,11 +473,11 @@ int main(int argc, char *argv[])
 
             case INPUT_TYPE_IT:
             {
-                if (Load_IT(&mod, v_flag))
+                if (Load_IT(&mod, &fr, v_flag))
                 {
                     // ERROR!
                     print_error(ERR_INVALID_MODULE);
-                    file_close_read();
+                    file_close_read(&fr);
                     return -1;
                 }
                 break;
@@ -374,10 +485,10 @@ int main(int argc, char *argv[])
 
             case INPUT_TYPE_WAV:
             {
-                if (Load_WAV(&samp, v_flag, false))
+                if (Load_WAV(&samp, &fr, v_flag, false))
                 {
                     print_error(ERR_INVALID_MODULE);
-                    file_close_read();
+                    file_close_read(&fr);
                     return -1;
                 }
 
@@ -392,7 +503,16 @@ int main(int argc, char *argv[])
             }
         }
 
-        file_close_read();
+        file_close_read(&fr);
+
+        if (strip_unused && input_type != INPUT_TYPE_WAV)
+            Strip_Module(&mod, v_flag);
+
+        if (trim_samples && input_type != INPUT_TYPE_WAV)
+            Trim_Module(&mod, v_flag);
+
+        if (downsample_notes && input_type != INPUT_TYPE_WAV)
+            Downsample_Module(&mod, v_flag);
 
         if (file_exists(str_output))
         {
@@ -404,7 +524,7 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (file_open_write(str_output))
+        if (file_open_write(str_output, &fw))
         {
             print_error(ERR_NOWRITE);
             return -1;
@@ -413,9 +533,9 @@ int main(int argc, char *argv[])
         printf("Writing .mas............\n");
 
         // output MAS
-        output_size = Write_MAS(&mod, v_flag, false);
+        output_size = Write_MAS(&mod, &fw, v_flag, false);
 
-        file_close_write();
+        file_close_write(&fw);
 
         Delete_Module(&mod);
 
@@ -445,7 +565,7 @@ int main(int argc, char *argv[])
         {
             MSL_Create(argv, argc, "tempSH308GK.bin", 0, v_flag);
 
-            if (file_open_write(str_output))
+            if (file_open_write(str_output, &fw))
             {
                 print_error(ERR_NOWRITE);
                 return -1;
@@ -454,18 +574,18 @@ int main(int argc, char *argv[])
             if (v_flag)
                 printf("Making GBA ROM.......\n");
 
-            Write_GBA();
+            Write_GBA(&fw);
 
             output_size = file_size("tempSH308GK.bin");
-            file_open_read("tempSH308GK.bin");
+            file_open_read("tempSH308GK.bin", &fr);
 
             for (int i = 0; i < output_size; i++)
             {
-                write8(read8());
+                write8(read8(&fr), &fw);
             }
 
-            file_close_read();
-            file_close_write();
+            file_close_read(&fr);
+            file_close_write(&fw);
 
             file_delete("tempSH308GK.bin");
 
@@ -486,6 +606,27 @@ int main(int argc, char *argv[])
     }
     else
     {
+        if (md_flag && str_depfile == NULL)
+        {
+            // Replace the extension of the output file by ".d"
+            size_t len = strlen(str_output);
+            size_t ext = len;
+            for (size_t x = 0; x < len; x++)
+            {
+                if (str_output[x] == '.')
+                    ext = x;
+                else if (str_output[x] == '/' || str_output[x] == '\\')
+                    ext = len;
+            }
+
+            str_depfile = malloc(ext + 3);
+            memcpy(str_depfile, str_output, ext);
+            strcpy(str_depfile + ext, ".d");
+        }
+
+        MSL_DEPFILE = str_depfile;
+        MSL_REPORT = str_report;
+
         MSL_Create(argv, argc, str_output, str_header, v_flag);
     }
 
@@ -0,0 +1,339 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+// Manifest files (.txt) list the input files of a soundbank, one per line, so
+// that soundbanks can have more inputs than what fits in a command line:
+//
+//     # Comment
+//     music/level1.xm
+//     "sfx/door open.wav" name=DOOR
+//     sfx/explosion.wav format=8 compress=adpcm rate=16000
+//
+// Relative paths are relative to the directory of the manifest. The settings
+// that can be used after the path are:
+//
+//     format=8|16            Format of the sample data (WAV files only).
+//     compress=adpcm|none    Compression of the sample data (WAV files only).
+//     rate=<hz>              Resample to this sample rate (WAV files only).
+//     name=<symbol>          Name of the definition in the header file.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "files.h"
+#include "manifest.h"
+#include "mas.h"
+#include "simple.h"
+#include "systems.h"
+
+// Maximum sample rate that can be stored in a sample header
+#define MAX_SAMPLE_RATE     (0xFFFF * 4)
+
+typedef struct tInputList
+{
+    InputEntry *entries;
+    int count;
+    int capacity;
+}
+InputList;
+
+static InputEntry *Inputs_Add(InputList *list, char *filename)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->entries = realloc(list->entries, list->capacity * sizeof(InputEntry));
+        if (list->entries == NULL)
+        {
+            printf("Not enough memory for the list of inputs\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    InputEntry *entry = &list->entries[list->count++];
+
+    entry->filename = filename;
+    entry->format = INPUT_FORMAT_DEFAULT;
+    entry->compression = INPUT_COMPRESSION_DEFAULT;
+    entry->rate = 0;
+    entry->symbol = NULL;
+
+    return entry;
+}
+
+static char *Manifest_Path(const char *manifest, const char *path, size_t len)
+{
+    size_t dir_len = 0;
+
+    bool absolute = (path[0] == '/') || (path[0] == '\\') ||
+                    (len > 1 && path[1] == ':');
+
+    if (!absolute)
+    {
+        for (size_t x = 0; manifest[x] != 0; x++)
+        {
+            if (manifest[x] == '/' || manifest[x] == '\\')
+                dir_len = x + 1;
+        }
+    }
+
+    char *result = malloc(dir_len + len + 1);
+    if (result == NULL)
+    {
+        printf("Not enough memory for the list of inputs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(result, manifest, dir_len);
+    memcpy(result + dir_len, path, len);
+    result[dir_len + len] = 0;
+
+    return result;
+}
+
+// Returns the length of the token that starts at "str". Tokens are separated
+// by spaces, and they may be quoted.
+static size_t Manifest_Token(const char *str, const char *end, bool *quoted)
+{
+    size_t len = 0;
+
+    *quoted = (str[0] == '"');
+    if (*quoted)
+    {
+        for (len = 1; str + len < end && str[len] != '"'; len++)
+            ;
+        return len + 1;
+    }
+
+    while (str + len < end && str[len] != ' ' && str[len] != '\t')
+        len++;
+
+    return len;
+}
+
+static void Manifest_Setting(InputEntry *entry, const char *setting,
+                             const char *manifest, int line)
+{
+    const char *value = strchr(setting, '=');
+    if (value == NULL)
+    {
+        printf("%s:%d: Invalid setting: %s\n", manifest, line, setting);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t key_len = value - setting;
+    value++;
+
+    if (key_len == 6 && strncmp(setting, "format", key_len) == 0)
+    {
+        if (strcmp(value, "8") == 0)
+        {
+            entry->format = INPUT_FORMAT_8BIT;
+        }
+        else if (strcmp(value, "16") == 0)
+        {
+            if (target_system == SYSTEM_GBA)
+            {
+                printf("%s:%d: 16-bit samples aren't supported on GBA\n", manifest, line);
+                exit(EXIT_FAILURE);
+            }
+            entry->format = INPUT_FORMAT_16BIT;
+        }
+        else
+        {
+            printf("%s:%d: Invalid format: %s\n", manifest, line, value);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (key_len == 8 && strncmp(setting, "compress", key_len) == 0)
+    {
+        if (strcmp(value, "adpcm") == 0)
+        {
+            if (target_system == SYSTEM_GBA)
+            {
+                printf("%s:%d: ADPCM samples aren't supported on GBA\n", manifest, line);
+                exit(EXIT_FAILURE);
+            }
+            entry->compression = INPUT_COMPRESSION_ADPCM;
+        }
+        else if (strcmp(value, "none") == 0)
+        {
+            entry->compression = INPUT_COMPRESSION_NONE;
+        }
+        else
+        {
+            printf("%s:%d: Invalid compression: %s\n", manifest, line, value);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (key_len == 4 && strncmp(setting, "rate", key_len) == 0)
+    {
+        char *end;
+        unsigned long rate = strtoul(value, &end, 10);
+        if (end == value || *end != 0 || rate == 0 || rate > MAX_SAMPLE_RATE)
+        {
+            printf("%s:%d: Invalid sample rate: %s\n", manifest, line, value);
+            exit(EXIT_FAILURE);
+        }
+        entry->rate = rate;
+    }
+    else if (key_len == 4 && strncmp(setting, "name", key_len) == 0)
+    {
+        if (value[0] == 0)
+        {
+            printf("%s:%d: Invalid name\n", manifest, line);
+            exit(EXIT_FAILURE);
+        }
+        free(entry->symbol);
+        entry->symbol = strdup(value);
+    }
+    else
+    {
+        printf("%s:%d: Unknown setting: %s\n", manifest, line, setting);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void Manifest_Load(InputList *list, char *manifest)
+{
+    FileReader fr;
+
+    file_open_read(manifest, &fr);
+
+    const char *text = (const char *)fr.data;
+    const char *text_end = text + fr.size;
+    int line = 0;
+
+    while (text < text_end)
+    {
+        const char *end = memchr(text, '\n', text_end - text);
+        if (end == NULL)
+            end = text_end;
+
+        const char *next = end + 1;
+        line++;
+
+        // Ignore line endings and whitespace at the end of the line
+        while (end > text && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        while (text < end && (*text == ' ' || *text == '\t'))
+            text++;
+
+        if (text == end || *text == '#')
+        {
+            text = next;
+            continue;
+        }
+
+        bool quoted;
+        size_t len = Manifest_Token(text, end, &quoted);
+
+        if (quoted && (text + len > end || len < 3 || text[len - 1] != '"'))
+        {
+            printf("%s:%d: Invalid file name\n", manifest, line);
+            exit(EXIT_FAILURE);
+        }
+
+        char *filename = quoted ? Manifest_Path(manifest, text + 1, len - 2)
+                                : Manifest_Path(manifest, text, len);
+
+        int type = get_ext(filename);
+        if (type == INPUT_TYPE_TXT)
+        {
+            printf("%s:%d: Manifests can't include other manifests\n", manifest, line);
+            exit(EXIT_FAILURE);
+        }
+
+        InputEntry *entry = Inputs_Add(list, filename);
+
+        text += len;
+
+        while (text < end)
+        {
+            while (text < end && (*text == ' ' || *text == '\t'))
+                text++;
+            if (text == end)
+                break;
+
+            len = Manifest_Token(text, end, &quoted);
+
+            char setting[256];
+            if (quoted || len >= sizeof(setting))
+            {
+                printf("%s:%d: Invalid setting\n", manifest, line);
+                exit(EXIT_FAILURE);
+            }
+            memcpy(setting, text, len);
+            setting[len] = 0;
+
+            Manifest_Setting(entry, setting, manifest, line);
+
+            text += len;
+        }
+
+        if (type != INPUT_TYPE_WAV && (entry->format != INPUT_FORMAT_DEFAULT ||
+            entry->compression != INPUT_COMPRESSION_DEFAULT || entry->rate != 0))
+        {
+            printf("%s:%d: Only WAV files support format, compress and rate\n",
+                   manifest, line);
+            exit(EXIT_FAILURE);
+        }
+
+        text = next;
+    }
+
+    file_close_read(&fr);
+}
+
+// Returns the list of input files of a soundbank, including the ones listed in
+// manifest files, in the order they have to be added to the soundbank.
+InputEntry *Inputs_Collect(char *argv[], int argc, int *count)
+{
+    InputList list = { 0 };
+
+    for (int x = 1; x < argc; x++)
+    {
+        // Skip anything that isn't an input file
+        if (argv[x][0] == '-')
+            continue;
+
+        if (get_ext(argv[x]) == INPUT_TYPE_TXT)
+        {
+            Manifest_Load(&list, argv[x]);
+        }
+        else
+        {
+            char *filename = strdup(argv[x]);
+            if (filename == NULL)
+            {
+                printf("Not enough memory for the list of inputs\n");
+                exit(EXIT_FAILURE);
+            }
+            Inputs_Add(&list, filename);
+        }
+    }
+
+    *count = list.count;
+    return list.entries;
+}
+
+void Inputs_Free(InputEntry *inputs, int count)
+{
+    for (int x = 0; x < count; x++)
+    {
+        free(inputs[x].filename);
+        free(inputs[x].symbol);
+    }
+
+    free(inputs);
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: ISC
+//
+// Copyright (c) 2026, Antonio Niño Díaz
+
+/****************************************************************************
+ *                ____ ___  ____ __  ______ ___  ____  ____/ /              *
+ *               / __ `__ \/ __ `/ |/ / __ `__ \/ __ \/ __  /               *
+ *              / / / / / / /_/ />  </ / / / / / /_/ / /_/ /                *
+ *             /_/ /_/ /_/\__,_/_/|_/_/ /_/ /_/\____/\__,_/                 *
+ *                                                                          *
+ ****************************************************************************/
+
+#ifndef MANIFEST_H__
+#define MANIFEST_H__
+
+#include "deftypes.h"
+
+#define INPUT_FORMAT_DEFAULT        0
+#define INPUT_FORMAT_8BIT           8
+#define INPUT_FORMAT_16BIT          16
+
+#define INPUT_COMPRESSION_DEFAULT   0
+#define INPUT_COMPRESSION_NONE      1
+#define INPUT_COMPRESSION_ADPCM     2
+
+// Input file of a soundbank, with the settings used to convert it. Entries of
+// manifest files may override the default settings.
+typedef struct tInputEntry
+{
+    char   *filename;
+    u8      format;         // INPUT_FORMAT_*
+    u8      compression;    // INPUT_COMPRESSION_*
+    u32     rate;           // New sample rate of the samples (0 = don't change)
+    char   *symbol;         // Name used in the header (NULL = use the file name)
+}
+InputEntry;
+
+InputEntry *Inputs_Collect(char *argv[], int argc, int *count);
+void Inputs_Free(InputEntry *inputs, int count);
+
+#endif // MANIFEST_H__
@@ -10,17 +10,19 @@
  *                                                                          *
  ****************************************************************************/
 
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+
 #include "defs.h"
 #include "files.h"
 #include "mas.h"
+#include "samplefix.h"
 #include "simple.h"
 #include "systems.h"
 #include "version.h"
 
-u32 MAS_OFFSET;
-u32 MAS_FILESIZE;
-
 static int CalcEnvelopeSize(Instrument_Envelope *env)
 {
     return (env->node_count * 4) + 8;
@@ -83,18 +85,17 @@ void Sanitize_Module(MAS_Module *mod, bool verbose)
 
         for (int r = 0; r < patt->nrows; r++)
         {
-            for (int c = 0; c < MAX_CHANNELS; c++)
+            for (int c = 0; c < patt->nchannels; c++)
             {
-                PatternEntry *pe = &(patt->data[r * MAX_CHANNELS + c]);
+                PatternEntry *pe = &(patt->data[r * patt->nchannels + c]);
 
                 // If the instrument entry isn't empty, make sure that the
                 // sample is valid. Maxmod will crash in some cases if it tries
                 // to play an empty sample.
                 if (pe->inst > 0)
                 {
-                    Instrument *inst = &(mod->instruments[pe->inst - 1]);
-
-                    if (!inst->is_valid)
+                    if ((pe->inst > mod->inst_count) ||
+                        !mod->instruments[pe->inst - 1].is_valid)
                     {
                         printf("warning: Invalid instrument %u at pattern %d row %u chan %u\n",
                                pe->inst, p, r, c + 1);
@@ -147,16 +148,16 @@ void Sanitize_Module(MAS_Module *mod, bool verbose)
     }
 }
 
-void Write_Instrument_Envelope(Instrument_Envelope *env)
+void Write_Instrument_Envelope(Instrument_Envelope *env, FileWriter *fw)
 {
-    write8((u8)(env->node_count * 4 + 8)); // maximum is 6+75
-    write8(env->loop_start);
-    write8(env->loop_end);
-    write8(env->sus_start);
-    write8(env->sus_end);
-    write8(env->node_count);
-    write8(env->env_filter);
-    write8(BYTESMASHER);
+    write8((u8)(env->node_count * 4 + 8), fw); // maximum is 6+75
+    write8(env->loop_start, fw);
+    write8(env->loop_end, fw);
+    write8(env->sus_start, fw);
+    write8(env->sus_end, fw);
+    write8(env->node_count, fw);
+    write8(env->env_filter, fw);
+    write8(BYTESMASHER, fw);
 
     if (env->node_count > 1)
     {
@@ -190,25 +191,22 @@ void Write_Instrument_Envelope(Instrument_Envelope *env)
                 range = 0;
                 delta = 0;
             }
-            write16((u16)delta);
-            write16((u16)(base | (range << 7)));
+            write16((u16)delta, fw);
+            write16((u16)(base | (range << 7)), fw);
         }
     }
 }
 
-void Write_Instrument(Instrument *inst)
+void Write_Instrument(Instrument *inst, FileWriter *fw)
 {
-    align32();
-    inst->parapointer = file_tell_write() - MAS_OFFSET;
-
-    write8(inst->global_volume);
-    write8((u8)inst->fadeout);
-    write8(inst->random_volume);
-    write8(inst->dct);
-    write8(inst->nna);
-    write8(inst->env_flags);
-    write8(inst->setpan);
-    write8(inst->dca);
+    write8(inst->global_volume, fw);
+    write8((u8)inst->fadeout, fw);
+    write8(inst->random_volume, fw);
+    write8(inst->dct, fw);
+    write8(inst->nna, fw);
+    write8(inst->env_flags, fw);
+    write8(inst->setpan, fw);
+    write8(inst->dca, fw);
 
     int full_notemap = 0;
     int first_notemap_samp = (inst->notemap[0] >> 8);
@@ -226,42 +224,42 @@ void Write_Instrument(Instrument *inst)
     {
         // full notemap
         // write offset here
-        write16((u16)CalcInstrumentSize(inst));
+        write16((u16)CalcInstrumentSize(inst), fw);
     }
     else
     {
         // single notemap entry
-        write16((u16)(0x8000 | first_notemap_samp));
+        write16((u16)(0x8000 | first_notemap_samp), fw);
     }
 
-    write16(0); // reserved space
+    write16(0, fw); // reserved space
 
     if (inst->env_flags & MAS_INSTR_FLAG_VOL_ENV_EXISTS) // Write volume envelope
-        Write_Instrument_Envelope(&inst->envelope_volume);
+        Write_Instrument_Envelope(&inst->envelope_volume, fw);
     if (inst->env_flags & MAS_INSTR_FLAG_PAN_ENV_EXISTS) // Write panning envelope
-        Write_Instrument_Envelope(&inst->envelope_pan);
+        Write_Instrument_Envelope(&inst->envelope_pan, fw);
     if (inst->env_flags & MAS_INSTR_FLAG_PITCH_ENV_EXISTS) // Write pitch envelope
-        Write_Instrument_Envelope(&inst->envelope_pitch);
+        Write_Instrument_Envelope(&inst->envelope_pitch, fw);
 
     if (full_notemap)
     {
         for (int y = 0; y < 120; y++)
-            write16(inst->notemap[y]);
+            write16(inst->notemap[y], fw);
     }
 }
 
-void Write_SampleData(Sample *samp)
+void Write_SampleData(Sample *samp, FileWriter *fw)
 {
     u32 sample_length = samp->sample_length;
     u32 sample_looplen = samp->loop_end - samp->loop_start;
 
     if (target_system == SYSTEM_GBA)
     {
-        write32(sample_length);
-        write32(samp->loop_type ? sample_looplen : 0xFFFFFFFF);
-        write8(SAMP_FORMAT_U8);
-        write8(BYTESMASHER);
-        write16((u16)((samp->frequency * 1024 + (15768 / 2)) / 15768));
+        write32(sample_length, fw);
+        write32(samp->loop_type ? sample_looplen : 0xFFFFFFFF, fw);
+        write8(SAMP_FORMAT_U8, fw);
+        write8(BYTESMASHER, fw);
+        write16((u16)((samp->frequency * 1024 + (15768 / 2)) / 15768), fw);
     }
     else
     {
@@ -269,91 +267,88 @@ void Write_SampleData(Sample *samp)
         {
             if (samp->loop_type)
             {
-                write32(samp->loop_start / 2);
-                write32((samp->loop_end-samp->loop_start) / 2);
+                write32(samp->loop_start / 2, fw);
+                write32((samp->loop_end-samp->loop_start) / 2, fw);
             }
             else
             {
-                write32(0);
-                write32(sample_length/2);
+                write32(0, fw);
+                write32(sample_length/2, fw);
             }
         }
         else
         {
             if (samp->loop_type)
             {
-                write32(samp->loop_start / 4);
-                write32((samp->loop_end-samp->loop_start) / 4);
+                write32(samp->loop_start / 4, fw);
+                write32((samp->loop_end-samp->loop_start) / 4, fw);
             }
             else
             {
-                write32(0);
-                write32(sample_length / 4);
+                write32(0, fw);
+                write32(sample_length / 4, fw);
             }
         }
-        write8(sample_dsformat(samp));
-        write8(sample_dsreptype(samp));
-        write16((u16) ((samp->frequency * 1024 + (32768 / 2)) / 32768));
-        write32(0);
+        write8(sample_dsformat(samp), fw);
+        write8(sample_dsreptype(samp), fw);
+        write16((u16) ((samp->frequency * 1024 + (32768 / 2)) / 32768), fw);
+        write32(0, fw);
     }
 
     // write sample data
     if (samp->format & SAMPF_16BIT)
     {
         for (u32 x = 0; x < sample_length; x++)
-            write16(((u16*)samp->data)[x]);
+            write16(((u16*)samp->data)[x], fw);
 
         // add padding data
         if (samp->loop_type && sample_length >= (samp->loop_start + 2))
         {
-            write16(((u16*)samp->data)[samp->loop_start]);
-            write16(((u16*)samp->data)[samp->loop_start + 1]);
+            write16(((u16*)samp->data)[samp->loop_start], fw);
+            write16(((u16*)samp->data)[samp->loop_start + 1], fw);
         }
         else
         {
-            write16(0);
-            write16(0);
+            write16(0, fw);
+            write16(0, fw);
         }
     }
     else
     {
         for (u32 x = 0; x < sample_length; x++)
-            write8(((u8 *)samp->data)[x]);
+            write8(((u8 *)samp->data)[x], fw);
 
         // add padding data
         if (samp->loop_type && sample_length >= (samp->loop_start + 4))
         {
-            write8(((u8*)samp->data)[samp->loop_start]);
-            write8(((u8*)samp->data)[samp->loop_start + 1]);
-            write8(((u8*)samp->data)[samp->loop_start + 2]);
-            write8(((u8*)samp->data)[samp->loop_start + 3]);
+            write8(((u8*)samp->data)[samp->loop_start], fw);
+            write8(((u8*)samp->data)[samp->loop_start + 1], fw);
+            write8(((u8*)samp->data)[samp->loop_start + 2], fw);
+            write8(((u8*)samp->data)[samp->loop_start + 3], fw);
         }
         else
         {
             for (u32 x = 0; x < 4; x++)
-                write8((target_system == SYSTEM_GBA) ? 128 : 0);
+                write8((target_system == SYSTEM_GBA) ? 128 : 0, fw);
         }
     }
 }
 
-void Write_Sample(Sample *samp)
+void Write_Sample(Sample *samp, FileWriter *fw)
 {
-    align32(); // align data by 32 bits
-    samp->parapointer = file_tell_write()-MAS_OFFSET;
+    write8(samp->default_volume, fw);
+    write8(samp->default_panning, fw);
+    write16((u16)(samp->frequency / 4), fw);
+    write8(samp->vibtype, fw);
+    write8(samp->vibdepth, fw);
+    write8(samp->vibspeed, fw);
+    write8(samp->global_volume, fw);
+    write16(samp->vibrate, fw);
 
-    write8(samp->default_volume);
-    write8(samp->default_panning);
-    write16((u16)(samp->frequency / 4));
-    write8(samp->vibtype);
-    write8(samp->vibdepth);
-    write8(samp->vibspeed);
-    write8(samp->global_volume);
-    write16(samp->vibrate);
-
-    write16(samp->msl_index);
+    write16(samp->msl_index, fw);
 
     if (samp->msl_index == 0xFFFF)
-        Write_SampleData(samp);
+        Write_SampleData(samp, fw);
 }
 
 #define COMPR_FLAG_NOTE     (1 << 0)
@@ -368,7 +363,81 @@ void Write_Sample(Sample *samp)
 #define MF_HASVCMD          (4 << 4)
 #define MF_HASFX            (8 << 4)
 
-void Write_Pattern(Pattern *patt, bool xm_vol)
+// Allocate the data of a pattern and fill it with empty entries. Loaders use
+// different values for empty entries.
+void Pattern_Alloc(Pattern *patt, int nrows, int nchannels, const PatternEntry *empty)
+{
+    size_t count = (size_t)nrows * nchannels;
+
+    patt->nrows = nrows;
+    patt->nchannels = nchannels;
+    patt->data = NULL;
+
+    if (count == 0)
+        return;
+
+    patt->data = malloc(count * sizeof(PatternEntry));
+    if (patt->data == NULL)
+    {
+        printf("Not enough memory for pattern data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t x = 0; x < count; x++)
+        patt->data[x] = *empty;
+}
+
+static bool Pattern_EntryIsEmpty(const PatternEntry *pe, const PatternEntry *empty)
+{
+    return (pe->note == empty->note) && (pe->inst == empty->inst) &&
+           (pe->vol == empty->vol) && (pe->fx == empty->fx) &&
+           (pe->param == empty->param);
+}
+
+// Remove the channels at the right of the pattern that only have empty entries
+void Pattern_Trim(Pattern *patt, const PatternEntry *empty)
+{
+    int used = 0;
+
+    for (int row = 0; row < patt->nrows; row++)
+    {
+        for (int col = patt->nchannels - 1; col >= used; col--)
+        {
+            if (!Pattern_EntryIsEmpty(&patt->data[row * patt->nchannels + col], empty))
+            {
+                used = col + 1;
+                break;
+            }
+        }
+    }
+
+    if (used == patt->nchannels)
+        return;
+
+    if (used == 0)
+    {
+        free(patt->data);
+        patt->data = NULL;
+        patt->nchannels = 0;
+        return;
+    }
+
+    // The new rows are never longer than the old ones, so they can be moved
+    // in place.
+    for (int row = 1; row < patt->nrows; row++)
+    {
+        memmove(&patt->data[row * used], &patt->data[row * patt->nchannels],
+                used * sizeof(PatternEntry));
+    }
+
+    PatternEntry *data = realloc(patt->data, (size_t)patt->nrows * used * sizeof(PatternEntry));
+    if (data != NULL)
+        patt->data = data;
+
+    patt->nchannels = used;
+}
+
+void Write_Pattern(Pattern *patt, FileWriter *fw, bool xm_vol)
 {
     u16 last_mask[MAX_CHANNELS];
     u16 last_note[MAX_CHANNELS];
@@ -377,8 +446,7 @@ void Write_Pattern(Pattern *patt, bool xm_vol)
     u16 last_fx[MAX_CHANNELS];
     u16 last_param[MAX_CHANNELS];
 
-    patt->parapointer = file_tell_write() - MAS_OFFSET;
-    write8((u8)(patt->nrows - 1));
+    write8((u8)(patt->nrows - 1), fw);
 
     patt->cmarks[0] = true;
     u8 emptyvol = xm_vol ? 0 : 255;
@@ -400,9 +468,9 @@ void Write_Pattern(Pattern *patt, bool xm_vol)
             }
         }
 
-        for (int col = 0; col < MAX_CHANNELS; col++)
+        for (int col = 0; col < patt->nchannels; col++)
         {
-            PatternEntry *pe = &patt->data[row * MAX_CHANNELS + col];
+            PatternEntry *pe = &patt->data[row * patt->nchannels + col];
 
             if (((pe->note != 250) || (pe->inst != 0) || (pe->vol != emptyvol) ||
                  (pe->fx != 0) || (pe->param != 0)))
@@ -485,20 +553,20 @@ void Write_Pattern(Pattern *patt, bool xm_vol)
                     last_mask[col] = maskvar;
                 }
 
-                write8(chanvar);
+                write8(chanvar, fw);
                 if (chanvar & (1 << 7))
-                    write8(maskvar);
+                    write8(maskvar, fw);
 
                 if (maskvar & COMPR_FLAG_NOTE)
-                    write8(pe->note);
+                    write8(pe->note, fw);
                 if (maskvar & COMPR_FLAG_INSTR)
-                    write8(pe->inst);
+                    write8(pe->inst, fw);
                 if (maskvar & COMPR_FLAG_VOLC)
-                    write8(pe->vol);
+                    write8(pe->vol, fw);
                 if (maskvar & COMPR_FLAG_EFFC)
                 {
-                    write8(pe->fx);
-                    write8(pe->param);
+                    write8(pe->fx, fw);
+                    write8(pe->param, fw);
                 }
             }
             else
@@ -506,7 +574,7 @@ void Write_Pattern(Pattern *patt, bool xm_vol)
                 continue;
             }
         }
-        write8(0);
+        write8(0, fw);
     }
 }
 
@@ -545,11 +613,13 @@ void Mark_Patterns(MAS_Module *mod)
         if (p >= mod->patt_count)
             continue;
 
-        for (int row = 0; row < mod->patterns[p].nrows; row++)
+        Pattern *patt = &mod->patterns[p];
+
+        for (int row = 0; row < patt->nrows; row++)
         {
-            for (int col = 0; col < MAX_CHANNELS; col++)
+            for (int col = 0; col < patt->nchannels; col++)
             {
-                PatternEntry* pe = &(mod->patterns[p].data[row * MAX_CHANNELS + col]);
+                PatternEntry* pe = &(patt->data[row * patt->nchannels + col]);
 
                 if (pe->fx == 3) // PATTERN BREAK
                 {
@@ -570,29 +640,38 @@ void Mark_Patterns(MAS_Module *mod)
     }
 }
 
-int Write_MAS(MAS_Module *mod, bool verbose, bool msl_dep)
+typedef struct tPattern_Data
 {
-    file_get_byte_count();
+    u32 offset; // Offset of the encoded pattern in the output buffer
+    u32 size;
+    u64 hash;
+    bool written; // False if it's a copy of a previous pattern
+}
+Pattern_Data;
+
+int Write_MAS(MAS_Module *mod, FileWriter *fw, bool verbose, bool msl_dep)
+{
+    file_get_byte_count(fw);
 
-    write32(BYTESMASHER);
-    write8(MAS_TYPE_SONG);
-    write8(MAS_VERSION);
-    write8(BYTESMASHER);
-    write8(BYTESMASHER);
+    write32(BYTESMASHER, fw);
+    write8(MAS_TYPE_SONG, fw);
+    write8(MAS_VERSION, fw);
+    write8(BYTESMASHER, fw);
+    write8(BYTESMASHER, fw);
 
-    MAS_OFFSET = file_tell_write();
+    u32 mas_offset = file_tell_write(fw);
 
-    write8((u8)mod->order_count);
-    write8(mod->inst_count);
-    write8(mod->samp_count);
-    write8(mod->patt_count);
+    write8((u8)mod->order_count, fw);
+    write8(mod->inst_count, fw);
+    write8(mod->samp_count, fw);
+    write8(mod->patt_count, fw);
     write8((u8)((mod->link_gxx ? 1 : 0) | (mod->old_effects ? 2 : 0) |
                 (mod->freq_mode ? 4 : 0) | (mod->xm_mode ? 8 : 0) |
-                (msl_dep ? 16 : 0) | (mod->old_mode ? 32 : 0)));
-    write8(mod->global_volume);
-    write8(mod->initial_speed);
-    write8(mod->initial_tempo);
-    write8(mod->restart_pos);
+                (msl_dep ? 16 : 0) | (mod->old_mode ? 32 : 0)), fw);
+    write8(mod->global_volume, fw);
+    write8(mod->initial_speed, fw);
+    write8(mod->initial_tempo, fw);
+    write8(mod->restart_pos, fw);
 
 /*
     u8 rsamp = 0;
@@ -617,16 +696,16 @@ int Write_MAS(MAS_Module *mod, bool verbose, bool msl_dep)
             rsamp++;
         }
     }
-    write8(rsamp);
+    write8(rsamp, fw);
 */
 
-    write8(BYTESMASHER);
-    write8(BYTESMASHER);write8(BYTESMASHER);
+    write8(BYTESMASHER, fw);
+    write8(BYTESMASHER, fw);write8(BYTESMASHER, fw);
 
     for (int x = 0; x < MAX_CHANNELS; x++)
-        write8(mod->channel_volume[x]);
+        write8(mod->channel_volume[x], fw);
     for (int x = 0; x < MAX_CHANNELS; x++)
-        write8(mod->channel_panning[x]);
+        write8(mod->channel_panning[x], fw);
 
     int z;
     for (z = 0; z < mod->order_count; z++)
@@ -637,82 +716,165 @@ int Write_MAS(MAS_Module *mod, bool verbose, bool msl_dep)
         if (mod->orders[z] < 254)
         {
             if (mod->orders[z] < mod->patt_count)
-                write8(mod->orders[z]);
+                write8(mod->orders[z], fw);
             else
-                write8(254);
+                write8(254, fw);
         }
         else
         {
-            write8(mod->orders[z]);
+            write8(mod->orders[z], fw);
         }
     }
     // When Maxmod finds a 255 it considers it the end of the song.
     for ( ; z < 200; z++)
-        write8(255);
+        write8(255, fw);
 
     // reserve space for offsets
-    int fpos_pointer = file_tell_write();
+    int fpos_pointer = file_tell_write(fw);
     for (int x = 0; x < mod->inst_count * 4 + mod->samp_count * 4 + mod->patt_count * 4; x++)
-        write8(BYTESMASHER); // BA BA BLACK SHEEP
+        write8(BYTESMASHER, fw); // BA BA BLACK SHEEP
 
 /*
     if (msl_dep && target_system == SYSTEM_NDS)
     {
         for (int x = 0; x < rsamp; x++) // write sample indices
-            write16(rsamps[x]);
+            write16(rsamps[x], fw);
     }
 */
 
     // WRITE INSTRUMENTS
 
     if (verbose)
-        printf("Header: %i bytes\n", file_get_byte_count());
+        printf("Header: %i bytes\n", file_get_byte_count(fw));
 
     for (int x = 0; x < mod->inst_count; x++)
-        Write_Instrument(&mod->instruments[x]);
+    {
+        align32(fw);
+        mod->instruments[x].parapointer = file_tell_write(fw) - mas_offset;
+        Write_Instrument(&mod->instruments[x], fw);
+    }
 
     for (int x = 0; x < mod->samp_count; x++)
-        Write_Sample(&mod->samples[x]);
+    {
+        align32(fw); // align data by 32 bits
+        mod->samples[x].parapointer = file_tell_write(fw) - mas_offset;
+        Write_Sample(&mod->samples[x], fw);
+    }
 
     if (verbose)
-        printf("Instruments: %i bytes\n", file_get_byte_count());
+        printf("Instruments: %i bytes\n", file_get_byte_count(fw));
 
     Mark_Patterns(mod);
+
+    // Trackers export many copy-pasted patterns. Patterns whose encoded data
+    // is the same as the one of a previous pattern aren't written again, they
+    // point to the data of the previous pattern.
+    Pattern_Data *patt_data = malloc((mod->patt_count > 0 ? mod->patt_count : 1) *
+                                     sizeof(Pattern_Data));
+
+    // Open addressing hash table of the patterns that have been written. Each
+    // slot holds the index of a pattern plus one, or zero if it's empty. It's
+    // kept under 50% full.
+    u32 table_size = 1;
+    while (table_size < (u32)mod->patt_count * 2)
+        table_size *= 2;
+    u32 table_mask = table_size - 1;
+    u16 *patt_table = calloc(table_size, sizeof(u16));
+
+    if (patt_data == NULL || patt_table == NULL)
+    {
+        printf("Not enough memory to write patterns\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int patt_dups = 0;
+
     for (int x = 0; x < mod->patt_count; x++)
     {
-//        for (y = 0; y < mod->order_count; y++)
-//        {
-//            if (mod->orders[y] == x)
-                Write_Pattern(&mod->patterns[x], mod->xm_mode);
-//        }
+        Pattern *patt = &mod->patterns[x];
+        Pattern_Data *pd = &patt_data[x];
+
+        pd->offset = file_tell_write(fw);
+        Write_Pattern(patt, fw, mod->xm_mode);
+        pd->size = file_tell_write(fw) - pd->offset;
+
+        // The row marks are already part of the encoded data, but include them
+        // anyway so that patterns are only merged if they are really the same.
+        pd->hash = hash_data(patt->cmarks, patt->nrows < 256 ? patt->nrows : 256, 0);
+        pd->hash = hash_data(&fw->data[pd->offset], pd->size, pd->hash);
+
+        patt->parapointer = pd->offset - mas_offset;
+        pd->written = true;
+
+        u32 slot = (u32)pd->hash & table_mask;
+
+        for ( ; patt_table[slot] != 0; slot = (slot + 1) & table_mask)
+        {
+            int y = patt_table[slot] - 1;
+            Pattern_Data *prev = &patt_data[y];
+
+            if (prev->hash != pd->hash || prev->size != pd->size)
+                continue;
+
+            if (memcmp(&fw->data[prev->offset], &fw->data[pd->offset], pd->size) != 0)
+                continue;
+
+            if (mod->patterns[y].nrows != patt->nrows ||
+                memcmp(mod->patterns[y].cmarks, patt->cmarks,
+                       patt->nrows < 256 ? patt->nrows : 256) != 0)
+                continue;
+
+            // Discard the data that has just been written
+            file_truncate_write(pd->offset, fw);
+            patt->parapointer = mod->patterns[y].parapointer;
+            pd->written = false;
+            patt_dups++;
+            break;
+        }
+
+        if (pd->written)
+            patt_table[slot] = x + 1;
     }
-    align32();
+
+    free(patt_table);
+    free(patt_data);
+
+    align32(fw);
 
     if (verbose)
-        printf("Patterns: %i bytes\n", file_get_byte_count());
+    {
+        printf("Patterns: %i bytes\n", file_get_byte_count(fw));
+        if (patt_dups > 0)
+            printf("Duplicated patterns: %i\n", patt_dups);
+    }
 
-    MAS_FILESIZE = file_tell_write() - MAS_OFFSET;
+    u32 mas_size = file_tell_write(fw) - mas_offset;
 
-    file_seek_write(MAS_OFFSET - 8, SEEK_SET);
-    write32(MAS_FILESIZE);
+    write_patch32(mas_offset - 8, mas_size, fw);
 
-    file_seek_write(fpos_pointer, SEEK_SET);
     for (int x = 0; x < mod->inst_count; x++)
-        write32(mod->instruments[x].parapointer);
+    {
+        write_patch32(fpos_pointer, mod->instruments[x].parapointer, fw);
+        fpos_pointer += 4;
+    }
     for (int x = 0; x < mod->samp_count; x++)
     {
         if (verbose)
         {
             printf("sample %s is at %d/%d of %d\n", mod->samples[x].name,
-                   mod->samples[x].parapointer, file_tell_write(),
+                   mod->samples[x].parapointer, fpos_pointer,
                    mod->samples[x].sample_length);
         }
-        write32(mod->samples[x].parapointer);
+        write_patch32(fpos_pointer, mod->samples[x].parapointer, fw);
+        fpos_pointer += 4;
     }
     for (int x = 0; x < mod->patt_count; x++)
-        write32(mod->patterns[x].parapointer);
+    {
+        write_patch32(fpos_pointer, mod->patterns[x].parapointer, fw);
+        fpos_pointer += 4;
+    }
 
-    return MAS_FILESIZE;
+    return mas_size;
 }
 
 void Delete_Module(MAS_Module *mod)
@@ -726,11 +888,1008 @@ void Delete_Module(MAS_Module *mod)
         {
             if (mod->samples[x].data)
                 free(mod->samples[x].data);
+            Sample_FreeSource(&mod->samples[x]);
         }
         free(mod->samples);
     }
     if (mod->patterns)
     {
+        for (int x = 0; x < mod->patt_count; x++)
+            free(mod->patterns[x].data);
         free(mod->patterns);
     }
 }
+
+// Remove the patterns that aren't in the order list, the instruments that
+// aren't used in those patterns and the samples that aren't used by those
+// instruments. The references to the remaining ones are renumbered.
+void Strip_Module(MAS_Module *mod, bool verbose)
+{
+    bool used_patt[256] = { 0 };
+    bool used_inst[256] = { 0 };
+    bool used_samp[256] = { 0 };
+    u8 new_patt[256];
+    u8 new_inst[256];
+    u8 new_samp[256];
+
+    // Check all the orders, not only the ones before the first 255. Position
+    // jumps can go past the end of the song.
+    for (int o = 0; o < mod->order_count; o++)
+    {
+        if (mod->orders[o] < 254 && mod->orders[o] < mod->patt_count)
+            used_patt[mod->orders[o]] = true;
+    }
+
+    for (int p = 0; p < mod->patt_count; p++)
+    {
+        if (!used_patt[p])
+            continue;
+
+        Pattern *patt = &mod->patterns[p];
+
+        for (int x = 0; x < patt->nrows * patt->nchannels; x++)
+        {
+            int inst = patt->data[x].inst;
+            if (inst > 0 && inst <= mod->inst_count)
+                used_inst[inst - 1] = true;
+        }
+    }
+
+    for (int i = 0; i < mod->inst_count; i++)
+    {
+        if (!used_inst[i])
+            continue;
+
+        for (int x = 0; x < 120; x++)
+        {
+            int sample = (mod->instruments[i].notemap[x] >> 8) & 0xFF;
+            if (sample > 0 && sample <= mod->samp_count)
+                used_samp[sample - 1] = true;
+        }
+    }
+
+    // The removed data is written to a buffer to know how much space is saved
+    FileWriter fw;
+    if (verbose)
+        file_open_write_buffer(&fw);
+
+    int patt_count = 0;
+    for (int p = 0; p < mod->patt_count; p++)
+    {
+        Pattern *patt = &mod->patterns[p];
+
+        if (used_patt[p])
+        {
+            new_patt[p] = patt_count;
+            mod->patterns[patt_count++] = *patt;
+            continue;
+        }
+
+        if (verbose)
+        {
+            memset(patt->cmarks, 0, sizeof(patt->cmarks));
+            Write_Pattern(patt, &fw, mod->xm_mode);
+            write32(0, &fw); // Parapointer
+        }
+        free(patt->data);
+    }
+
+    int inst_count = 0;
+    for (int i = 0; i < mod->inst_count; i++)
+    {
+        Instrument *inst = &mod->instruments[i];
+
+        if (used_inst[i])
+        {
+            new_inst[i] = inst_count;
+            mod->instruments[inst_count++] = *inst;
+            continue;
+        }
+
+        if (verbose)
+        {
+            Write_Instrument(inst, &fw);
+            write32(0, &fw); // Parapointer
+        }
+    }
+
+    int samp_count = 0;
+    for (int s = 0; s < mod->samp_count; s++)
+    {
+        Sample *samp = &mod->samples[s];
+
+        if (used_samp[s])
+        {
+            new_samp[s] = samp_count;
+            mod->samples[samp_count++] = *samp;
+            continue;
+        }
+
+        if (verbose)
+        {
+            // In soundbanks the sample data is stored outside of the song
+            Write_Sample(samp, &fw);
+            if (samp->msl_index != 0xFFFF)
+                Write_SampleData(samp, &fw);
+            write32(0, &fw); // Parapointer
+        }
+        free(samp->data);
+        Sample_FreeSource(samp);
+    }
+
+    for (int o = 0; o < mod->order_count; o++)
+    {
+        if (mod->orders[o] < 254)
+            mod->orders[o] = used_patt[mod->orders[o]] ? new_patt[mod->orders[o]] : 254;
+    }
+
+    for (int p = 0; p < patt_count; p++)
+    {
+        Pattern *patt = &mod->patterns[p];
+
+        for (int x = 0; x < patt->nrows * patt->nchannels; x++)
+        {
+            PatternEntry *pe = &patt->data[x];
+            if (pe->inst > 0)
+                pe->inst = (pe->inst <= mod->inst_count) ? new_inst[pe->inst - 1] + 1 : 0;
+        }
+    }
+
+    for (int i = 0; i < inst_count; i++)
+    {
+        u16 *notemap = mod->instruments[i].notemap;
+
+        for (int x = 0; x < 120; x++)
+        {
+            int sample = (notemap[x] >> 8) & 0xFF;
+            if (sample > 0 && sample <= mod->samp_count)
+                notemap[x] = (notemap[x] & 0xFF) | ((new_samp[sample - 1] + 1) << 8);
+        }
+    }
+
+    if (verbose)
+    {
+        size_t saved;
+        free(file_close_write_buffer(&saved, &fw));
+
+        printf("Removed %i patterns, %i instruments and %i samples: %i bytes\n",
+               mod->patt_count - patt_count, mod->inst_count - inst_count,
+               mod->samp_count - samp_count, (int)saved);
+    }
+
+    mod->patt_count = patt_count;
+    mod->inst_count = inst_count;
+    mod->samp_count = samp_count;
+}
+
+// Rate at which the samples are mixed. Frequencies above half of it can't be
+// heard (Maxmod can mix at lower rates on GBA, this is the highest one).
+#define MIX_RATE_GBA        31536
+#define MIX_RATE_NDS        32768
+
+// Samples aren't resampled unless their size goes down at least this much (%)
+#define DOWNSAMPLE_MIN_SAVING   10
+
+// Effects that can lower the pitch of notes, or that depend on the position
+// of the sample data.
+#define FX_PORTA_DOWN       ('E' - 64)
+#define FX_TONE_PORTA       ('G' - 64)
+#define FX_VIBRATO          ('H' - 64)
+#define FX_VIBRATO_VOL      ('K' - 64)
+#define FX_TONE_PORTA_VOL   ('L' - 64)
+#define FX_SAMPLE_OFFSET    ('O' - 64)
+#define FX_FINE_VIBRATO     ('U' - 64)
+
+// Semitones subtracted from the lowest note to account for vibrato
+#define VIBRATO_MARGIN      1
+
+typedef struct tChannel_Pitch
+{
+    bool    insts[256];     // Instruments used in the channel
+    int     margin;         // Semitones that effects subtract from the notes
+    int     min_note;       // Lowest note (after the note map) of the channel
+    bool    porta;          // Tone portamento slides to notes of other samples
+    bool    unsafe;         // The pitch can't be known (portamento down)
+    bool    offset;         // Sample offset effects are used
+}
+Channel_Pitch;
+
+static void Pitch_Effects(Channel_Pitch *ch, const PatternEntry *pe, bool xm_mode)
+{
+    switch (pe->fx)
+    {
+        case FX_PORTA_DOWN:
+            ch->unsafe = true;
+            break;
+        case FX_TONE_PORTA:
+        case FX_TONE_PORTA_VOL:
+            ch->porta = true;
+            break;
+        case FX_VIBRATO:
+        case FX_VIBRATO_VOL:
+        case FX_FINE_VIBRATO:
+            if (ch->margin < VIBRATO_MARGIN)
+                ch->margin = VIBRATO_MARGIN;
+            break;
+        case FX_SAMPLE_OFFSET:
+            ch->offset = true;
+            break;
+    }
+
+    if (xm_mode)
+    {
+        if (pe->vol >= 0xF0) // Tone portamento
+            ch->porta = true;
+        else if (pe->vol >= 0xB0 && pe->vol < 0xC0 && ch->margin < VIBRATO_MARGIN)
+            ch->margin = VIBRATO_MARGIN;
+    }
+    else
+    {
+        if (pe->vol >= 105 && pe->vol <= 114) // Pitch slide down
+            ch->unsafe = true;
+        else if (pe->vol >= 193 && pe->vol <= 202) // Tone portamento
+            ch->porta = true;
+        else if (pe->vol >= 203 && pe->vol <= 212 && ch->margin < VIBRATO_MARGIN)
+            ch->margin = VIBRATO_MARGIN;
+    }
+}
+
+// Semitones that the pitch envelope of an instrument can subtract from its
+// notes. Envelope values are centered at 32.
+static int Pitch_Envelope_Margin(const Instrument *inst)
+{
+    const Instrument_Envelope *env = &inst->envelope_pitch;
+
+    if (!(inst->env_flags & MAS_INSTR_FLAG_PITCH_ENV_EXISTS) || env->env_filter)
+        return 0;
+
+    int margin = 0;
+    for (int x = 0; x < env->node_count && x < 25; x++)
+    {
+        if (32 - env->node_y[x] > margin)
+            margin = 32 - env->node_y[x];
+    }
+
+    return margin;
+}
+
+static int Sample_DataSize(const Sample *samp)
+{
+    if (samp->format & SAMPF_COMP)
+        return samp->sample_length / 2;
+    else if (samp->format & SAMPF_16BIT)
+        return samp->sample_length * 2;
+    else
+        return samp->sample_length;
+}
+
+// Replace the fixed data of a sample by the original data kept by FixSample()
+static void Sample_RestoreSource(Sample *samp)
+{
+    Sample *source = samp->source;
+
+    samp->source = NULL;
+    free(samp->data);
+    samp->data = source->data;
+    samp->sample_length = source->sample_length;
+    samp->loop_start = source->loop_start;
+    samp->loop_end = source->loop_end;
+    samp->loop_type = source->loop_type;
+    samp->format = source->format;
+    samp->frequency = source->frequency;
+    free(source);
+}
+
+void Downsample_Module(MAS_Module *mod, bool verbose)
+{
+    bool used_patt[256] = { 0 };
+    Channel_Pitch *chans = calloc(MAX_CHANNELS, sizeof(Channel_Pitch));
+
+    // Lowest note of each sample in each channel (INT_MAX if it isn't used)
+    int (*min_note)[MAX_CHANNELS] = malloc(256 * sizeof(*min_note));
+
+    if (chans == NULL || min_note == NULL)
+    {
+        printf("Not enough memory to analyze the song\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = 0; s < 256; s++)
+    {
+        for (int c = 0; c < MAX_CHANNELS; c++)
+            min_note[s][c] = INT_MAX;
+    }
+
+    for (int c = 0; c < MAX_CHANNELS; c++)
+        chans[c].min_note = INT_MAX;
+
+    for (int o = 0; o < mod->order_count; o++)
+    {
+        if (mod->orders[o] < 254 && mod->orders[o] < mod->patt_count)
+            used_patt[mod->orders[o]] = true;
+    }
+
+    // First, find the instruments used in each channel, and the effects that
+    // change the pitch of the notes of the channel.
+    for (int p = 0; p < mod->patt_count; p++)
+    {
+        Pattern *patt = &mod->patterns[p];
+
+        if (!used_patt[p])
+            continue;
+
+        for (int r = 0; r < patt->nrows; r++)
+        {
+            for (int c = 0; c < patt->nchannels && c < MAX_CHANNELS; c++)
+            {
+                const PatternEntry *pe = &patt->data[r * patt->nchannels + c];
+
+                if (pe->inst > 0 && pe->inst <= mod->inst_count)
+                    chans[c].insts[pe->inst - 1] = true;
+
+                Pitch_Effects(&chans[c], pe, mod->xm_mode);
+            }
+        }
+    }
+
+    // Now, find the lowest note that each sample is played at. Notes without
+    // an instrument at the start of a pattern could be played by any of the
+    // instruments used in the channel.
+    for (int p = 0; p < mod->patt_count; p++)
+    {
+        Pattern *patt = &mod->patterns[p];
+        int current[MAX_CHANNELS] = { 0 };
+
+        if (!used_patt[p])
+            continue;
+
+        for (int r = 0; r < patt->nrows; r++)
+        {
+            for (int c = 0; c < patt->nchannels && c < MAX_CHANNELS; c++)
+            {
+                const PatternEntry *pe = &patt->data[r * patt->nchannels + c];
+
+                if (pe->inst > 0 && pe->inst <= mod->inst_count)
+                    current[c] = pe->inst;
+
+                if (pe->note >= 120)
+                    continue;
+
+                for (int i = 0; i < mod->inst_count; i++)
+                {
+                    if (current[c] != 0 ? (i != current[c] - 1) : !chans[c].insts[i])
+                        continue;
+
+                    const Instrument *inst = &mod->instruments[i];
+                    int sample = (inst->notemap[pe->note] >> 8) & 0xFF;
+                    int note = (inst->notemap[pe->note] & 0xFF) - Pitch_Envelope_Margin(inst);
+
+                    if (sample == 0 || sample > mod->samp_count)
+                        continue;
+
+                    if (note < min_note[sample - 1][c])
+                        min_note[sample - 1][c] = note;
+                    if (note < chans[c].min_note)
+                        chans[c].min_note = note;
+                }
+            }
+        }
+    }
+
+    u32 mix_rate = (target_system == SYSTEM_GBA) ? MIX_RATE_GBA : MIX_RATE_NDS;
+    int count = 0;
+    int saved = 0;
+
+    for (int s = 0; s < mod->samp_count; s++)
+    {
+        Sample *samp = &mod->samples[s];
+        int lowest = INT_MAX;
+        bool unsafe = false;
+
+        for (int c = 0; c < MAX_CHANNELS; c++)
+        {
+            if (min_note[s][c] == INT_MAX)
+                continue;
+
+            Channel_Pitch *ch = &chans[c];
+            int note = ch->porta ? ch->min_note : min_note[s][c];
+
+            if (ch->unsafe || ch->offset)
+                unsafe = true;
+            if (note - ch->margin < lowest)
+                lowest = note - ch->margin;
+        }
+
+        if (unsafe || lowest == INT_MAX || samp->source == NULL)
+            continue;
+
+        // The auto-vibrato of the sample goes below every note it plays
+        if (samp->vibdepth != 0)
+            lowest -= VIBRATO_MARGIN;
+
+        // Note 60 (C-5) is played at the sample rate of the sample. At higher
+        // notes the frequencies of the sample go up, and the ones that end up
+        // over the limit of the mixer can't be heard. The lowest note is the
+        // one that needs the highest sample rate.
+        double ratio = pow(2.0, (lowest - 60) / 12.0);
+        double rate = ceil(mix_rate / ratio);
+
+        if (rate * 100 > (double)samp->frequency * (100 - DOWNSAMPLE_MIN_SAVING))
+            continue;
+
+        if (verbose)
+        {
+            printf("Sample %d (lowest note %d): %u Hz -> %u Hz\n", s + 1, lowest,
+                   (unsigned int)samp->frequency, (unsigned int)rate);
+        }
+
+        // Resample the original sample and fix it again
+        int old_size = Sample_DataSize(samp);
+
+        Sample_RestoreSource(samp);
+        Sample_SetRate(samp, (u32)rate);
+        FixSample(samp);
+
+        count++;
+        saved += old_size - Sample_DataSize(samp);
+    }
+
+    if (verbose && count > 0)
+        printf("Downsampled %d samples: %d bytes\n", count, saved);
+
+    free(min_note);
+    free(chans);
+}
+
+// Samples kept after the furthest position that the songs can reach, for the
+// interpolation of the mixer and to cover rounding errors in the analysis.
+#define TRIM_MARGIN         64
+
+// Trailing data quieter than this (out of 32768, about -60 dB) is removed
+#define TRIM_SILENCE        32
+
+// The analysis gives up if the song doesn't loop after this many rows
+#define TRIM_MAX_ROWS       (1 << 20)
+
+// Effects that change the timing of the song, or that can raise the pitch of
+// notes (the ones that lower it only make samples play slower).
+#define FX_SET_SPEED        ('A' - 64)
+#define FX_POSITION_JUMP    ('B' - 64)
+#define FX_PATTERN_BREAK    ('C' - 64)
+#define FX_PORTA_UP         ('F' - 64)
+#define FX_ARPEGGIO         ('J' - 64)
+#define FX_EXTENDED         ('S' - 64)
+#define FX_SET_TEMPO        ('T' - 64)
+#define FX_KEY_OFF          28 // Kxx of XM
+
+typedef struct tChannel_Play
+{
+    int     inst;           // Last instrument of the channel (1-based)
+    int     note_inst;      // Instrument of the note being played
+    int     sample;         // Sample being played (1-based, 0 if none)
+    int     note;           // Highest note the sample can be playing at
+    int     rise;           // Semitones that effects add to the note
+    int     stop;           // Ticks left until the note stops (-1 if unknown)
+    double  position;       // Furthest position of the sample reached so far
+    bool    unbounded;      // The pitch or position can't be known
+    bool    carried;        // The note was playing when the song looped
+    int     offset;         // Last sample offset effect
+    int     loop_row;       // Start of the pattern loop
+    int     loop_count;     // Iterations of the pattern loop left
+}
+Channel_Play;
+
+typedef struct tTrim_State
+{
+    const MAS_Module *mod;
+    double  *reach;         // Furthest position of each sample (-1 if unused)
+    bool    *unbounded;     // The furthest position of the sample isn't known
+    double  tick_time;      // Length of a tick in seconds
+}
+Trim_State;
+
+// Semitones that the pitch envelope of an instrument can add to its notes
+static int Pitch_Envelope_Rise(const Instrument *inst)
+{
+    const Instrument_Envelope *env = &inst->envelope_pitch;
+
+    if (!(inst->env_flags & MAS_INSTR_FLAG_PITCH_ENV_EXISTS) || env->env_filter)
+        return 0;
+
+    int rise = 0;
+    for (int x = 0; x < env->node_count && x < 25; x++)
+    {
+        if (env->node_y[x] - 32 > rise)
+            rise = env->node_y[x] - 32;
+    }
+
+    return rise;
+}
+
+// Ticks that a note keeps playing after a note off, or -1 if it isn't known.
+// In XM songs the volume is set to 0 if there is no volume envelope. If there
+// is one the note fades out, and how long that takes depends on the player, so
+// it isn't analyzed. IT songs can keep playing the note until the volume
+// envelope ends, so they aren't analyzed either.
+static int Trim_KeyOffTicks(const MAS_Module *mod, int inst)
+{
+    if (!mod->xm_mode || inst == 0 || inst > mod->inst_count)
+        return -1;
+
+    const Instrument *ins = &mod->instruments[inst - 1];
+
+    if (!(ins->env_flags & MAS_INSTR_FLAG_VOL_ENV_ENABLED))
+        return 0;
+
+    return -1;
+}
+
+// Stop the note of a channel and save how far the sample has been played
+static void Trim_Stop(Trim_State *st, Channel_Play *ch, bool unbounded)
+{
+    if (ch->sample == 0)
+        return;
+
+    int s = ch->sample - 1;
+
+    if (unbounded || ch->unbounded)
+        st->unbounded[s] = true;
+    if (ch->position > st->reach[s])
+        st->reach[s] = ch->position;
+
+    ch->sample = 0;
+}
+
+// Play the note of a channel during some ticks. Note 60 (C-5) plays the
+// sample at its sample rate.
+static void Trim_Play(Trim_State *st, Channel_Play *ch, int ticks)
+{
+    if (ch->sample == 0 || ticks <= 0)
+        return;
+
+    if (ch->stop >= 0 && ch->stop < ticks)
+        ticks = ch->stop;
+
+    const Sample *samp = &st->mod->samples[ch->sample - 1];
+    u32 rate = samp->source ? samp->source->frequency : samp->frequency;
+
+    ch->position += ticks * st->tick_time * rate
+                  * pow(2.0, (ch->note + ch->rise - 60) / 12.0);
+
+    if (ch->stop >= 0)
+    {
+        ch->stop -= ticks;
+        if (ch->stop == 0)
+            Trim_Stop(st, ch, false);
+    }
+}
+
+static void Trim_SetStop(Trim_State *st, Channel_Play *ch, int ticks)
+{
+    if (ch->sample == 0 || ticks < 0)
+        return;
+
+    if (ticks == 0)
+        Trim_Stop(st, ch, false);
+    else if (ch->stop < 0 || ticks < ch->stop)
+        ch->stop = ticks;
+}
+
+// Note after the note map of an instrument, and sample (1-based) that plays it
+static int Trim_MapNote(const MAS_Module *mod, int inst, int note, int *sample)
+{
+    *sample = 0;
+
+    if (inst == 0 || inst > mod->inst_count)
+        return note;
+
+    const Instrument *ins = &mod->instruments[inst - 1];
+
+    *sample = (ins->notemap[note] >> 8) & 0xFF;
+    if (*sample > mod->samp_count)
+        *sample = 0;
+
+    return (ins->notemap[note] & 0xFF) + Pitch_Envelope_Rise(ins);
+}
+
+static void Trim_Channel(Trim_State *st, Channel_Play *ch, const PatternEntry *pe,
+                         int speed, int ticks)
+{
+    const MAS_Module *mod = st->mod;
+    int event = -1;     // Tick of the event of the note column
+    int cut = INT_MAX;  // Tick at which the note stops (from the row start)
+    bool porta = false;
+
+    if (pe->inst > 0 && pe->inst <= mod->inst_count)
+        ch->inst = pe->inst;
+
+    if (pe->fx == FX_TONE_PORTA || pe->fx == FX_TONE_PORTA_VOL)
+        porta = true;
+    if (mod->xm_mode ? (pe->vol >= 0xF0) : (pe->vol >= 193 && pe->vol <= 202))
+        porta = true;
+
+    if (pe->note < 120 || pe->note == 254 || pe->note == 255)
+    {
+        event = 0;
+        if (pe->fx == FX_EXTENDED && (pe->param >> 4) == 0xD)
+            event = pe->param & 0xF;
+
+        // Notes delayed past the end of the row aren't played
+        if (event >= speed)
+            event = -1;
+    }
+
+    if (pe->fx == FX_EXTENDED && (pe->param >> 4) == 0xC)
+    {
+        int tick = (pe->param & 0xF) ? (pe->param & 0xF) : 1;
+        if (tick < speed)
+            cut = tick;
+    }
+    else if (pe->fx == FX_KEY_OFF && pe->param < speed)
+    {
+        int fade = Trim_KeyOffTicks(mod, ch->note_inst);
+        if (fade >= 0)
+            cut = pe->param + fade;
+    }
+
+    int t = 0;
+
+    if (event >= 0)
+    {
+        if (cut < event)
+        {
+            Trim_SetStop(st, ch, cut);
+            cut = INT_MAX;
+        }
+
+        Trim_Play(st, ch, event);
+        t = event;
+
+        if (pe->note == 254)
+        {
+            Trim_Stop(st, ch, false);
+        }
+        else if (pe->note == 255)
+        {
+            Trim_SetStop(st, ch, Trim_KeyOffTicks(mod, ch->note_inst));
+        }
+        else if (porta && ch->sample != 0)
+        {
+            // Tone portamento slides the note that is playing to the new one
+            int sample;
+            int note = Trim_MapNote(mod, ch->inst, pe->note, &sample);
+            if (note > ch->note)
+                ch->note = note;
+        }
+        else
+        {
+            // With a new note action other than "cut", the old note keeps
+            // playing in the background in IT songs.
+            bool background = !mod->xm_mode && ch->note_inst != 0
+                              && mod->instruments[ch->note_inst - 1].nna != 0;
+            Trim_Stop(st, ch, background);
+
+            int sample;
+            int note = Trim_MapNote(mod, ch->inst, pe->note, &sample);
+
+            if (pe->fx == FX_SAMPLE_OFFSET && pe->param != 0)
+                ch->offset = pe->param * 256;
+
+            ch->note_inst = ch->inst;
+            ch->sample = sample;
+            ch->note = note;
+            ch->rise = 0;
+            ch->stop = -1;
+            ch->position = (pe->fx == FX_SAMPLE_OFFSET) ? ch->offset : 0;
+            ch->unbounded = false;
+            ch->carried = false;
+
+            if (sample != 0 && mod->samples[sample - 1].vibdepth != 0)
+                ch->rise = VIBRATO_MARGIN;
+        }
+    }
+
+    if (cut != INT_MAX)
+        Trim_SetStop(st, ch, cut - t);
+
+    // Effects that raise the pitch of the note
+    switch (pe->fx)
+    {
+        case FX_PORTA_UP:
+            ch->unbounded = true;
+            break;
+        case FX_VIBRATO:
+        case FX_VIBRATO_VOL:
+        case FX_FINE_VIBRATO:
+            if (ch->rise < VIBRATO_MARGIN)
+                ch->rise = VIBRATO_MARGIN;
+            break;
+        case FX_ARPEGGIO:
+        {
+            // J00 repeats the last arpeggio in IT songs
+            int rise = pe->param ? (pe->param >> 4) : 15;
+            if (rise < (pe->param & 0xF))
+                rise = pe->param & 0xF;
+            if (ch->rise < rise)
+                ch->rise = rise;
+            break;
+        }
+        case FX_EXTENDED:
+            if ((pe->param >> 4) == 0xA) // High sample offset
+                ch->unbounded = true;
+            break;
+    }
+
+    if (mod->xm_mode)
+    {
+        if (pe->vol >= 0xB0 && pe->vol < 0xC0 && ch->rise < VIBRATO_MARGIN)
+            ch->rise = VIBRATO_MARGIN;
+    }
+    else
+    {
+        if (pe->vol >= 115 && pe->vol <= 124) // Pitch slide up
+            ch->unbounded = true;
+        else if (pe->vol >= 203 && pe->vol <= 212 && ch->rise < VIBRATO_MARGIN)
+            ch->rise = VIBRATO_MARGIN;
+    }
+
+    Trim_Play(st, ch, ticks - t);
+}
+
+// Entry of a channel in a row of a pattern. Pattern_Trim() removes the empty
+// channels at the right of the pattern, but the notes that were started in
+// them in previous patterns keep playing.
+static const PatternEntry *Trim_Entry(const Pattern *patt, int row, int channel)
+{
+    static const PatternEntry empty = { .note = 250 };
+
+    if (channel >= patt->nchannels)
+        return &empty;
+
+    return &patt->data[row * patt->nchannels + channel];
+}
+
+// First order at or after the given one that plays a pattern, wrapping around
+// to the restart position at the end of the song. Returns -1 if there isn't
+// any.
+static int Trim_NextOrder(const MAS_Module *mod, int order)
+{
+    for (int x = 0; x < 512; x++)
+    {
+        if (order >= mod->order_count || mod->orders[order] == 255)
+            order = mod->restart_pos;
+        else if (mod->orders[order] == 254)
+            order++;
+        else
+            return (mod->orders[order] < mod->patt_count) ? order : -1;
+    }
+
+    return -1;
+}
+
+// Absolute value of a sample of original (unsigned) data, out of 32768
+static int Sample_Level(const Sample *samp, u32 pos)
+{
+    if (samp->format & SAMPF_16BIT)
+        return abs((int)((u16 *)samp->data)[pos] - 32768);
+    else
+        return abs((int)((u8 *)samp->data)[pos] - 128) * 256;
+}
+
+void Trim_Module(MAS_Module *mod, bool verbose)
+{
+    Channel_Play *chans = calloc(MAX_CHANNELS, sizeof(Channel_Play));
+    double *reach = malloc((mod->samp_count + 1) * sizeof(double));
+    bool *unbounded = calloc(mod->samp_count + 1, sizeof(bool));
+    u8 (*visits)[256] = calloc(256, sizeof(*visits));
+
+    if (chans == NULL || reach == NULL || unbounded == NULL || visits == NULL)
+    {
+        printf("Not enough memory to analyze the song\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int s = 0; s < mod->samp_count; s++)
+        reach[s] = -1;
+
+    Trim_State st = { mod, reach, unbounded, 0 };
+
+    int speed = mod->initial_speed ? mod->initial_speed : 6;
+    int tempo = (mod->initial_tempo >= 32) ? mod->initial_tempo : 125;
+    int order = 0;
+    int row = 0;
+    int rows = 0;
+    bool looped = false;
+    bool complete = false;
+
+    // Play the song until it loops for the second time. The notes that were
+    // playing when it looped for the first time and are still playing can
+    // play the rest of their samples.
+    while (rows++ < TRIM_MAX_ROWS)
+    {
+        order = Trim_NextOrder(mod, order);
+        if (order < 0)
+            break;
+
+        Pattern *patt = &mod->patterns[mod->orders[order]];
+        if (row >= patt->nrows)
+            row = 0;
+
+        bool in_loop = false;
+        for (int c = 0; c < MAX_CHANNELS; c++)
+            in_loop |= chans[c].loop_count > 0;
+
+        // Rows repeated by pattern loops don't mean that the song has looped
+        if (!in_loop)
+        {
+            if (visits[order][row] == 2)
+            {
+                complete = true;
+                break;
+            }
+
+            if (visits[order][row] == 1 && !looped)
+            {
+                looped = true;
+                for (int c = 0; c < MAX_CHANNELS; c++)
+                    chans[c].carried = chans[c].sample != 0;
+            }
+
+            visits[order][row]++;
+        }
+
+        int delay = 0;
+        int jump = -1;
+        int next_row = -1;
+
+        for (int c = 0; c < MAX_CHANNELS; c++)
+        {
+            const PatternEntry *pe = Trim_Entry(patt, row, c);
+
+            if (pe->fx == FX_SET_SPEED && pe->param != 0)
+            {
+                speed = pe->param;
+            }
+            else if (pe->fx == FX_SET_TEMPO)
+            {
+                // Tempo slides down are applied in full at the start of the
+                // row, slides up are ignored.
+                if (mod->xm_mode || pe->param >= 0x20)
+                    tempo = pe->param;
+                else if ((pe->param >> 4) == 0)
+                    tempo -= (pe->param & 0xF) * (speed - 1);
+
+                if (tempo < 32)
+                    tempo = 32;
+            }
+            else if (pe->fx == FX_POSITION_JUMP)
+            {
+                jump = pe->param;
+            }
+            else if (pe->fx == FX_PATTERN_BREAK)
+            {
+                next_row = pe->param;
+            }
+            else if (pe->fx == FX_EXTENDED && (pe->param >> 4) == 0xE)
+            {
+                if ((pe->param & 0xF) > delay)
+                    delay = pe->param & 0xF;
+            }
+        }
+
+        // The tempo is the number of ticks per 2.5 seconds
+        st.tick_time = 2.5 / tempo;
+
+        for (int c = 0; c < MAX_CHANNELS; c++)
+            Trim_Channel(&st, &chans[c], Trim_Entry(patt, row, c), speed, speed * (1 + delay));
+
+        int loop_row = -1;
+
+        for (int c = 0; c < MAX_CHANNELS; c++)
+        {
+            const PatternEntry *pe = Trim_Entry(patt, row, c);
+            Channel_Play *ch = &chans[c];
+
+            if (pe->fx != FX_EXTENDED || (pe->param >> 4) != 0xB)
+                continue;
+
+            if ((pe->param & 0xF) == 0)
+            {
+                ch->loop_row = row;
+            }
+            else if (ch->loop_count == 0)
+            {
+                ch->loop_count = pe->param & 0xF;
+                loop_row = ch->loop_row;
+            }
+            else if (--ch->loop_count > 0)
+            {
+                loop_row = ch->loop_row;
+            }
+        }
+
+        if (loop_row >= 0)
+        {
+            row = loop_row;
+            continue;
+        }
+
+        if (jump >= 0 || next_row >= 0)
+        {
+            order = (jump >= 0) ? jump : order + 1;
+            row = (next_row >= 0) ? next_row : 0;
+        }
+        else if (++row >= patt->nrows)
+        {
+            order++;
+            row = 0;
+        }
+        else
+        {
+            continue;
+        }
+
+        for (int c = 0; c < MAX_CHANNELS; c++)
+            chans[c].loop_row = 0;
+    }
+
+    for (int c = 0; c < MAX_CHANNELS; c++)
+        Trim_Stop(&st, &chans[c], chans[c].carried);
+
+    // If the song couldn't be followed until the end, any sample may be
+    // played further than what has been found.
+    if (!complete)
+    {
+        for (int s = 0; s < mod->samp_count; s++)
+            unbounded[s] = true;
+    }
+
+    int count = 0;
+    int saved = 0;
+
+    for (int s = 0; s < mod->samp_count; s++)
+    {
+        Sample *samp = &mod->samples[s];
+        Sample *source = samp->source;
+
+        if (source == NULL || source->loop_type != 0)
+            continue;
+        if (reach[s] < 0 && !unbounded[s])
+            continue;
+
+        u32 length = source->sample_length;
+
+        if (!unbounded[s] && reach[s] + TRIM_MARGIN < length)
+            length = (u32)ceil(reach[s]) + TRIM_MARGIN;
+
+        while (length > 1 && Sample_Level(source, length - 1) <= TRIM_SILENCE)
+            length--;
+
+        if (length >= source->sample_length)
+            continue;
+
+        if (verbose)
+        {
+            printf("Sample %d: %u -> %u samples\n", s + 1,
+                   (unsigned int)source->sample_length, (unsigned int)length);
+        }
+
+        // Fix the original sample again with the new length
+        int old_size = Sample_DataSize(samp);
+
+        Sample_RestoreSource(samp);
+        samp->sample_length = length;
+        FixSample(samp);
+
+        count++;
+        saved += old_size - Sample_DataSize(samp);
+    }
+
+    if (verbose && count > 0)
+        printf("Trimmed %d samples: %d bytes\n", count, saved);
+
+    free(visits);
+    free(unbounded);
+    free(reach);
+    free(chans);
+}
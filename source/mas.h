@@ -13,6 +13,8 @@
 #ifndef MAS_H__
 #define MAS_H__
 
+#include "files.h"
+
 // Flags used to determine the characteristics of samples in an input module
 // file. Not all combinations are supported in a MAS sample.
 
@@ -120,6 +122,15 @@ typedef struct tSample
     u8      it_compression;
     char    name[32];
     char    filename[12];
+
+    // Number of sample points added by FixSample() as padding and to unroll
+    // the loop
+    u32     fix_padding;
+    u32     fix_unrolled;
+
+    // Copy of the sample before FixSample() modified it (only if
+    // fix_keep_source is set)
+    struct tSample *source;
 }
 Sample;
 
@@ -133,12 +144,15 @@ typedef struct tPatternEntry
 }
 PatternEntry;
 
+// Patterns only store the channels up to the last one that isn't empty. The
+// entry of row "r" and channel "c" is data[r * nchannels + c].
 typedef struct tPattern
 {
     u32             parapointer;
     u16             nrows;
+    u8              nchannels;
     int             clength;
-    PatternEntry    data[MAX_CHANNELS*256];
+    PatternEntry   *data;
     bool            cmarks[256];
 }
 Pattern;
@@ -170,16 +184,24 @@ typedef struct tMAS_Module
 }
 MAS_Module;
 
-void Write_Instrument_Envelope(Instrument_Envelope *env);
-void Write_Instrument(Instrument *inst);
-void Write_SampleData(Sample *samp);
-void Write_Sample(Sample *samp);
-void Write_Pattern(Pattern *patt, bool xm_vol);
-int Write_MAS(MAS_Module *mod, bool verbose, bool msl_dep);
+void Write_Instrument_Envelope(Instrument_Envelope *env, FileWriter *fw);
+void Write_Instrument(Instrument *inst, FileWriter *fw);
+void Write_SampleData(Sample *samp, FileWriter *fw);
+void Write_Sample(Sample *samp, FileWriter *fw);
+void Pattern_Alloc(Pattern *patt, int nrows, int nchannels, const PatternEntry *empty);
+void Pattern_Trim(Pattern *patt, const PatternEntry *empty);
+void Write_Pattern(Pattern *patt, FileWriter *fw, bool xm_vol);
+int Write_MAS(MAS_Module *mod, FileWriter *fw, bool verbose, bool msl_dep);
 void Delete_Module(MAS_Module *mod);
 
-void Sanitize_Module(MAS_Module *mod, bool verbose);
+// Set by -u, -a and -t
+extern bool strip_unused;
+extern bool downsample_notes;
+extern bool trim_samples;
 
-extern u32 MAS_FILESIZE;
+void Sanitize_Module(MAS_Module *mod, bool verbose);
+void Strip_Module(MAS_Module *mod, bool verbose);
+void Downsample_Module(MAS_Module *mod, bool verbose);
+void Trim_Module(MAS_Module *mod, bool verbose);
 
 #endif // MAS_H__
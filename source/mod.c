@@ -62,37 +62,31 @@ int Create_MOD_Instrument(Instrument *inst, u8 sample)
     return ERR_NONE;
 }
 
-int Load_MOD_SampleData(Sample *samp)
+int Load_MOD_SampleData(Sample *samp, FileReader *fr)
 {
     if (samp->sample_length > 0)
-    {
-        // allocate a SAMPLE_LENGTH sized pointer to buffer in memory and load the sample into it
-        samp->data = malloc(samp->sample_length);
-        for (u32 t = 0; t < samp->sample_length; t++)
-            ((u8*)samp->data)[t] = read8() + 128; // unsign data
-    }
+        Sample_ReadData(samp, fr, SAMP_FORMAT_S8, false);
     FixSample(samp);
     return ERR_NONE;
 }
 
-int Load_MOD_Pattern(Pattern *patt, u8 nchannels, u8 *inst_count)
+int Load_MOD_Pattern(Pattern *patt, FileReader *fr, u8 nchannels, u8 *inst_count)
 {
+    static const PatternEntry empty = { .note = 250 };
+
     memset(patt, 0, sizeof(Pattern));
-    patt->nrows = 64; // MODs have fixed 64 rows per pattern
 
-    for (u32 row = 0; row < 64 * MAX_CHANNELS; row++)
-    {
-        patt->data[row].note = 250;
-    }
+    // MODs have fixed 64 rows per pattern
+    Pattern_Alloc(patt, 64, nchannels, &empty);
 
     for (u32 row = 0; row < 64; row++)
     {
         for (u32 col = 0; col < nchannels; col++)
         {
-            u8 data1 = read8();    // +-------------------------------------+
-            u8 data2 = read8();    // | Byte 0    Byte 1   Byte 2   Byte 3  |
-            u8 data3 = read8();    // |-------------------------------------|
-            u8 data4 = read8();    // |aaaaBBBB CCCCCCCCC DDDDeeee FFFFFFFFF|
+            u8 data1 = read8(fr);    // +-------------------------------------+
+            u8 data2 = read8(fr);    // | Byte 0    Byte 1   Byte 2   Byte 3  |
+            u8 data3 = read8(fr);    // |-------------------------------------|
+            u8 data4 = read8(fr);    // |aaaaBBBB CCCCCCCCC DDDDeeee FFFFFFFFF|
                                    // +-------------------------------------+
 
             u16 period = (data1 & 0xf) * 256 + data2; // BBBBCCCCCCCC = sample period value
@@ -109,7 +103,7 @@ int Load_MOD_Pattern(Pattern *patt, u8 nchannels, u8 *inst_count)
                         param &= 0xF0;
             }
 
-            PatternEntry* p = &patt->data[row * MAX_CHANNELS + col]; // copy data to pattern entry
+            PatternEntry* p = &patt->data[row * nchannels + col]; // copy data to pattern entry
 
             p->inst = inst;
             CONV_XM_EFFECT(&effect, &param);
@@ -127,28 +121,31 @@ int Load_MOD_Pattern(Pattern *patt, u8 nchannels, u8 *inst_count)
             }
         }
     }
+
+    Pattern_Trim(patt, &empty);
+
     return ERR_NONE;
 }
 
-int Load_MOD_Sample(Sample *samp, bool verbose, int index)
+int Load_MOD_Sample(Sample *samp, FileReader *fr, bool verbose, int index)
 {
     memset(samp, 0, sizeof(Sample));
     samp->msl_index = 0xFFFF;
 
     for (int x = 0; x < 22; x++) // 22 bytes : SAMPLE_NAME
-        samp->name[x] = read8();
+        samp->name[x] = read8(fr);
     for (int x = 0; x < 12; x++) // copy to filename
         samp->filename[x] = samp->name[x];
 
-    samp->sample_length = (read8() * 256 + read8()) * 2; // 2 bytes : SAMPLE_LENGTH
+    samp->sample_length = (read8(fr) * 256 + read8(fr)) * 2; // 2 bytes : SAMPLE_LENGTH
 
-    int finetune = read8(); // 1 byte : FINE_TUNE
+    int finetune = read8(fr); // 1 byte : FINE_TUNE
     if (finetune >= 8)
         finetune -= 16;
 
-    samp->default_volume = read8(); // 1 byte : VOLUME
-    samp->loop_start = (read8() * 256 + read8()) * 2; // 2 bytes : LOOP_START
-    samp->loop_end = samp->loop_start + (read8() * 256 + read8()) * 2; // 2 bytes : LOOP_LENGTH
+    samp->default_volume = read8(fr); // 1 byte : VOLUME
+    samp->loop_start = (read8(fr) * 256 + read8(fr)) * 2; // 2 bytes : LOOP_START
+    samp->loop_end = samp->loop_start + (read8(fr) * 256 + read8(fr)) * 2; // 2 bytes : LOOP_LENGTH
 
     // calculate frequency...
     // IS THIS WRONG?? :
@@ -194,19 +191,19 @@ int Load_MOD_Sample(Sample *samp, bool verbose, int index)
     return ERR_NONE;
 }
 
-int Load_MOD(MAS_Module *mod, bool verbose)
+int Load_MOD(MAS_Module *mod, FileReader *fr, bool verbose)
 {
     if (verbose)
         printf("Loading MOD, ");
 
     memset(mod, 0, sizeof(MAS_Module));
 
-    u32 file_start = file_tell_read();
-    file_seek_read(0x438, SEEK_SET);    // Seek to offset 1080 (438h) in the file
+    u32 file_start = file_tell_read(fr);
+    file_seek_read(0x438, SEEK_SET, fr);    // Seek to offset 1080 (438h) in the file
 
     char sigs[5];
 
-    u32 sig = read32(); // read in 4 bytes
+    u32 sig = read32(fr); // read in 4 bytes
     sigs[0] = sig & 0xFF;
     sigs[1] = (sig >> 8) & 0xFF;
     sigs[2] = (sig >> 16) & 0xFF;
@@ -264,9 +261,9 @@ int Load_MOD(MAS_Module *mod, bool verbose)
         }
     }
 
-    file_seek_read(file_start, SEEK_SET); // - Seek back to position 0, the start of the file
+    file_seek_read(file_start, SEEK_SET, fr); // - Seek back to position 0, the start of the file
     for (int x = 0; x < 20; x++)
-        mod->title[x] = read8();          // - read in 20 bytes, store as MODULE_NAME.
+        mod->title[x] = read8(fr);          // - read in 20 bytes, store as MODULE_NAME.
 
     if (verbose)
     {
@@ -315,7 +312,7 @@ int Load_MOD(MAS_Module *mod, bool verbose)
     {
     //    if (verbose)
             //printf("Loading Sample %i...\n", x+1);
-        Load_MOD_Sample(&mod->samples[x], verbose, x);
+        Load_MOD_Sample(&mod->samples[x], fr, verbose, x);
 
         // Only setup instrument for samples that have any length
         if (mod->samples[x].sample_length != 0)
@@ -325,11 +322,11 @@ int Load_MOD(MAS_Module *mod, bool verbose)
     // Read sequence
 
     // read a byte, store as SONG_LENGTH (this is the number of orders in a song)
-    mod->order_count = read8();
+    mod->order_count = read8(fr);
     // read a byte, discard it (this is the UNUSED byte - used to be used in PT
     // as the restart position, but not now since jump to pattern was
     // introduced)
-    mod->restart_pos = read8();
+    mod->restart_pos = read8(fr);
     if (mod->restart_pos >= 127)
         mod->restart_pos = 0;
 
@@ -337,14 +334,14 @@ int Load_MOD(MAS_Module *mod, bool verbose)
     for (int x = 0; x < 128; x++) // from this point, loop 128 times
     {
         // read 1 byte, store it as ORDER <loopcounter>
-        mod->orders[x] = read8();
+        mod->orders[x] = read8(fr);
         // if this value was bigger than NUMBER_OF_PATTERNS then set it to that value.
         if (mod->orders[x] >= npatterns)
             npatterns=mod->orders[x] + 1;
     }
 
     // read 4 bytes, discard them (we are at position 1080 again, this is M.K. etc!)
-    read32();
+    read32(fr);
 
     mod->patt_count = npatterns;
     mod->patterns = (Pattern *)calloc(mod->patt_count, sizeof(Pattern));
@@ -366,7 +363,7 @@ int Load_MOD(MAS_Module *mod, bool verbose)
         {
             printf(vstr_mod_pattern, x + 1, ((x + 1) % 15) ? "" : "\n");
         }
-        Load_MOD_Pattern(&mod->patterns[x], (u8)mod_channels, &(mod->inst_count));
+        Load_MOD_Pattern(&mod->patterns[x], fr, (u8)mod_channels, &(mod->inst_count));
     }
 
     if (verbose)
@@ -382,7 +379,7 @@ int Load_MOD(MAS_Module *mod, bool verbose)
     mod->samp_count = mod->inst_count;
     for (int x = 0; x < 31; x++)
     {
-        Load_MOD_SampleData(&mod->samples[x]);
+        Load_MOD_SampleData(&mod->samples[x], fr);
     }
 
     if (verbose)
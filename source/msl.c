@@ -12,10 +12,12 @@
 
 // MAXMOD SOUNDBANK
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #include "errors.h"
 #include "defs.h"
@@ -30,220 +32,660 @@
 #include "version.h"
 #include "systems.h"
 #include "samplefix.h"
+#include "cache.h"
+#include "manifest.h"
 
 FILE *F_SCRIPT = NULL;
 
-FILE *F_SAMP = NULL;
-FILE *F_SONG = NULL;
-
-FILE *F_HEADER = NULL;
+// The header is built in memory and only written if it has changed, so that
+// the files that include it aren't rebuilt every time the soundbank is built.
+FileWriter *F_HEADER = NULL;
 
 u16 MSL_NSAMPS;
 u16 MSL_NSONGS;
 
+int MSL_JOBS = 1;
+
+char *MSL_DEPFILE = NULL;
+
+char *MSL_REPORT = NULL;
+
+u32 MSL_BUDGET = 0;
+u32 MSL_SONG_BUDGET = 0;
+
 char str_msl[256];
 
-static char TMP_SAMP[] = "mm_samp_tmp.XXXXXXX";
-static char TMP_SONG[] = "mm_song_tmp.XXXXXXX";
+// Samples and songs are stored in memory until the soundbank is exported. Each
+// entry is stored the same way as in the final file: a 32-bit size followed by
+// 4 bytes of information and the data itself.
+static FileWriter msl_samp_data;
+static FileWriter msl_song_data;
 
 void MSL_PrintDefinition(char *filename, u16 id, char *prefix);
 
-#define SAMPLE_HEADER_SIZE (12 + ((target_system == SYSTEM_NDS) ? 4 : 0))
+// Index of the samples added to the soundbank, used to find duplicated samples
+// without having to compare them with all the samples that have been added.
+typedef struct tMSL_SampleEntry
+{
+    u64 hash;
+    u32 offset; // Offset of the sample data in msl_samp_data
+    u32 size;   // Size of the sample data (header included)
+
+    // Information used in size reports
+    const char *file;   // Input file that added the sample
+    u32 index;          // Index of the sample in that file
+    char name[13];
+    u32 padding;
+    u32 unrolled;
+}
+MSL_SampleEntry;
+
+// Input file that added each song, used in size reports
+typedef struct tMSL_SongEntry
+{
+    const char *file;
+    u32 index;  // Index of the song in that file
+}
+MSL_SongEntry;
+
+// Sample serialized the same way it's stored in the soundbank
+typedef struct tMSL_SampleBlob
+{
+    u8 *data;
+    u32 size;
+    u64 hash;
+    char filename[13];  // Samples whose name starts with '#' are exported as SFX
+    u32 padding;        // Bytes added by FixSample() as padding
+    u32 unrolled;       // Bytes added by FixSample() to unroll the loop
+
+    // Other ways to encode the sample (only when there is a budget)
+    struct tMSL_SampleAlt *alts;
+    u32 nalts;
+}
+MSL_SampleBlob;
+
+typedef struct tMSL_SampleAlt
+{
+    MSL_SampleBlob blob;
+    u32 frequency;  // Songs that use the sample have to be updated
+    double loss;    // Noise added to the default encoding (relative to the signal)
+}
+MSL_SampleAlt;
+
+// Sample rates lower than this aren't used to fit the soundbank in a budget
+#define BUDGET_MIN_RATE 4000
+
+// Input file that has been loaded and converted, and that is waiting to be
+// added to the soundbank. Loading and converting files is independent from
+// other files, so it can be done in parallel. Adding them to the soundbank
+// is always done in the order of the command line.
+typedef struct tMSL_Input
+{
+    const InputEntry *entry;
+    char *filename;
+    int type;               // INPUT_TYPE_* (INPUT_TYPE_UNK if it can't be used)
+    MSL_SampleBlob *blobs;  // Samples of the module (or the WAV file)
+    u32 nblobs;
+    u8 *song;               // Song entries, with indices into the blobs array
+    u32 song_size;
+    u32 nsongs;
+    bool ready;
+}
+MSL_Input;
+
+static MSL_SampleEntry *msl_samples = NULL;
+static u32 msl_samples_capacity = 0;
+
+// Open addressing hash table. Each slot holds the index of a sample plus one,
+// or zero if the slot is empty. The size is always a power of two.
+static u32 *msl_hash_table = NULL;
+static u32 msl_hash_size = 0;
+
+static MSL_SongEntry *msl_songs = NULL;
+static u32 msl_songs_capacity = 0;
+
+// Samples that weren't added because they were already in the soundbank
+static u32 msl_dedup_hits = 0;
+static u32 msl_dedup_bytes = 0;
+
+// The frequency of the sample isn't used by songs (they have their own copy of
+// it) so it isn't considered when looking for duplicated samples. It's found in
+// the same place of the header of GBA and NDS samples.
+#define SAMPLE_FREQ_OFFSET 10
+
+// Songs are serialized before the samples are added to the soundbank, so the
+// sample indices are patched when they are known. This is the offset of the
+// index in the sample headers written by Write_Sample().
+#define MAS_SAMPLE_INDEX_OFFSET 10
+
+// Offset of the sample rate in the same headers. Songs use their own copy of it.
+#define MAS_SAMPLE_FREQ_OFFSET  2
+
+// Size of the MAS header written by Write_MAS() before the parapointers, and
+// offsets of some of its fields.
+#define MAS_HEADER_SIZE         (12 + 32 + 32 + 200)
+#define MAS_HEADER_INST_COUNT   1
+#define MAS_HEADER_SAMP_COUNT   2
+#define MAS_HEADER_PATT_COUNT   3
+#define MAS_HEADER_FLAGS        4
+#define MAS_HEADER_FLAG_MSL_DEP 16
+
+static u64 MSL_HashSample(const u8 *data, u32 size)
+{
+    u64 hash = hash_data(data, SAMPLE_FREQ_OFFSET, 0);
+    return hash_data(data + SAMPLE_FREQ_OFFSET + 2,
+                     size - SAMPLE_FREQ_OFFSET - 2, hash);
+}
+
+static void MSL_FreeSampleIndex(void)
+{
+    free(msl_samples);
+    msl_samples = NULL;
+    msl_samples_capacity = 0;
+
+    free(msl_hash_table);
+    msl_hash_table = NULL;
+    msl_hash_size = 0;
+
+    free(msl_songs);
+    msl_songs = NULL;
+    msl_songs_capacity = 0;
+
+    msl_dedup_hits = 0;
+    msl_dedup_bytes = 0;
+}
+
+static void MSL_HashInsert(u32 id)
+{
+    u32 mask = msl_hash_size - 1;
+    u32 slot = (u32)msl_samples[id].hash & mask;
+
+    while (msl_hash_table[slot] != 0)
+        slot = (slot + 1) & mask;
+
+    msl_hash_table[slot] = id + 1;
+}
+
+static void MSL_IndexSample(u32 id, u64 hash, u32 offset, u32 size)
+{
+    if (id >= msl_samples_capacity)
+    {
+        msl_samples_capacity = msl_samples_capacity ? msl_samples_capacity * 2 : 256;
+        msl_samples = realloc(msl_samples, msl_samples_capacity * sizeof(MSL_SampleEntry));
+        if (msl_samples == NULL)
+        {
+            printf("Not enough memory for the sample index\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    msl_samples[id].hash = hash;
+    msl_samples[id].offset = offset;
+    msl_samples[id].size = size;
+
+    // Keep the load factor of the table under 50%
+    if ((id + 1) * 2 > msl_hash_size)
+    {
+        free(msl_hash_table);
+        msl_hash_size = msl_hash_size ? msl_hash_size * 2 : 512;
+        msl_hash_table = calloc(msl_hash_size, sizeof(u32));
+        if (msl_hash_table == NULL)
+        {
+            printf("Not enough memory for the sample index\n");
+            exit(EXIT_FAILURE);
+        }
+
+        for (u32 x = 0; x < id; x++)
+            MSL_HashInsert(x);
+    }
+
+    MSL_HashInsert(id);
+}
 
 void MSL_Erase(void)
 {
     MSL_NSAMPS = 0;
     MSL_NSONGS = 0;
-    file_delete(TMP_SAMP);
-    file_delete(TMP_SONG);
+    MSL_FreeSampleIndex();
+
+    size_t size;
+    free(file_close_write_buffer(&size, &msl_samp_data));
+    free(file_close_write_buffer(&size, &msl_song_data));
 }
 
-u16 MSL_AddSample(Sample *samp)
+// Serialize a sample the same way it's stored in the soundbank (without the
+// 8 byte prefix) and calculate its hash.
+static void MSL_PrepareSample(Sample *samp, MSL_SampleBlob *blob)
 {
-    file_open_write_end(TMP_SAMP);
+    FileWriter fw;
+    size_t size;
 
-    u32 sample_length = samp->sample_length;
+    file_open_write_buffer(&fw);
+    Write_SampleData(samp, &fw);
+    blob->data = file_close_write_buffer(&size, &fw);
+    blob->size = size;
+    blob->hash = MSL_HashSample(blob->data, blob->size);
 
-    write32(((samp->format & SAMPF_16BIT) ? sample_length * 2 : sample_length)
-            + SAMPLE_HEADER_SIZE + 4); // +4 for sample padding
-    write8((target_system == SYSTEM_GBA) ? MAS_TYPE_SAMPLE_GBA : MAS_TYPE_SAMPLE_NDS);
-    write8(MAS_VERSION);
-    write8(samp->filename[0] == '#' ? 1 : 0);
-    write8(BYTESMASHER);
+    memcpy(blob->filename, samp->filename, sizeof(samp->filename));
+    blob->filename[sizeof(samp->filename)] = 0;
 
-    Write_SampleData(samp);
+    // FixSample() counts sample points, convert them to bytes
+    u32 bits = (samp->format & SAMPF_COMP) ? 4 : (samp->format & SAMPF_16BIT) ? 16 : 8;
+    blob->padding = samp->fix_padding * bits / 8;
+    blob->unrolled = samp->fix_unrolled * bits / 8;
 
-    file_close_write();
+    blob->alts = NULL;
+    blob->nalts = 0;
+}
 
-    MSL_NSAMPS++;
+static bool MSL_UsingBudget(void)
+{
+    return (MSL_BUDGET > 0) || (MSL_SONG_BUDGET > 0);
+}
 
-    return MSL_NSAMPS - 1;
+// Power of the noise of an encoding relative to the power of the signal. Unlike
+// the SNR in dB, the noise added by the changes of several encodings can be
+// compared and added up.
+static double MSL_NoiseRatio(double snr)
+{
+    return pow(10.0, -snr / 10.0);
 }
 
-u16 MSL_AddSampleC(Sample *samp)
+// Encode the original sample (saved by FixSample()) with all the formats and
+// sample rates that can be used to fit the soundbank in a budget. Samples with
+// settings chosen in a manifest, and samples that are already compressed
+// (with the "%c" flag, for example) are always used as they are.
+static void MSL_PrepareAlternatives(Sample *samp, MSL_SampleBlob *blob,
+                                    const InputEntry *entry)
 {
-    int fsize = file_size(TMP_SAMP);
-    if (fsize == 0)
+    const Sample *source = samp->source;
+
+    if (source == NULL || source->sample_length == 0 || source->frequency == 0)
+        return;
+
+    if (entry->format != INPUT_FORMAT_DEFAULT ||
+        entry->compression != INPUT_COMPRESSION_DEFAULT || entry->rate != 0)
+        return;
+
+    if (samp->format & SAMPF_COMP)
+        return;
+
+    u8 formats[3];
+    int nformats = 0;
+    u8 default_format = 0;
+
+    if (target_system == SYSTEM_NDS)
+    {
+        default_format = source->format & SAMPF_16BIT;
+        if (default_format)
+            formats[nformats++] = SAMPF_16BIT;
+        formats[nformats++] = 0;
+        formats[nformats++] = SAMPF_COMP;
+    }
+    else
+    {
+        formats[nformats++] = 0;
+    }
+
+    blob->alts = malloc(3 * nformats * sizeof(MSL_SampleAlt));
+    if (blob->alts == NULL)
     {
-        return MSL_AddSample(samp);
+        printf("Not enough memory to encode sample\n");
+        exit(EXIT_FAILURE);
     }
-    F_SAMP = fopen(TMP_SAMP, "rb");
-    fseek(F_SAMP, 0, SEEK_SET);
 
-    int samp_id = 0;
+    // The default encoding may have a lower sample rate than the original
+    // sample (with -R, for example)
+    double default_noise = MSL_NoiseRatio(Sample_SNR(source, default_format, samp->frequency));
 
-    while (ftell(F_SAMP) < fsize)
+    for (u32 div = 1; div <= 4; div *= 2)
     {
-        u32 h_filesize = read32f(F_SAMP);
-        read32f(F_SAMP);
-        u32 samp_len = read32f(F_SAMP);
-        u32 samp_llen = read32f(F_SAMP);
-        u8 sformat = read8f(F_SAMP);
-        skip8f(3, F_SAMP);
+        u32 rate = source->frequency / div;
+        if (div > 1 && rate < BUDGET_MIN_RATE)
+            break;
 
-        u8 target_sformat;
-        if (target_system == SYSTEM_NDS)
-        {
-            target_sformat = sample_dsformat(samp);
-            skip8f(4, F_SAMP);
-        }
-        else
+        for (int f = 0; f < nformats; f++)
         {
-            target_sformat = SAMP_FORMAT_U8;
+            if (div == 1 && formats[f] == default_format)
+                continue;
+
+            Sample conv = *source;
+            conv.data = Sample_CopyData(source);
+
+            if (div > 1)
+                Sample_SetRate(&conv, rate);
+
+            if (formats[f] & SAMPF_COMP)
+                conv.format |= SAMPF_COMP;
+            else if (!(formats[f] & SAMPF_16BIT))
+                Sample_8bit(&conv);
+
+            FixSample(&conv);
+            Sample_FreeSource(&conv);
+
+            MSL_SampleAlt *alt = &blob->alts[blob->nalts++];
+
+            MSL_PrepareSample(&conv, &alt->blob);
+            memcpy(alt->blob.filename, blob->filename, sizeof(blob->filename));
+            alt->frequency = conv.frequency;
+            alt->loss = MSL_NoiseRatio(Sample_SNR(source, formats[f], conv.frequency)) -
+                        default_noise;
+
+            free(conv.data);
         }
+    }
+}
+
+static void MSL_FreeAlternatives(MSL_SampleBlob *blob)
+{
+    for (u32 x = 0; x < blob->nalts; x++)
+        free(blob->alts[x].blob.data);
+    free(blob->alts);
+    blob->alts = NULL;
+    blob->nalts = 0;
+}
+
+// Compare a sample with one that has already been added to the soundbank
+static bool MSL_SampleMatches(MSL_SampleEntry *entry, MSL_SampleBlob *blob)
+{
+    if (entry->size != blob->size)
+        return false;
+
+    const u8 *stored = &msl_samp_data.data[entry->offset];
+
+    return (memcmp(stored, blob->data, SAMPLE_FREQ_OFFSET) == 0) &&
+           (memcmp(stored + SAMPLE_FREQ_OFFSET + 2, blob->data + SAMPLE_FREQ_OFFSET + 2,
+                   blob->size - SAMPLE_FREQ_OFFSET - 2) == 0);
+}
+
+static u16 MSL_AddSample(MSL_SampleBlob *blob, const char *file, u32 index)
+{
+    FileWriter *fw = &msl_samp_data;
+
+    write32(blob->size, fw);
+    write8((target_system == SYSTEM_GBA) ? MAS_TYPE_SAMPLE_GBA : MAS_TYPE_SAMPLE_NDS, fw);
+    write8(MAS_VERSION, fw);
+    write8(blob->filename[0] == '#' ? 1 : 0, fw);
+    write8(BYTESMASHER, fw);
+
+    u32 offset = file_tell_write(fw);
+    write_bytes(blob->data, blob->size, fw);
+
+    MSL_IndexSample(MSL_NSAMPS, blob->hash, offset, blob->size);
+
+    MSL_SampleEntry *entry = &msl_samples[MSL_NSAMPS];
+    entry->file = file;
+    entry->index = index;
+    memcpy(entry->name, blob->filename, sizeof(entry->name));
+    entry->padding = blob->padding;
+    entry->unrolled = blob->unrolled;
+
+    MSL_NSAMPS++;
+
+    return MSL_NSAMPS - 1;
+}
 
-        u32 st;
-        bool samp_match = true;
+// Add a sample to the soundbank unless an identical sample has already been
+// added. It returns the index of the sample in the soundbank.
+static u16 MSL_AddSampleC(MSL_SampleBlob *blob, const char *file, u32 index)
+{
+    if (msl_hash_size > 0)
+    {
+        u32 mask = msl_hash_size - 1;
+        u32 slot = (u32)blob->hash & mask;
 
-        if (samp->sample_length == samp_len &&
-            (samp->loop_type ? samp->loop_end-samp->loop_start : 0xFFFFFFFF) == samp_llen &&
-            sformat == target_sformat)
+        while (msl_hash_table[slot] != 0)
         {
-            // verify sample data
-            if (samp->format & SAMPF_16BIT)
-            {
-                for (st = 0; st < samp_len; st++)
-                {
-                    if (read16f(F_SAMP) != ((u16*)samp->data)[st])
-                    {
-                        samp_match = false;
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                for (st = 0; st < samp_len; st++)
-                {
-                    if (read8f(F_SAMP) != ((u8*)samp->data)[st])
-                    {
-                        samp_match = false;
-                        break;
-                    }
-                }
-            }
+            u32 id = msl_hash_table[slot] - 1;
+            MSL_SampleEntry *entry = &msl_samples[id];
 
-            if (samp_match)
-            {
-                fclose(F_SAMP);
-                return samp_id;
-            }
-            else
+            if (entry->hash == blob->hash && MSL_SampleMatches(entry, blob))
             {
-                // +4 to skip padding
-                skip8f((h_filesize - SAMPLE_HEADER_SIZE) - (st + 1), F_SAMP);
+                msl_dedup_hits++;
+                msl_dedup_bytes += blob->size + 8;
+                return id;
             }
+
+            slot = (slot + 1) & mask;
         }
-        else
+    }
+
+    return MSL_AddSample(blob, file, index);
+}
+
+static u32 MSL_Get32(const u8 *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((u32)p[3] << 24);
+}
+
+// Size of a song or sample entry, including the 8 bytes before the data.
+static u32 MSL_EntrySize(const u8 *entry)
+{
+    return MSL_Get32(entry) + 8;
+}
+
+// Sample index of sample "x" of a song entry (in the soundbank, or in the input
+// file before the song is added to the soundbank)
+static u16 MSL_SongSample(const u8 *song, u32 x)
+{
+    const u8 *header = &song[8];
+    u32 table = 8 + MAS_HEADER_SIZE + header[MAS_HEADER_INST_COUNT] * 4;
+    u32 offset = 8 + MSL_Get32(&song[table + x * 4]) + MAS_SAMPLE_INDEX_OFFSET;
+
+    return song[offset] | (song[offset + 1] << 8);
+}
+
+// Songs of an input file refer to samples by their index in the input file.
+// This replaces them by the indices of the samples in the soundbank (if "ids"
+// isn't NULL). It returns false if the song is malformed, or if it refers to
+// samples that don't exist in the input file.
+static bool MSL_RemapSong(u8 *song, u32 size, const u16 *ids, u32 nids)
+{
+    if (size < 8 + MAS_HEADER_SIZE || MSL_EntrySize(song) != size)
+        return false;
+
+    const u8 *header = &song[8];
+    u32 table = 8 + MAS_HEADER_SIZE + header[MAS_HEADER_INST_COUNT] * 4;
+    u32 samp_count = header[MAS_HEADER_SAMP_COUNT];
+
+    if (table + samp_count * 4 > size)
+        return false;
+
+    for (u32 x = 0; x < samp_count; x++)
+    {
+        u32 parapointer = MSL_Get32(&song[table + x * 4]);
+        if (parapointer >= size)
+            return false;
+
+        u32 offset = 8 + parapointer + MAS_SAMPLE_INDEX_OFFSET;
+        if (offset + 2 > size)
+            return false;
+
+        u32 index = song[offset] | (song[offset + 1] << 8);
+        if (index >= nids)
+            return false;
+
+        if (ids != NULL)
         {
-            skip8f(h_filesize- SAMPLE_HEADER_SIZE, F_SAMP); // +4 to skip padding
+            song[offset] = ids[index] & 0xFF;
+            song[offset + 1] = ids[index] >> 8;
         }
-        samp_id++;
     }
 
-    fclose(F_SAMP);
-    return MSL_AddSample(samp);
+    return true;
 }
 
-u16 MSL_AddModule(MAS_Module *mod)
+// Adds all the samples of an input file to the soundbank (reusing the ones
+// that are already in it) and returns their indices in the soundbank.
+static u16 *MSL_AddSamples(MSL_Input *in)
 {
-    // ADD SAMPLES
-    for (int x = 0; x < mod->samp_count; x++)
+    u16 *ids = malloc((in->nblobs > 0 ? in->nblobs : 1) * sizeof(u16));
+    if (ids == NULL)
+    {
+        printf("Not enough memory to add %s\n", in->filename);
+        exit(EXIT_FAILURE);
+    }
+
+    for (u32 x = 0; x < in->nblobs; x++)
+        ids[x] = MSL_AddSampleC(&in->blobs[x], in->filename, x);
+
+    return ids;
+}
+
+static u16 MSL_AddSong(u8 *song, u32 size, const u16 *ids, u32 nids,
+                       const char *file, u32 index)
+{
+    if (!MSL_RemapSong(song, size, ids, nids))
     {
-        int samp_id = MSL_AddSampleC(&mod->samples[x]);
+        printf("Invalid song\n");
+        exit(EXIT_FAILURE);
+    }
 
-        if (mod->samples[x].filename[0] == '#')
-            MSL_PrintDefinition(mod->samples[x].filename + 1, (u16)samp_id, "SFX_");
+    write_bytes(song, size, &msl_song_data);
 
-        mod->samples[x].msl_index = samp_id;
+    if (MSL_NSONGS >= msl_songs_capacity)
+    {
+        msl_songs_capacity = msl_songs_capacity ? msl_songs_capacity * 2 : 64;
+        msl_songs = realloc(msl_songs, msl_songs_capacity * sizeof(MSL_SongEntry));
+        if (msl_songs == NULL)
+        {
+            printf("Not enough memory for the song index\n");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    file_open_write_end(TMP_SONG);
-    Write_MAS(mod, false, true);
-    file_close_write();
+    msl_songs[MSL_NSONGS].file = file;
+    msl_songs[MSL_NSONGS].index = index;
 
     MSL_NSONGS++;
 
     return MSL_NSONGS - 1;
 }
 
+static u16 MSL_AddModule(MSL_Input *in)
+{
+    // ADD SAMPLES
+    u16 *ids = MSL_AddSamples(in);
+
+    for (u32 x = 0; x < in->nblobs; x++)
+    {
+        if (in->blobs[x].filename[0] == '#')
+            MSL_PrintDefinition(in->blobs[x].filename + 1, ids[x], "SFX_");
+    }
+
+    u16 id = MSL_AddSong(in->song, in->song_size, ids, in->nblobs, in->filename, 0);
+
+    free(ids);
+
+    return id;
+}
+
+// Soundbanks don't store the names of their songs and samples, so the
+// definitions of the imported ones are named after the soundbank file and
+// their index in it.
+static void MSL_PrintImportDefinition(char *filename, u32 index, u16 id, char *prefix)
+{
+    char name[64];
+    int s = 0, len;
+
+    for (int x = 0; filename[x] != 0; x++)
+    {
+        if (filename[x] == '\\' || filename[x] == '/')
+            s = x + 1;
+    }
+    for (len = 0; filename[s + len] != 0 && filename[s + len] != '.'; len++)
+        ;
+    if (len > 40)
+        len = 40;
+
+    snprintf(name, sizeof(name), "%.*s_%u", len, filename + s, (unsigned int)index);
+
+    MSL_PrintDefinition(name, id, prefix);
+}
+
+// Name used for the definitions of the input file in the header
+static char *MSL_InputName(MSL_Input *in)
+{
+    return in->entry->symbol ? in->entry->symbol : in->filename;
+}
+
+static void MSL_AddSoundbank(MSL_Input *in)
+{
+    u16 *ids = MSL_AddSamples(in);
+
+    for (u32 x = 0; x < in->nblobs; x++)
+    {
+        if (in->blobs[x].filename[0] == '#')
+            MSL_PrintImportDefinition(MSL_InputName(in), x, ids[x], "SFX_");
+    }
+
+    u8 *song = in->song;
+    for (u32 x = 0; x < in->nsongs; x++)
+    {
+        u32 size = MSL_EntrySize(song);
+        u16 id = MSL_AddSong(song, size, ids, in->nblobs, in->filename, x);
+        MSL_PrintImportDefinition(MSL_InputName(in), x, id, "MOD_");
+        song += size;
+    }
+
+    free(ids);
+}
+
 void MSL_Export(char *filename)
 {
-    file_open_write(filename);
-    write16(MSL_NSAMPS);
-    write16(MSL_NSONGS);
-    write8('*');
-    write8('m');
-    write8('a');
-    write8('x');
-    write8('m');
-    write8('o');
-    write8('d');
-    write8('*');
+    FileWriter fw;
+
+    file_open_write(filename, &fw);
+    write16(MSL_NSAMPS, &fw);
+    write16(MSL_NSONGS, &fw);
+    write8('*', &fw);
+    write8('m', &fw);
+    write8('a', &fw);
+    write8('x', &fw);
+    write8('m', &fw);
+    write8('o', &fw);
+    write8('d', &fw);
+    write8('*', &fw);
 
     u32 *parap_samp = (u32*)malloc(MSL_NSAMPS * sizeof(u32));
     u32 *parap_song = (u32*)malloc(MSL_NSONGS * sizeof(u32));
 
     // reserve space for parapointers
     for (u32 x = 0; x < MSL_NSAMPS; x++)
-        write32(0xAAAAAAAA);
+        write32(0xAAAAAAAA, &fw);
     for (u32 x = 0; x < MSL_NSONGS; x++)
-        write32(0xAAAAAAAA);
+        write32(0xAAAAAAAA, &fw);
 
     // copy samples
-    file_open_read(TMP_SAMP);
+    const u8 *src = msl_samp_data.data;
     for (u32 x = 0; x < MSL_NSAMPS; x++)
     {
-        align32();
-        parap_samp[x] = file_tell_write();
+        align32(&fw);
+        parap_samp[x] = file_tell_write(&fw);
 
-        u32 file_size = read32();
-        write32(file_size);
-        for (u32 y = 0; y < file_size + 4; y++)
-            write8(read8());
+        u32 size = MSL_EntrySize(src);
+        write_bytes(src, size, &fw);
+        src += size;
     }
-    file_close_read();
 
-    file_open_read(TMP_SONG);
+    // copy songs
+    src = msl_song_data.data;
     for (u32 x = 0; x < MSL_NSONGS; x++)
     {
-        align32();
-        parap_song[x] = file_tell_write();
+        align32(&fw);
+        parap_song[x] = file_tell_write(&fw);
 
-        u32 file_size = read32();
-        write32(file_size);
-        for (u32 y = 0; y < file_size+4; y++)
-            write8(read8());
+        u32 size = MSL_EntrySize(src);
+        write_bytes(src, size, &fw);
+        src += size;
     }
-    file_close_read();
 
-    file_seek_write(0x0C, SEEK_SET);
     for (u32 x = 0; x < MSL_NSAMPS; x++)
-        write32(parap_samp[x]);
+        write_patch32(0x0C + x * 4, parap_samp[x], &fw);
     for (u32 x = 0; x < MSL_NSONGS; x++)
-        write32(parap_song[x]);
+        write_patch32(0x0C + (MSL_NSAMPS + x) * 4, parap_song[x], &fw);
 
-    file_close_write();
+    file_close_write(&fw);
 
     if (parap_samp)
         free(parap_samp);
@@ -251,6 +693,39 @@ void MSL_Export(char *filename)
         free(parap_song);
 }
 
+static void MSL_VPrintf(FileWriter *fw, const char *format, va_list args)
+{
+    char line[256];
+
+    int len = vsnprintf(line, sizeof(line), format, args);
+
+    if (len < 0)
+        return;
+    if ((size_t)len >= sizeof(line))
+        len = sizeof(line) - 1;
+
+    write_bytes(line, len, fw);
+}
+
+static void MSL_HeaderPrintf(const char *format, ...)
+{
+    if (F_HEADER == NULL)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    MSL_VPrintf(F_HEADER, format, args);
+    va_end(args);
+}
+
+static void MSL_ReportPrintf(FileWriter *fw, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    MSL_VPrintf(fw, format, args);
+    va_end(args);
+}
+
 void MSL_PrintDefinition(char* filename, u16 id, char* prefix)
 {
     char newtitle[64];
@@ -285,140 +760,1571 @@ void MSL_PrintDefinition(char* filename, u16 id, char* prefix)
     }
     newtitle[x - s] = 0;
 
-    if (F_HEADER)
-    {
-        fprintf(F_HEADER, "#define %s%s    %i\r\n", prefix, newtitle, id);
-    }
+    MSL_HeaderPrintf("#define %s%s    %i\r\n", prefix, newtitle, id);
 }
 
-void MSL_LoadFile(char *filename, bool verbose)
+// Apply the settings of the manifest entry of a WAV file before converting it
+static void MSL_ApplyOverrides(Sample *samp, const InputEntry *entry)
 {
-    Sample wav;
-    MAS_Module mod;
+    if (entry->rate != 0)
+        Sample_SetRate(samp, entry->rate);
+
+    if (entry->format == INPUT_FORMAT_8BIT)
+        Sample_8bit(samp);
+    else if (entry->format == INPUT_FORMAT_16BIT)
+        Sample_16bit(samp);
+
+    if (entry->compression == INPUT_COMPRESSION_ADPCM)
+        samp->format |= SAMPF_COMP;
+    else if (entry->compression == INPUT_COMPRESSION_NONE)
+        samp->format &= ~SAMPF_COMP;
+}
 
-    if (file_open_read(filename))
-    {
-        printf("Cannot open %s for reading! Skipping.\n", filename);
-        return;
-    }
+// Load an input file, convert all its samples to the format used in the
+// soundbank and serialize the song.
+static void MSL_ConvertFile(MSL_Input *in, FileReader *fr, bool verbose)
+{
+    MAS_Module mod;
+    Sample wav;
 
-    int f_ext = get_ext(filename);
-    switch (f_ext)
+    switch (in->type)
     {
         case INPUT_TYPE_MOD:
-            if (Load_MOD(&mod, verbose))
+            if (Load_MOD(&mod, fr, verbose))
                 exit(EXIT_FAILURE);
-            MSL_PrintDefinition(filename, MSL_AddModule(&mod), "MOD_");
-            Delete_Module(&mod);
             break;
         case INPUT_TYPE_S3M:
-            if (Load_S3M(&mod, verbose))
+            if (Load_S3M(&mod, fr, verbose))
                 exit(EXIT_FAILURE);
-            MSL_PrintDefinition(filename, MSL_AddModule(&mod), "MOD_");
-            Delete_Module(&mod);
             break;
         case INPUT_TYPE_XM:
-            if (Load_XM(&mod, verbose))
+            if (Load_XM(&mod, fr, verbose))
                 exit(EXIT_FAILURE);
-            MSL_PrintDefinition(filename, MSL_AddModule(&mod), "MOD_");
-            Delete_Module(&mod);
             break;
         case INPUT_TYPE_IT:
-            if (Load_IT(&mod, verbose))
+            if (Load_IT(&mod, fr, verbose))
                 exit(EXIT_FAILURE);
-            MSL_PrintDefinition(filename, MSL_AddModule(&mod), "MOD_");
-            Delete_Module(&mod);
             break;
         case INPUT_TYPE_WAV:
-            if (Load_WAV(&wav, verbose, true))
+            if (Load_WAV(&wav, fr, verbose, false))
                 exit(EXIT_FAILURE);
+            MSL_ApplyOverrides(&wav, in->entry);
+            FixSample(&wav);
             wav.filename[0] = '#'; // set SFX flag (for demo)
-            MSL_PrintDefinition(filename, MSL_AddSample(&wav), "SFX_");
-            free(wav.data);
             break;
-        default:
-            // print error/warning
-            printf("Unknown file %s...\n", filename);
     }
 
-    file_close_read();
-}
+    if (strip_unused && in->type != INPUT_TYPE_WAV)
+        Strip_Module(&mod, verbose);
 
-int MSL_CreateTemporaryFiles(bool verbose)
-{
-    int fd_samp = mkstemp(TMP_SAMP);
-    if (fd_samp == -1)
+    if (trim_samples && in->type != INPUT_TYPE_WAV)
+        Trim_Module(&mod, verbose);
+
+    if (downsample_notes && in->type != INPUT_TYPE_WAV)
+        Downsample_Module(&mod, verbose);
+
+    in->nblobs = (in->type == INPUT_TYPE_WAV) ? 1 : mod.samp_count;
+    if (in->nblobs > 0)
     {
-        printf("Can't generate temporary file for samples\n");
-        perror("mkstemp");
-        return ERR_NOWRITE;
+        in->blobs = malloc(in->nblobs * sizeof(MSL_SampleBlob));
+        if (in->blobs == NULL)
+        {
+            printf("Not enough memory to convert %s\n", in->filename);
+            exit(EXIT_FAILURE);
+        }
     }
-    close(fd_samp);
 
-    int fd_song = mkstemp(TMP_SONG);
-    if (fd_song == -1)
+    if (in->type == INPUT_TYPE_WAV)
     {
-        printf("Can't generate temporary file for songs\n");
-        perror("mkstemp");
-        return ERR_NOWRITE;
+        MSL_PrepareSample(&wav, &in->blobs[0]);
+        if (MSL_UsingBudget())
+            MSL_PrepareAlternatives(&wav, &in->blobs[0], in->entry);
+        free(wav.data);
+        Sample_FreeSource(&wav);
+        return;
     }
-    close(fd_song);
 
-    // Make sure that the files are deleted when the program ends even if it
-    // ends through a call to exit().
-    atexit(MSL_Erase);
-
-    if (verbose)
+    // The sample data isn't needed after serializing it. Songs in soundbanks
+    // only contain references to the samples.
+    for (int x = 0; x < mod.samp_count; x++)
     {
-        printf("Temporary files: %s and %s\n", TMP_SAMP, TMP_SONG);
+        MSL_PrepareSample(&mod.samples[x], &in->blobs[x]);
+        if (MSL_UsingBudget())
+            MSL_PrepareAlternatives(&mod.samples[x], &in->blobs[x], in->entry);
+        free(mod.samples[x].data);
+        mod.samples[x].data = NULL;
+        mod.samples[x].msl_index = x;
+        Sample_FreeSource(&mod.samples[x]);
     }
 
-    return ERR_NONE;
-}
+    FileWriter fw;
+    size_t size;
 
-int MSL_Create(char *argv[], int argc, char *output, char *header, bool verbose)
-{
-    MSL_Erase();
+    file_open_write_buffer(&fw);
+    Write_MAS(&mod, &fw, false, true);
+    in->song = file_close_write_buffer(&size, &fw);
+    in->song_size = size;
+    in->nsongs = 1;
 
-    str_msl[0] = 0;
+    Delete_Module(&mod);
+}
 
-    F_HEADER = NULL;
-    if (header)
+static void MSL_FreeInput(MSL_Input *in)
+{
+    for (u32 x = 0; x < in->nblobs; x++)
     {
-        F_HEADER = fopen(header, "wb");
-        if (F_HEADER == NULL)
-        {
-            printf("Can't open output header file: %s\n", header);
-            return ERR_NOWRITE;
-        }
+        free(in->blobs[x].data);
+        MSL_FreeAlternatives(&in->blobs[x]);
     }
+    free(in->blobs);
+    in->blobs = NULL;
+    in->nblobs = 0;
+
+    free(in->song);
+    in->song = NULL;
+    in->song_size = 0;
+    in->nsongs = 0;
+}
 
-    int ret = MSL_CreateTemporaryFiles(verbose);
-    if (ret != ERR_NONE)
-        return ret;
+// Entries of the conversion cache contain the converted input file:
+//
+//     u32 nblobs, u32 song_size, song data
+//     For each sample: filename (12 bytes), u32 padding, u32 unrolled, u32 size,
+//     data
+//
+// The sample hashes are calculated again when the entry is loaded.
 
-    for (int x = 1; x < argc; x++)
+static void MSL_StoreCacheEntry(MSL_Input *in, const CacheKey *key)
+{
+    FileWriter fw;
+    size_t size;
+
+    file_open_write_buffer(&fw);
+
+    write32(in->nblobs, &fw);
+    write32(in->song_size, &fw);
+    write_bytes(in->song, in->song_size, &fw);
+
+    for (u32 x = 0; x < in->nblobs; x++)
     {
-        if (argv[x][0] == '-')
-        {
-            // Skip anything that isn't an input file
-        }
-        else
-        {
-            MSL_LoadFile(argv[x], verbose);
-        }
+        MSL_SampleBlob *blob = &in->blobs[x];
+
+        write_bytes(blob->filename, 12, &fw);
+        write32(blob->padding, &fw);
+        write32(blob->unrolled, &fw);
+        write32(blob->size, &fw);
+        write_bytes(blob->data, blob->size, &fw);
     }
 
-    MSL_Export(output);
+    u8 *data = file_close_write_buffer(&size, &fw);
+    cache_store(key, data, size);
+    free(data);
+}
 
-    if (F_HEADER)
+// Read "size" bytes from a cache entry. It returns NULL if the entry is too
+// short (if it has been truncated or corrupted).
+static const u8 *MSL_CacheRead(FileReader *fr, size_t size)
+{
+    if (size > fr->size - fr->pos)
+        return NULL;
+
+    const u8 *p = &fr->data[fr->pos];
+    fr->pos += size;
+    return p;
+}
+
+static u32 MSL_CacheRead32(FileReader *fr, bool *ok)
+{
+    const u8 *p = MSL_CacheRead(fr, 4);
+    if (p == NULL)
     {
-        fprintf(F_HEADER, "#define MSL_NSONGS    %i\r\n", MSL_NSONGS);
-        fprintf(F_HEADER, "#define MSL_NSAMPS    %i\r\n", MSL_NSAMPS);
-        fprintf(F_HEADER, "#define MSL_BANKSIZE    %i\r\n", MSL_NSAMPS + MSL_NSONGS);
-        fclose(F_HEADER);
-        F_HEADER = NULL;
+        *ok = false;
+        return 0;
     }
 
+    return MSL_Get32(p);
+}
+
+static bool MSL_LoadCacheEntry(MSL_Input *in, const CacheKey *key)
+{
+    FileReader fr = { 0 };
+    size_t size;
+    bool ok = true;
+
+    fr.data = cache_load(key, &size);
+    if (fr.data == NULL)
+        return false;
+    fr.size = size;
+
+    in->nblobs = MSL_CacheRead32(&fr, &ok);
+    in->song_size = MSL_CacheRead32(&fr, &ok);
+
+    // Every sample takes at least 24 bytes
+    if (!ok || in->nblobs > fr.size / 24)
+        goto fail;
+
+    const u8 *song = MSL_CacheRead(&fr, in->song_size);
+    if (song == NULL)
+        goto fail;
+
+    if (in->song_size > 0)
+    {
+        in->song = malloc(in->song_size);
+        if (in->song == NULL)
+            goto fail;
+        memcpy(in->song, song, in->song_size);
+    }
+
+    if (in->nblobs > 0)
+    {
+        in->blobs = calloc(in->nblobs, sizeof(MSL_SampleBlob));
+        if (in->blobs == NULL)
+            goto fail;
+    }
+
+    for (u32 x = 0; x < in->nblobs; x++)
+    {
+        MSL_SampleBlob *blob = &in->blobs[x];
+
+        const u8 *filename = MSL_CacheRead(&fr, 12);
+        if (filename == NULL)
+            goto fail;
+        memcpy(blob->filename, filename, 12);
+        blob->filename[12] = 0;
+
+        blob->padding = MSL_CacheRead32(&fr, &ok);
+        blob->unrolled = MSL_CacheRead32(&fr, &ok);
+        blob->size = MSL_CacheRead32(&fr, &ok);
+        if (!ok || blob->size <= SAMPLE_FREQ_OFFSET + 2)
+            goto fail;
+
+        const u8 *data = MSL_CacheRead(&fr, blob->size);
+        if (data == NULL)
+            goto fail;
+
+        blob->data = malloc(blob->size);
+        if (blob->data == NULL)
+            goto fail;
+        memcpy(blob->data, data, blob->size);
+        blob->hash = MSL_HashSample(blob->data, blob->size);
+    }
+
+    if (in->type == INPUT_TYPE_WAV)
+    {
+        if (in->nblobs != 1 || in->song_size != 0)
+            goto fail;
+    }
+    else
+    {
+        if (!MSL_RemapSong(in->song, in->song_size, NULL, in->nblobs))
+            goto fail;
+        in->nsongs = 1;
+    }
+
+    free(fr.data);
+    return true;
+
+fail:
+    MSL_FreeInput(in);
+    free(fr.data);
+    return false;
+}
+
+// Read the samples and songs of a soundbank created by mmutil. They are already
+// in the format used in soundbanks, so they are imported without converting
+// them.
+static void MSL_ImportSoundbank(MSL_Input *in, FileReader *fr, bool verbose)
+{
+    const u8 *bank = fr->data;
+    u32 size = fr->size;
+
+    if (size < 12 || memcmp(&bank[4], "*maxmod*", 8) != 0)
+    {
+        printf("%s isn't a soundbank\n", in->filename);
+        exit(EXIT_FAILURE);
+    }
+
+    u32 nsamps = bank[0] | (bank[1] << 8);
+    u32 nsongs = bank[2] | (bank[3] << 8);
+
+    if (12 + (nsamps + nsongs) * 4 > size)
+        goto invalid;
+
+    u8 samp_type = (target_system == SYSTEM_GBA) ? MAS_TYPE_SAMPLE_GBA : MAS_TYPE_SAMPLE_NDS;
+
+    if (nsamps > 0)
+    {
+        in->blobs = calloc(nsamps, sizeof(MSL_SampleBlob));
+        if (in->blobs == NULL)
+        {
+            printf("Not enough memory to import %s\n", in->filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (u32 x = 0; x < nsamps; x++)
+    {
+        u32 offset = MSL_Get32(&bank[12 + x * 4]);
+        if (offset > size - 8)
+            goto invalid;
+
+        const u8 *entry = &bank[offset];
+        u32 samp_size = MSL_Get32(entry);
+        if (samp_size > size - offset - 8 || samp_size <= SAMPLE_FREQ_OFFSET + 2)
+            goto invalid;
+
+        if (entry[4] != samp_type)
+        {
+            printf("%s was created for a different system\n", in->filename);
+            exit(EXIT_FAILURE);
+        }
+        if (entry[5] != MAS_VERSION)
+        {
+            printf("%s was created by an incompatible version of mmutil\n", in->filename);
+            exit(EXIT_FAILURE);
+        }
+
+        MSL_SampleBlob *blob = &in->blobs[x];
+
+        blob->data = malloc(samp_size);
+        if (blob->data == NULL)
+        {
+            printf("Not enough memory to import %s\n", in->filename);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(blob->data, &entry[8], samp_size);
+        blob->size = samp_size;
+        blob->hash = MSL_HashSample(blob->data, blob->size);
+        blob->filename[0] = entry[6] ? '#' : 0;
+
+        in->nblobs++;
+    }
+
+    FileWriter fw;
+    size_t song_size;
+
+    file_open_write_buffer(&fw);
+
+    for (u32 x = 0; x < nsongs; x++)
+    {
+        u32 offset = MSL_Get32(&bank[12 + (nsamps + x) * 4]);
+        if (offset > size - 8)
+            goto invalid;
+
+        const u8 *entry = &bank[offset];
+        u32 entry_size = MSL_Get32(entry);
+        if (entry_size > size - offset - 8)
+            goto invalid;
+        entry_size += 8;
+
+        if (entry[4] != MAS_TYPE_SONG || entry[5] != MAS_VERSION)
+            goto invalid;
+
+        // Songs in soundbanks never contain sample data
+        if (entry_size < 8 + MAS_HEADER_SIZE ||
+            !(entry[8 + MAS_HEADER_FLAGS] & MAS_HEADER_FLAG_MSL_DEP))
+            goto invalid;
+
+        u32 song_offset = file_tell_write(&fw);
+        write_bytes(entry, entry_size, &fw);
+
+        // Check the song now so that invalid banks are reported before
+        // modifying the soundbank.
+        if (!MSL_RemapSong(&fw.data[song_offset], entry_size, NULL, nsamps))
+            goto invalid;
+    }
+
+    in->song = file_close_write_buffer(&song_size, &fw);
+    in->song_size = song_size;
+    in->nsongs = nsongs;
+
+    if (verbose)
+    {
+        printf("Imported %u samples and %u songs from %s\n",
+               (unsigned int)nsamps, (unsigned int)nsongs, in->filename);
+    }
+
+    return;
+
+invalid:
+    printf("Invalid soundbank: %s\n", in->filename);
+    exit(EXIT_FAILURE);
+}
+
+// Load an input file and convert it to the format used in the soundbank (or
+// get the result from the conversion cache). This doesn't use any global
+// state, so it's safe to call it from several threads at the same time.
+static void MSL_PrepareFile(MSL_Input *in, bool verbose)
+{
+    FileReader fr;
+
+    in->type = INPUT_TYPE_UNK;
+    in->blobs = NULL;
+    in->nblobs = 0;
+    in->song = NULL;
+    in->song_size = 0;
+    in->nsongs = 0;
+
+    if (file_open_read(in->filename, &fr))
+    {
+        printf("Cannot open %s for reading! Skipping.\n", in->filename);
+        return;
+    }
+
+    int f_ext = get_ext(in->filename);
+    switch (f_ext)
+    {
+        case INPUT_TYPE_MOD:
+        case INPUT_TYPE_S3M:
+        case INPUT_TYPE_XM:
+        case INPUT_TYPE_IT:
+        case INPUT_TYPE_WAV:
+            in->type = f_ext;
+            break;
+        case INPUT_TYPE_MSL:
+            // Soundbanks don't need to be converted, so they aren't cached
+            in->type = f_ext;
+            MSL_ImportSoundbank(in, &fr, verbose);
+            file_close_read(&fr);
+            return;
+        default:
+            // print error/warning
+            printf("Unknown file %s...\n", in->filename);
+            file_close_read(&fr);
+            return;
+    }
+
+    CacheKey key;
+
+    // Cache entries don't contain the alternative encodings of the samples
+    bool use_cache = cache_enabled() && !MSL_UsingBudget();
+
+    if (use_cache)
+    {
+        char options[64];
+        snprintf(options, sizeof(options), "%d|%d|%u", in->entry->format,
+                 in->entry->compression, (unsigned int)in->entry->rate);
+
+        key = cache_key(fr.data, fr.size, in->type, options);
+
+        if (MSL_LoadCacheEntry(in, &key))
+        {
+            if (verbose)
+                printf("Using cached conversion of %s\n", in->filename);
+
+            file_close_read(&fr);
+            return;
+        }
+    }
+
+    MSL_ConvertFile(in, &fr, verbose);
+
+    file_close_read(&fr);
+
+    if (use_cache)
+        MSL_StoreCacheEntry(in, &key);
+}
+
+// Add an input file prepared by MSL_PrepareFile() to the soundbank
+static void MSL_MergeFile(MSL_Input *in)
+{
+    switch (in->type)
+    {
+        case INPUT_TYPE_MOD:
+        case INPUT_TYPE_S3M:
+        case INPUT_TYPE_XM:
+        case INPUT_TYPE_IT:
+            MSL_PrintDefinition(MSL_InputName(in), MSL_AddModule(in), "MOD_");
+            break;
+        case INPUT_TYPE_WAV:
+            MSL_PrintDefinition(MSL_InputName(in),
+                                MSL_AddSample(&in->blobs[0], in->filename, 0), "SFX_");
+            break;
+        case INPUT_TYPE_MSL:
+            MSL_AddSoundbank(in);
+            break;
+        default:
+            break;
+    }
+
+    MSL_FreeInput(in);
+}
+
+void MSL_LoadFile(const InputEntry *entry, bool verbose)
+{
+    MSL_Input in = { 0 };
+
+    in.entry = entry;
+    in.filename = entry->filename;
+
+    MSL_PrepareFile(&in, verbose);
+    MSL_MergeFile(&in);
+}
+
+// Inputs are prepared by a pool of worker threads and merged by the main thread
+// in the order of the command line, so that the result is the same as when
+// they are loaded one by one. Workers can't get too far ahead of the main
+// thread so that the number of files kept in memory is limited.
+typedef struct tMSL_JobQueue
+{
+    MSL_Input *inputs;
+    int count;
+    int next;   // Next input to be prepared
+    int merged; // Number of inputs added to the soundbank
+    int window; // Max number of inputs prepared but not merged
+    bool verbose;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+MSL_JobQueue;
+
+static void *MSL_Worker(void *arg)
+{
+    MSL_JobQueue *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+
+    while (1)
+    {
+        while (q->next < q->count && q->next >= q->merged + q->window)
+            pthread_cond_wait(&q->cond, &q->lock);
+
+        if (q->next >= q->count)
+            break;
+
+        MSL_Input *in = &q->inputs[q->next++];
+
+        pthread_mutex_unlock(&q->lock);
+        MSL_PrepareFile(in, q->verbose);
+        pthread_mutex_lock(&q->lock);
+
+        in->ready = true;
+        pthread_cond_broadcast(&q->cond);
+    }
+
+    pthread_mutex_unlock(&q->lock);
+
+    return NULL;
+}
+
+static MSL_Input *MSL_AllocInputs(const InputEntry *entries, int count)
+{
+    MSL_Input *inputs = calloc(count > 0 ? count : 1, sizeof(MSL_Input));
+    if (inputs == NULL)
+    {
+        printf("Not enough memory for the list of inputs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int x = 0; x < count; x++)
+    {
+        inputs[x].entry = &entries[x];
+        inputs[x].filename = entries[x].filename;
+    }
+
+    return inputs;
+}
+
+// If "merge" is set, inputs are added to the soundbank as soon as they are
+// ready. If not, all of them are prepared and kept in memory.
+static void MSL_LoadFilesParallel(MSL_Input *inputs, int count, int jobs,
+                                  bool merge, bool verbose)
+{
+    MSL_JobQueue q = { 0 };
+
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    if (threads == NULL)
+    {
+        printf("Not enough memory for the job queue\n");
+        exit(EXIT_FAILURE);
+    }
+
+    q.inputs = inputs;
+    q.count = count;
+
+    if (jobs > q.count)
+        jobs = q.count;
+
+    q.window = merge ? jobs * 2 : count;
+    q.verbose = verbose;
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.cond, NULL);
+
+    int started = 0;
+    for ( ; started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, MSL_Worker, &q) != 0)
+            break;
+    }
+
+    if (started == 0)
+    {
+        // Fall back to loading the files from this thread
+        for (int x = 0; x < q.count; x++)
+        {
+            MSL_PrepareFile(&q.inputs[x], verbose);
+            if (merge)
+                MSL_MergeFile(&q.inputs[x]);
+        }
+    }
+    else
+    {
+        for (int x = 0; x < q.count; x++)
+        {
+            pthread_mutex_lock(&q.lock);
+            while (!q.inputs[x].ready)
+                pthread_cond_wait(&q.cond, &q.lock);
+            pthread_mutex_unlock(&q.lock);
+
+            if (merge)
+                MSL_MergeFile(&q.inputs[x]);
+
+            pthread_mutex_lock(&q.lock);
+            q.merged++;
+            pthread_cond_broadcast(&q.cond);
+            pthread_mutex_unlock(&q.lock);
+        }
+    }
+
+    for (int x = 0; x < started; x++)
+        pthread_join(threads[x], NULL);
+
+    pthread_cond_destroy(&q.cond);
+    pthread_mutex_destroy(&q.lock);
+
+    free(threads);
+}
+
+// Fitting the soundbank in a budget
+//
+// Samples that are identical form a unit. Samples of songs are merged with the
+// identical samples added before them to the soundbank, but WAV files are
+// always added, so a unit may be stored more than once in the soundbank. Each unit can be encoded in several ways, each one
+// with a size and a loss (the noise it adds, relative to the signal). Starting
+// from the default encodings, the unit that adds the least noise per byte saved
+// is encoded with a smaller encoding, until the soundbank (or every song) fits
+// in the budget. Only the encodings in the lower convex hull of each unit are
+// used, so that the noise added per byte of the changes of a unit always
+// increases, and all the changes can be sorted and done in one go.
+
+typedef struct tMSL_BudgetUnit
+{
+    MSL_SampleBlob *blob;   // First sample of the unit (in input order)
+    u8 hull[16];            // Encodings in the convex hull (0 is the default)
+    u32 nhull;
+    u32 pos;                // Position of the current encoding in the hull
+    u32 encoding;           // Encoding chosen in the end (it may not be in the hull)
+    u32 copies;             // Times that the unit is stored in the soundbank
+    u32 first_limit;        // Limits that include the unit in budget_limits
+    u32 nlimits;
+}
+MSL_BudgetUnit;
+
+typedef struct tMSL_BudgetLimit
+{
+    const char *file;   // Input file of the song (NULL for the soundbank)
+    u32 index;          // Index of the song in the input file
+    u32 budget;
+    u64 size;
+}
+MSL_BudgetLimit;
+
+typedef struct tMSL_BudgetStep
+{
+    u32 unit;
+    u32 pos;        // Position in the hull after the change
+    double slope;   // Noise added per byte saved
+}
+MSL_BudgetStep;
+
+// Size of an encoding of a sample in the soundbank
+static u32 MSL_BudgetSize(const MSL_SampleBlob *blob, u32 encoding)
+{
+    u32 size = (encoding == 0) ? blob->size : blob->alts[encoding - 1].blob.size;
+    return (size + 8 + 3) & ~3;
+}
+
+static double MSL_BudgetLoss(const MSL_SampleBlob *blob, u32 encoding)
+{
+    return (encoding == 0) ? 0.0 : blob->alts[encoding - 1].loss;
+}
+
+static double MSL_BudgetSlope(const MSL_SampleBlob *blob, u32 from, u32 to)
+{
+    return (MSL_BudgetLoss(blob, to) - MSL_BudgetLoss(blob, from)) /
+           (double)(MSL_BudgetSize(blob, from) - MSL_BudgetSize(blob, to));
+}
+
+static void MSL_BudgetHull(MSL_BudgetUnit *unit)
+{
+    const MSL_SampleBlob *blob = unit->blob;
+    u32 default_size = MSL_BudgetSize(blob, 0);
+    u8 order[16];
+    u32 n = 0;
+
+    // Encodings smaller than the default one, sorted by size (from the biggest
+    // to the smallest) and by loss.
+    for (u32 x = 1; x <= blob->nalts && n < sizeof(unit->hull) - 1; x++)
+    {
+        if (MSL_BudgetSize(blob, x) >= default_size)
+            continue;
+
+        u32 y = n++;
+        for ( ; y > 0; y--)
+        {
+            u32 size = MSL_BudgetSize(blob, order[y - 1]);
+            if (size > MSL_BudgetSize(blob, x) ||
+                (size == MSL_BudgetSize(blob, x) &&
+                 MSL_BudgetLoss(blob, order[y - 1]) <= MSL_BudgetLoss(blob, x)))
+                break;
+            order[y] = order[y - 1];
+        }
+        order[y] = x;
+    }
+
+    unit->hull[0] = 0;
+    unit->nhull = 1;
+    unit->pos = 0;
+
+    for (u32 x = 0; x < n; x++)
+    {
+        u32 c = order[x];
+        u32 top = unit->hull[unit->nhull - 1];
+
+        if (MSL_BudgetSize(blob, c) == MSL_BudgetSize(blob, top))
+            continue;
+
+        while (unit->nhull >= 2 &&
+               MSL_BudgetSlope(blob, unit->hull[unit->nhull - 2], unit->hull[unit->nhull - 1]) >=
+               MSL_BudgetSlope(blob, unit->hull[unit->nhull - 1], c))
+            unit->nhull--;
+
+        unit->hull[unit->nhull++] = c;
+    }
+}
+
+// Times that a unit is counted in a limit. Songs only use one of the copies.
+static u32 MSL_BudgetCopies(const MSL_BudgetUnit *unit, const MSL_BudgetLimit *limit)
+{
+    return (limit->file == NULL) ? unit->copies : 1;
+}
+
+typedef struct tMSL_BlobRef
+{
+    MSL_SampleBlob *blob;
+    u32 flat;   // Index of the sample in the list of samples of all inputs
+    bool wav;   // Added to the soundbank even if it's identical to another one
+}
+MSL_BlobRef;
+
+static int MSL_CompareBlobRefs(const void *a, const void *b)
+{
+    const MSL_BlobRef *ra = a;
+    const MSL_BlobRef *rb = b;
+
+    if (ra->blob->hash != rb->blob->hash)
+        return ra->blob->hash < rb->blob->hash ? -1 : 1;
+    if (ra->blob->size != rb->blob->size)
+        return ra->blob->size < rb->blob->size ? -1 : 1;
+    return ra->flat < rb->flat ? -1 : (ra->flat > rb->flat);
+}
+
+// Samples with the same data and alternative encodings are one unit. The data
+// of the headers is compared too, as the frequency may be different.
+static bool MSL_SameEncodings(const MSL_SampleBlob *a, const MSL_SampleBlob *b)
+{
+    if (a->hash != b->hash || a->size != b->size || a->nalts != b->nalts)
+        return false;
+
+    if (memcmp(a->data, b->data, a->size) != 0)
+        return false;
+
+    for (u32 x = 0; x < a->nalts; x++)
+    {
+        if (a->alts[x].blob.size != b->alts[x].blob.size ||
+            a->alts[x].blob.hash != b->alts[x].blob.hash)
+            return false;
+    }
+
+    return true;
+}
+
+static int MSL_CompareBudgetSteps(const void *a, const void *b)
+{
+    const MSL_BudgetStep *sa = a;
+    const MSL_BudgetStep *sb = b;
+
+    if (sa->slope != sb->slope)
+        return sa->slope < sb->slope ? -1 : 1;
+    if (sa->unit != sb->unit)
+        return sa->unit < sb->unit ? -1 : 1;
+    return sa->pos < sb->pos ? -1 : (sa->pos > sb->pos);
+}
+
+// Use an alternative encoding of a sample of an input file
+static void MSL_UseAlternative(MSL_Input *in, u32 x, u32 encoding)
+{
+    MSL_SampleBlob *blob = &in->blobs[x];
+    MSL_SampleAlt *alt = &blob->alts[encoding - 1];
+
+    free(blob->data);
+    blob->data = alt->blob.data;
+    blob->size = alt->blob.size;
+    blob->hash = alt->blob.hash;
+    blob->padding = alt->blob.padding;
+    blob->unrolled = alt->blob.unrolled;
+    alt->blob.data = NULL;
+
+    // Songs have their own copy of the sample rate
+    if (in->song != NULL)
+    {
+        const u8 *header = &in->song[8];
+        u32 table = 8 + MAS_HEADER_SIZE + header[MAS_HEADER_INST_COUNT] * 4;
+        u32 offset = 8 + MSL_Get32(&in->song[table + x * 4]) + MAS_SAMPLE_FREQ_OFFSET;
+
+        in->song[offset] = (alt->frequency / 4) & 0xFF;
+        in->song[offset + 1] = (alt->frequency / 4) >> 8;
+    }
+}
+
+// Choose the encoding of every sample of the inputs so that the soundbank (or
+// every song with the samples it uses) fits in the budget, adding as little
+// noise as possible.
+static void MSL_FitBudget(MSL_Input *inputs, int count, bool verbose)
+{
+    u32 nblobs = 0;
+    u32 nsongs = 0;
+
+    for (int x = 0; x < count; x++)
+    {
+        nblobs += inputs[x].nblobs;
+        nsongs += inputs[x].nsongs;
+    }
+
+    u32 *first_blob = malloc((count + 1) * sizeof(u32));
+    MSL_BlobRef *refs = malloc((nblobs + 1) * sizeof(MSL_BlobRef));
+    u32 *unit_of = malloc((nblobs + 1) * sizeof(u32));
+    MSL_BudgetUnit *units = malloc((nblobs + 1) * sizeof(MSL_BudgetUnit));
+    MSL_BudgetLimit *limits = malloc((nsongs + 1) * sizeof(MSL_BudgetLimit));
+
+    if (first_blob == NULL || refs == NULL || unit_of == NULL || units == NULL ||
+        limits == NULL)
+        goto nomem;
+
+    // Group identical samples in units
+
+    u32 flat = 0;
+    for (int x = 0; x < count; x++)
+    {
+        first_blob[x] = flat;
+        for (u32 y = 0; y < inputs[x].nblobs; y++)
+        {
+            refs[flat].blob = &inputs[x].blobs[y];
+            refs[flat].flat = flat;
+            refs[flat].wav = inputs[x].type == INPUT_TYPE_WAV;
+            flat++;
+        }
+    }
+
+    qsort(refs, nblobs, sizeof(MSL_BlobRef), MSL_CompareBlobRefs);
+
+    u32 nunits = 0;
+    for (u32 x = 0; x < nblobs; x++)
+    {
+        MSL_SampleBlob *blob = refs[x].blob;
+
+        if (nunits > 0)
+        {
+            MSL_SampleBlob *leader = units[nunits - 1].blob;
+
+            if (MSL_SameEncodings(leader, blob))
+            {
+                unit_of[refs[x].flat] = nunits - 1;
+                if (refs[x].wav)
+                    units[nunits - 1].copies++;
+                continue;
+            }
+        }
+
+        units[nunits].blob = blob;
+        units[nunits].copies = 1;
+        units[nunits].nlimits = 0;
+        MSL_BudgetHull(&units[nunits]);
+        unit_of[refs[x].flat] = nunits++;
+    }
+
+    // Limits and the units included in each one. The size of the soundbank
+    // includes its header and the parapointers of all the entries.
+
+    u32 nlimits = 0;
+    u32 songs_size = 0;
+
+    for (int x = 0; x < count; x++)
+    {
+        const u8 *song = inputs[x].song;
+        for (u32 y = 0; y < inputs[x].nsongs; y++)
+        {
+            songs_size += (MSL_EntrySize(song) + 3) & ~3;
+            song += MSL_EntrySize(song);
+        }
+    }
+
+    if (MSL_BUDGET > 0)
+    {
+        limits[nlimits].file = NULL;
+        limits[nlimits].index = 0;
+        limits[nlimits].budget = MSL_BUDGET;
+        limits[nlimits].size = 12 + nsongs * 4 + songs_size;
+        nlimits++;
+    }
+
+    // Pairs of unit and limit, sorted by unit
+    u32 npairs = 0;
+    u32 max_pairs = (MSL_BUDGET > 0 ? nunits : 0) + (MSL_SONG_BUDGET > 0 ? nblobs : 0);
+    u32 *pairs = malloc((max_pairs + 1) * 2 * sizeof(u32));
+    u32 *last_limit = malloc((nunits + 1) * sizeof(u32));
+    u32 *budget_limits = malloc((max_pairs + 1) * sizeof(u32));
+
+    if (pairs == NULL || last_limit == NULL || budget_limits == NULL)
+        goto nomem;
+
+    for (u32 x = 0; x < nunits; x++)
+        last_limit[x] = 0xFFFFFFFF;
+
+    if (MSL_BUDGET > 0)
+    {
+        for (u32 x = 0; x < nunits; x++)
+        {
+            units[x].nlimits++;
+            pairs[npairs * 2] = x;
+            pairs[npairs * 2 + 1] = 0;
+            npairs++;
+            limits[0].size += (4 + MSL_BudgetSize(units[x].blob, 0)) * units[x].copies;
+        }
+    }
+
+    if (MSL_SONG_BUDGET > 0)
+    {
+        for (int x = 0; x < count; x++)
+        {
+            const u8 *song = inputs[x].song;
+
+            for (u32 y = 0; y < inputs[x].nsongs; y++)
+            {
+                MSL_BudgetLimit *limit = &limits[nlimits];
+
+                limit->file = inputs[x].filename;
+                limit->index = y;
+                limit->budget = MSL_SONG_BUDGET;
+                limit->size = (MSL_EntrySize(song) + 3) & ~3;
+
+                for (u32 z = 0; z < song[8 + MAS_HEADER_SAMP_COUNT]; z++)
+                {
+                    u32 unit = unit_of[first_blob[x] + MSL_SongSample(song, z)];
+
+                    // Songs may use the same sample more than once
+                    if (last_limit[unit] == nlimits)
+                        continue;
+                    last_limit[unit] = nlimits;
+
+                    units[unit].nlimits++;
+                    pairs[npairs * 2] = unit;
+                    pairs[npairs * 2 + 1] = nlimits;
+                    npairs++;
+                    limit->size += MSL_BudgetSize(units[unit].blob, 0);
+                }
+
+                nlimits++;
+                song += MSL_EntrySize(song);
+            }
+        }
+    }
+
+    u32 pos = 0;
+    for (u32 x = 0; x < nunits; x++)
+    {
+        units[x].first_limit = pos;
+        pos += units[x].nlimits;
+        units[x].nlimits = 0;
+    }
+    for (u32 x = 0; x < npairs; x++)
+    {
+        MSL_BudgetUnit *unit = &units[pairs[x * 2]];
+        budget_limits[unit->first_limit + unit->nlimits++] = pairs[x * 2 + 1];
+    }
+
+    // Sort all the possible changes and do them until everything fits
+
+    u32 nsteps = 0;
+    for (u32 x = 0; x < nunits; x++)
+        nsteps += units[x].nhull - 1;
+
+    MSL_BudgetStep *steps = malloc((nsteps + 1) * sizeof(MSL_BudgetStep));
+    if (steps == NULL)
+        goto nomem;
+
+    nsteps = 0;
+    for (u32 x = 0; x < nunits; x++)
+    {
+        for (u32 y = 1; y < units[x].nhull; y++)
+        {
+            steps[nsteps].unit = x;
+            steps[nsteps].pos = y;
+            steps[nsteps].slope = MSL_BudgetSlope(units[x].blob, units[x].hull[y - 1],
+                                                  units[x].hull[y]);
+            nsteps++;
+        }
+    }
+
+    qsort(steps, nsteps, sizeof(MSL_BudgetStep), MSL_CompareBudgetSteps);
+
+    u32 over = 0;
+    for (u32 x = 0; x < nlimits; x++)
+    {
+        if (limits[x].size > limits[x].budget)
+            over++;
+    }
+
+    for (u32 x = 0; x < nsteps && over > 0; x++)
+    {
+        MSL_BudgetUnit *unit = &units[steps[x].unit];
+        u32 *unit_limits = &budget_limits[unit->first_limit];
+
+        // Changes of a unit that has been skipped can't be done
+        if (unit->pos + 1 != steps[x].pos)
+            continue;
+
+        // Only change units that help fitting something in the budget. Sizes
+        // only go down, so they won't be needed later either.
+        bool useful = false;
+        for (u32 y = 0; y < unit->nlimits; y++)
+        {
+            if (limits[unit_limits[y]].size > limits[unit_limits[y]].budget)
+                useful = true;
+        }
+        if (!useful)
+            continue;
+
+        u32 saved = MSL_BudgetSize(unit->blob, unit->hull[unit->pos]) -
+                    MSL_BudgetSize(unit->blob, unit->hull[steps[x].pos]);
+
+        for (u32 y = 0; y < unit->nlimits; y++)
+        {
+            MSL_BudgetLimit *limit = &limits[unit_limits[y]];
+
+            bool was_over = limit->size > limit->budget;
+            limit->size -= (u64)saved * MSL_BudgetCopies(unit, limit);
+            if (was_over && limit->size <= limit->budget)
+                over--;
+        }
+
+        unit->pos = steps[x].pos;
+    }
+
+    for (u32 x = 0; x < nunits; x++)
+        units[x].encoding = units[x].hull[units[x].pos];
+
+    // The last change of a unit may save more bytes than needed, and only the
+    // encodings of the hull have been used. Starting from the units with the
+    // most noise added per byte, use the encoding with the least loss that
+    // still fits in the budgets of the unit.
+    for (u32 x = nsteps; x > 0; x--)
+    {
+        MSL_BudgetUnit *unit = &units[steps[x - 1].unit];
+        u32 *unit_limits = &budget_limits[unit->first_limit];
+
+        if (unit->pos != steps[x - 1].pos)
+            continue;
+
+        u64 slack = UINT64_MAX;
+        for (u32 y = 0; y < unit->nlimits; y++)
+        {
+            MSL_BudgetLimit *limit = &limits[unit_limits[y]];
+            u32 copies = MSL_BudgetCopies(unit, limit);
+            if (limit->size > limit->budget)
+                slack = 0;
+            else if ((limit->budget - limit->size) / copies < slack)
+                slack = (limit->budget - limit->size) / copies;
+        }
+
+        u32 size = MSL_BudgetSize(unit->blob, unit->encoding);
+        u32 best = unit->encoding;
+
+        for (u32 e = 0; e <= unit->blob->nalts; e++)
+        {
+            if (MSL_BudgetSize(unit->blob, e) <= size + slack &&
+                MSL_BudgetLoss(unit->blob, e) < MSL_BudgetLoss(unit->blob, best))
+                best = e;
+        }
+
+        for (u32 y = 0; y < unit->nlimits; y++)
+        {
+            MSL_BudgetLimit *limit = &limits[unit_limits[y]];
+            u32 copies = MSL_BudgetCopies(unit, limit);
+            limit->size = limit->size - (u64)size * copies +
+                          (u64)MSL_BudgetSize(unit->blob, best) * copies;
+        }
+
+        unit->encoding = best;
+    }
+
+    // Use the chosen encodings
+
+    u32 changed = 0;
+    for (int x = 0; x < count; x++)
+    {
+        for (u32 y = 0; y < inputs[x].nblobs; y++)
+        {
+            MSL_SampleBlob *blob = &inputs[x].blobs[y];
+            MSL_BudgetUnit *unit = &units[unit_of[first_blob[x] + y]];
+            u32 encoding = unit->encoding;
+
+            if (encoding > 0 && encoding <= blob->nalts)
+            {
+                MSL_UseAlternative(&inputs[x], y, encoding);
+                changed++;
+            }
+
+            MSL_FreeAlternatives(blob);
+        }
+    }
+
+    for (u32 x = 0; x < nlimits; x++)
+    {
+        MSL_BudgetLimit *limit = &limits[x];
+
+        if (limit->size <= limit->budget)
+            continue;
+
+        if (limit->file == NULL)
+        {
+            printf("warning: The soundbank doesn't fit in the budget (%u > %u bytes)\n",
+                   (unsigned int)limit->size, (unsigned int)limit->budget);
+        }
+        else
+        {
+            printf("warning: Song %u of %s doesn't fit in the budget (%u > %u bytes)\n",
+                   (unsigned int)limit->index, limit->file,
+                   (unsigned int)limit->size, (unsigned int)limit->budget);
+        }
+    }
+
+    if (verbose)
+        printf("Samples encoded differently to fit in the budget: %u\n", (unsigned int)changed);
+
+    free(steps);
+    free(budget_limits);
+    free(last_limit);
+    free(pairs);
+    free(limits);
+    free(units);
+    free(unit_of);
+    free(refs);
+    free(first_blob);
+    return;
+
+nomem:
+    printf("Not enough memory to fit the soundbank in the budget\n");
+    exit(EXIT_FAILURE);
+}
+
+// Write a file name escaped the way Make expects it in dependency files
+static void MSL_WriteMakePath(const char *path, FileWriter *fw)
+{
+    for (size_t x = 0; path[x] != 0; x++)
+    {
+        if (path[x] == ' ' || path[x] == '#')
+            write8('\\', fw);
+        else if (path[x] == '$')
+            write8('$', fw);
+
+        write8(path[x], fw);
+    }
+}
+
+// Write a dependency file that lists all the files used to build the soundbank
+// (including manifests and the files listed in them). Like "gcc -MP", every
+// input has an empty rule so that Make doesn't fail if one is removed. Only the
+// soundbank is a target: the header isn't written when it doesn't change, so
+// Make would always consider it out of date.
+static void MSL_WriteDependencies(char *depfile, char *output,
+                                  char *argv[], int argc,
+                                  const InputEntry *inputs, int count)
+{
+    // Manifests from the command line, followed by all the input files
+    const char **deps = malloc((argc + count) * sizeof(char *));
+    int ndeps = 0;
+
+    if (deps == NULL)
+    {
+        printf("Not enough memory to write the dependency file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int x = 1; x < argc; x++)
+    {
+        if (argv[x][0] != '-' && get_ext(argv[x]) == INPUT_TYPE_TXT)
+            deps[ndeps++] = argv[x];
+    }
+    for (int x = 0; x < count; x++)
+        deps[ndeps++] = inputs[x].filename;
+
+    FileWriter fw;
+    size_t size;
+
+    file_open_write_buffer(&fw);
+
+    MSL_WriteMakePath(output, &fw);
+    write8(':', &fw);
+
+    for (int x = 0; x < ndeps; x++)
+    {
+        write_bytes(" \\\n  ", 5, &fw);
+        MSL_WriteMakePath(deps[x], &fw);
+    }
+    write8('\n', &fw);
+
+    for (int x = 0; x < ndeps; x++)
+    {
+        write8('\n', &fw);
+        MSL_WriteMakePath(deps[x], &fw);
+        write_bytes(":\n", 2, &fw);
+    }
+
+    u8 *data = file_close_write_buffer(&size, &fw);
+    file_write_if_changed(depfile, data, size);
+    free(data);
+    free(deps);
+}
+
+// Write a string escaped the way JSON expects it. Names in modules aren't
+// always ASCII, and they are treated as Latin-1.
+static void MSL_WriteJSONString(const char *str, FileWriter *fw)
+{
+    write8('"', fw);
+
+    for (const u8 *c = (const u8 *)str; *c != 0; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            write8('\\', fw);
+            write8(*c, fw);
+        }
+        else if (*c < 0x20 || *c >= 0x7F)
+        {
+            MSL_ReportPrintf(fw, "\\u%04x", *c);
+        }
+        else
+        {
+            write8(*c, fw);
+        }
+    }
+
+    write8('"', fw);
+}
+
+// Write the sizes of the instruments, samples or patterns of a song. The size
+// of each one goes from its parapointer to the next one, so it includes the
+// alignment padding. Patterns that share their data with a previous pattern
+// have size 0.
+static void MSL_ReportSongItems(const u8 *song, u32 first, u32 count,
+                                FileWriter *fw)
+{
+    const u8 *header = &song[8];
+    u32 mas_size = MSL_Get32(song);
+    u32 table = 8 + MAS_HEADER_SIZE;
+    u32 nitems = header[MAS_HEADER_INST_COUNT] + header[MAS_HEADER_SAMP_COUNT] +
+                 header[MAS_HEADER_PATT_COUNT];
+
+    for (u32 x = first; x < first + count; x++)
+    {
+        u32 start = MSL_Get32(&song[table + x * 4]);
+        u32 end = mas_size;
+        bool shared = false;
+
+        for (u32 y = 0; y < nitems; y++)
+        {
+            u32 other = MSL_Get32(&song[table + y * 4]);
+
+            if (other > start && other < end)
+                end = other;
+            else if (other == start && y < x)
+                shared = true;
+        }
+
+        MSL_ReportPrintf(fw, "%s%u", x == first ? "" : ", ",
+                         shared ? 0 : (unsigned int)(end - start));
+    }
+}
+
+// Write a JSON report with the size of every song and sample of the soundbank
+// (including the 8 bytes before the data of each one), the songs that use each
+// sample, and how much space has been saved by reusing duplicated samples.
+static void MSL_WriteReport(char *filename, char *output)
+{
+    // Songs that use each sample. The list of sample "x" goes from users[x] to
+    // users[x + 1] in the user_songs array.
+    u32 *users = calloc(MSL_NSAMPS + 1, sizeof(u32));
+    u32 *last_user = malloc((MSL_NSAMPS + 1) * sizeof(u32));
+    u16 *user_songs = NULL;
+    u32 nusers = 0;
+
+    if (users == NULL || last_user == NULL)
+        goto nomem;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        const u8 *song = msl_song_data.data;
+
+        for (u32 x = 0; x < MSL_NSAMPS; x++)
+            last_user[x] = 0xFFFFFFFF;
+
+        for (u32 x = 0; x < MSL_NSONGS; x++)
+        {
+            u32 samp_count = song[8 + MAS_HEADER_SAMP_COUNT];
+
+            for (u32 y = 0; y < samp_count; y++)
+            {
+                u16 id = MSL_SongSample(song, y);
+
+                // Songs may use the same sample more than once
+                if (id >= MSL_NSAMPS || last_user[id] == x)
+                    continue;
+                last_user[id] = x;
+
+                if (pass == 0)
+                    users[id + 1]++;
+                else
+                    user_songs[users[id]++] = x;
+            }
+
+            song += MSL_EntrySize(song);
+        }
+
+        if (pass == 0)
+        {
+            for (u32 x = 0; x < MSL_NSAMPS; x++)
+                users[x + 1] += users[x];
+
+            nusers = users[MSL_NSAMPS];
+            user_songs = malloc((nusers > 0 ? nusers : 1) * sizeof(u16));
+            if (user_songs == NULL)
+                goto nomem;
+        }
+        else
+        {
+            // The second pass has moved each start to the start of the next one
+            for (u32 x = MSL_NSAMPS; x > 0; x--)
+                users[x] = users[x - 1];
+            users[0] = 0;
+        }
+    }
+
+    // Sizes of the entries and of the file created by MSL_Export()
+    u32 file_size = 12 + (MSL_NSAMPS + MSL_NSONGS) * 4;
+    u32 samples_size = 0;
+    u32 songs_size = 0;
+
+    for (u32 x = 0; x < MSL_NSAMPS; x++)
+    {
+        u32 size = msl_samples[x].size + 8;
+        file_size = ((file_size + 3) & ~3) + size;
+        samples_size += size;
+    }
+
+    const u8 *song = msl_song_data.data;
+    for (u32 x = 0; x < MSL_NSONGS; x++)
+    {
+        u32 size = MSL_EntrySize(song);
+        file_size = ((file_size + 3) & ~3) + size;
+        songs_size += size;
+        song += size;
+    }
+
+    FileWriter fw;
+    size_t size;
+
+    file_open_write_buffer(&fw);
+
+    MSL_ReportPrintf(&fw, "{\n  \"soundbank\": ");
+    MSL_WriteJSONString(output, &fw);
+    MSL_ReportPrintf(&fw, ",\n  \"size\": %u,\n", (unsigned int)file_size);
+    MSL_ReportPrintf(&fw, "  \"samples_size\": %u,\n", (unsigned int)samples_size);
+    MSL_ReportPrintf(&fw, "  \"songs_size\": %u,\n", (unsigned int)songs_size);
+    MSL_ReportPrintf(&fw, "  \"duplicated_samples\": { \"count\": %u, \"bytes\": %u },\n",
+                     (unsigned int)msl_dedup_hits, (unsigned int)msl_dedup_bytes);
+
+    MSL_ReportPrintf(&fw, "  \"songs\": [");
+
+    song = msl_song_data.data;
+    for (u32 x = 0; x < MSL_NSONGS; x++)
+    {
+        const u8 *header = &song[8];
+        u32 inst_count = header[MAS_HEADER_INST_COUNT];
+        u32 samp_count = header[MAS_HEADER_SAMP_COUNT];
+        u32 patt_count = header[MAS_HEADER_PATT_COUNT];
+
+        // The header goes up to the first instrument, sample or pattern
+        u32 header_size = MSL_Get32(song);
+        for (u32 y = 0; y < inst_count + samp_count + patt_count; y++)
+        {
+            u32 parapointer = MSL_Get32(&song[8 + MAS_HEADER_SIZE + y * 4]);
+            if (parapointer < header_size)
+                header_size = parapointer;
+        }
+
+        MSL_ReportPrintf(&fw, "%s\n    {\n      \"id\": %u,\n      \"file\": ",
+                         x == 0 ? "" : ",", (unsigned int)x);
+        MSL_WriteJSONString(msl_songs[x].file, &fw);
+        MSL_ReportPrintf(&fw, ",\n      \"index\": %u,\n", (unsigned int)msl_songs[x].index);
+        MSL_ReportPrintf(&fw, "      \"size\": %u,\n", (unsigned int)MSL_EntrySize(song));
+        MSL_ReportPrintf(&fw, "      \"header\": %u,\n", (unsigned int)(8 + header_size));
+
+        MSL_ReportPrintf(&fw, "      \"instruments\": [");
+        MSL_ReportSongItems(song, 0, inst_count, &fw);
+        MSL_ReportPrintf(&fw, "],\n      \"samples\": [");
+        MSL_ReportSongItems(song, inst_count, samp_count, &fw);
+        MSL_ReportPrintf(&fw, "],\n      \"patterns\": [");
+        MSL_ReportSongItems(song, inst_count + samp_count, patt_count, &fw);
+
+        MSL_ReportPrintf(&fw, "],\n      \"sample_ids\": [");
+        for (u32 y = 0; y < samp_count; y++)
+        {
+            MSL_ReportPrintf(&fw, "%s%u", y == 0 ? "" : ", ",
+                             (unsigned int)MSL_SongSample(song, y));
+        }
+        MSL_ReportPrintf(&fw, "]\n    }");
+
+        song += MSL_EntrySize(song);
+    }
+
+    MSL_ReportPrintf(&fw, "\n  ],\n  \"samples\": [");
+
+    for (u32 x = 0; x < MSL_NSAMPS; x++)
+    {
+        MSL_SampleEntry *entry = &msl_samples[x];
+        const char *name = (entry->name[0] == '#') ? entry->name + 1 : entry->name;
+
+        MSL_ReportPrintf(&fw, "%s\n    {\n      \"id\": %u,\n      \"file\": ",
+                         x == 0 ? "" : ",", (unsigned int)x);
+        MSL_WriteJSONString(entry->file, &fw);
+        MSL_ReportPrintf(&fw, ",\n      \"index\": %u,\n      \"name\": ",
+                         (unsigned int)entry->index);
+        MSL_WriteJSONString(name, &fw);
+        MSL_ReportPrintf(&fw, ",\n      \"size\": %u,\n", (unsigned int)(entry->size + 8));
+        MSL_ReportPrintf(&fw, "      \"padding\": %u,\n", (unsigned int)entry->padding);
+        MSL_ReportPrintf(&fw, "      \"unrolled\": %u,\n", (unsigned int)entry->unrolled);
+
+        MSL_ReportPrintf(&fw, "      \"songs\": [");
+        for (u32 y = users[x]; y < users[x + 1]; y++)
+        {
+            MSL_ReportPrintf(&fw, "%s%u", y == users[x] ? "" : ", ",
+                             (unsigned int)user_songs[y]);
+        }
+        MSL_ReportPrintf(&fw, "]\n    }");
+    }
+
+    MSL_ReportPrintf(&fw, "\n  ]\n}\n");
+
+    u8 *data = file_close_write_buffer(&size, &fw);
+    file_write_if_changed(filename, data, size);
+    free(data);
+
+    free(user_songs);
+    free(last_user);
+    free(users);
+    return;
+
+nomem:
+    printf("Not enough memory to write the report\n");
+    exit(EXIT_FAILURE);
+}
+
+int MSL_Create(char *argv[], int argc, char *output, char *header, bool verbose)
+{
+    FileWriter header_data;
+
+    MSL_Erase();
+
+    str_msl[0] = 0;
+
+    F_HEADER = NULL;
+    if (header)
+    {
+        file_open_write_buffer(&header_data);
+        F_HEADER = &header_data;
+    }
+
+    // Get the full list of inputs before loading any of them, so that all the
+    // errors in manifest files are reported before doing any work.
+    int count;
+    InputEntry *inputs = Inputs_Collect(argv, argc, &count);
+
+    if (MSL_UsingBudget())
+    {
+        // All the files have to be converted before choosing how to encode
+        // their samples, so they are all kept in memory.
+        MSL_Input *in = MSL_AllocInputs(inputs, count);
+
+        bool keep_source = fix_keep_source;
+        fix_keep_source = true;
+        if (MSL_JOBS > 1)
+        {
+            MSL_LoadFilesParallel(in, count, MSL_JOBS, false, verbose);
+        }
+        else
+        {
+            for (int x = 0; x < count; x++)
+                MSL_PrepareFile(&in[x], verbose);
+        }
+        fix_keep_source = keep_source;
+
+        MSL_FitBudget(in, count, verbose);
+
+        for (int x = 0; x < count; x++)
+            MSL_MergeFile(&in[x]);
+
+        free(in);
+    }
+    else if (MSL_JOBS > 1)
+    {
+        MSL_Input *in = MSL_AllocInputs(inputs, count);
+        MSL_LoadFilesParallel(in, count, MSL_JOBS, true, verbose);
+        free(in);
+    }
+    else
+    {
+        for (int x = 0; x < count; x++)
+            MSL_LoadFile(&inputs[x], verbose);
+    }
+
+    MSL_Export(output);
+
+    if (F_HEADER)
+    {
+        size_t size;
+
+        MSL_HeaderPrintf("#define MSL_NSONGS    %i\r\n", MSL_NSONGS);
+        MSL_HeaderPrintf("#define MSL_NSAMPS    %i\r\n", MSL_NSAMPS);
+        MSL_HeaderPrintf("#define MSL_BANKSIZE    %i\r\n", MSL_NSAMPS + MSL_NSONGS);
+
+        u8 *data = file_close_write_buffer(&size, F_HEADER);
+        if (!file_write_if_changed(header, data, size) && verbose)
+            printf("Header file hasn't changed: %s\n", header);
+        free(data);
+
+        F_HEADER = NULL;
+    }
+
+    if (MSL_DEPFILE)
+        MSL_WriteDependencies(MSL_DEPFILE, output, argv, argc, inputs, count);
+
+    if (MSL_REPORT)
+        MSL_WriteReport(MSL_REPORT, output);
+
+    Inputs_Free(inputs, count);
+
+    MSL_Erase();
+
     return ERR_NONE;
 }
@@ -13,6 +13,20 @@
 #ifndef MSL_H__
 #define MSL_H__
 
+// Number of threads used to load and convert the input files of soundbanks
+extern int MSL_JOBS;
+
+// If it isn't NULL, dependency file (for Make) of the soundbank
+extern char *MSL_DEPFILE;
+
+// If it isn't NULL, JSON file with the sizes of the songs and samples
+extern char *MSL_REPORT;
+
+// If they aren't 0, maximum size of the soundbank and of each song (including
+// the samples it uses) in bytes. The samples are encoded so that they fit.
+extern u32 MSL_BUDGET;
+extern u32 MSL_SONG_BUDGET;
+
 int MSL_Create(char *argv[], int argc, char *output, char *header, bool verbose);
 
 #endif // MSL_H__
@@ -52,51 +52,20 @@
 #define vstr_s3m_pattern " * %2i%s"
 #endif
 
-int Load_S3M_SampleData(Sample *samp, u8 ffi)
+int Load_S3M_SampleData(Sample *samp, FileReader *fr, u8 ffi)
 {
     if (samp->sample_length == 0)
         return ERR_NONE;
 
-    if (samp->format & SAMPF_16BIT)
-        samp->data = malloc(samp->sample_length * 2);
-    else
-        samp->data = malloc(samp->sample_length);
-
     if (ffi == 1)
     {
         // signed samples [VERY OLD]
-        for (u32 x = 0; x < samp->sample_length; x++)
-        {
-            if (samp->format & SAMPF_16BIT)
-            {
-                int a = read16();
-                a += 32768;
-                ((u16*)samp->data)[x] = (u16)a;
-            }
-            else
-            {
-                int a = read8();
-                a += 128;
-                ((u8*)samp->data)[x] = (u8)a;
-            }
-        }
+        Sample_ReadData(samp, fr, (samp->format & SAMPF_16BIT) | SAMPF_SIGNED, false);
     }
     else if (ffi == 2)
     {
         // unsigned samples
-        for (u32 x = 0; x < samp->sample_length; x++)
-        {
-            if (samp->format & SAMPF_16BIT)
-            {
-                int a = read16();
-                ((u16*)samp->data)[x] = (u16)a;
-            }
-            else
-            {
-                int a = read8();
-                ((u8*)samp->data)[x] = (u8)a;
-            }
-        }
+        Sample_ReadData(samp, fr, samp->format & SAMPF_16BIT, false);
     }
     else
     {
@@ -107,41 +76,41 @@ int Load_S3M_SampleData(Sample *samp, u8 ffi)
     return ERR_NONE;
 }
 
-int Load_S3M_Sample(Sample *samp, bool verbose)
+int Load_S3M_Sample(Sample *samp, FileReader *fr, bool verbose)
 {
     memset(samp, 0, sizeof(Sample));
     samp->msl_index = 0xFFFF;
 
-    if (read8() == 1) // type, 1 = sample
+    if (read8(fr) == 1) // type, 1 = sample
     {
         for (u32 x = 0; x < 12; x++)
-            samp->filename[x] = read8();
+            samp->filename[x] = read8(fr);
 
-        samp->datapointer = (read8() * 65536 + read16()) * 16; //read24();
-        samp->sample_length = read32();
-        samp->loop_start = read32();
-        samp->loop_end = read32();
-        samp->default_volume = read8();
+        samp->datapointer = (read8(fr) * 65536 + read16(fr)) * 16; //read24(fr);
+        samp->sample_length = read32(fr);
+        samp->loop_start = read32(fr);
+        samp->loop_end = read32(fr);
+        samp->default_volume = read8(fr);
         samp->global_volume = 64;
-        read8(); // reserved
+        read8(fr); // reserved
 
-        if (read8() != 0) // packing, 0 = unpacked
+        if (read8(fr) != 0) // packing, 0 = unpacked
             return ERR_UNKNOWNSAMPLE;
 
-        u8 flags = read8();
+        u8 flags = read8(fr);
         samp->loop_type = flags & 1 ? 1 : 0;
         if (flags & 2)
             return ERR_UNKNOWNSAMPLE;
 
         //samp->bit16 = flags & 4 ? true : false;
         samp->format = flags & 4 ? SAMP_FORMAT_U16 : SAMP_FORMAT_U8;
-        samp->frequency = read32();
-        read32(); // reserved
-        skip8(8); // internal variables
+        samp->frequency = read32(fr);
+        read32(fr); // reserved
+        skip8(8, fr); // internal variables
         for (u32 x = 0;x < 28; x++)
-            samp->name[x] = read8();
+            samp->name[x] = read8(fr);
 
-        if (read32() != 'SRCS')
+        if (read32(fr) != 'SRCS')
             return ERR_UNKNOWNSAMPLE;
 
         if (verbose)
@@ -178,35 +147,34 @@ int Load_S3M_Sample(Sample *samp, bool verbose)
     return ERR_NONE;
 }
 
-int Load_S3M_Pattern(Pattern *patt)
+static const PatternEntry s3m_empty_entry = { .note = 250, .vol = 255 };
+
+int Load_S3M_Pattern(Pattern *patt, FileReader *fr)
 {
-    int clength = read16();
+    int clength = read16(fr);
     // unpack s3m data
 
     memset(patt, 0, sizeof(Pattern));
 
     patt->clength = clength;
-    patt->nrows = 64;
 
-    for (int row = 0; row < 64 * MAX_CHANNELS; row++)
-    {
-        patt->data[row].note = 250;
-        patt->data[row].vol = 255;
-    }
+    // The number of channels used by the pattern isn't known until it has been
+    // unpacked, so unused channels are removed at the end.
+    Pattern_Alloc(patt, 64, MAX_CHANNELS, &s3m_empty_entry);
 
     for (int row = 0; row < 64; row++)
     {
         u8 what;
 
-        while ((what = read8()) != 0) // BYTE:what / 0 = end of row
+        while ((what = read8(fr)) != 0) // BYTE:what / 0 = end of row
         {
             int col = what & 31; // & 31 = channel
 
-            int z = row * MAX_CHANNELS + col;
+            int z = row * patt->nchannels + col;
 
             if (what & 32) // & 32 = follows;  BYTE:note, BYTE:instrument
             {
-                patt->data[z].note = read8();
+                patt->data[z].note = read8(fr);
 
                 if (patt->data[z].note == 255)
                     patt->data[z].note = 250;
@@ -215,18 +183,18 @@ int Load_S3M_Pattern(Pattern *patt)
                 else
                     patt->data[z].note = S3M_NOTE(patt->data[z].note);
 
-                patt->data[z].inst = read8();
+                patt->data[z].inst = read8(fr);
             }
 
             if (what & 64) // & 64 = follows;  BYTE:volume
             {
-                patt->data[z].vol = read8();
+                patt->data[z].vol = read8(fr);
             }
 
             if (what & 128) // & 128 = follows; BYTE:command, BYTE:info
             {
-                patt->data[z].fx = read8();
-                patt->data[z].param = read8();
+                patt->data[z].fx = read8(fr);
+                patt->data[z].param = read8(fr);
                 if (patt->data[z].fx == 3) // convert pattern break to hexadecimal
                 {
                     patt->data[z].param = (patt->data[z].param & 0xF)
@@ -250,20 +218,22 @@ int Load_S3M_Pattern(Pattern *patt)
         }
     }
 
+    Pattern_Trim(patt, &s3m_empty_entry);
+
     return ERR_NONE;
 }
 
-int Load_S3M(MAS_Module *mod, bool verbose)
+int Load_S3M(MAS_Module *mod, FileReader *fr, bool verbose)
 {
     memset(mod, 0, sizeof(MAS_Module));
     for (int x = 0; x < 28; x++)
-        mod->title[x] = read8();    // read song name
+        mod->title[x] = read8(fr);    // read song name
 
-    read8(); // No need to check this value
-//    if (read8() != 0x1A)
+    read8(fr); // No need to check this value
+//    if (read8(fr) != 0x1A)
 //        return ERR_INVALID_MODULE;
 
-    if (read8() != 16)
+    if (read8(fr) != 16)
         return ERR_INVALID_MODULE;
 
     if (verbose)
@@ -272,11 +242,11 @@ int Load_S3M(MAS_Module *mod, bool verbose)
         printf("Loading S3M, \"%s\"\n", mod->title);
     }
 
-    skip8(2); // reserved space
-    mod->order_count = (u8)read16();
-    mod->inst_count = (u8)read16();
+    skip8(2, fr); // reserved space
+    mod->order_count = (u8)read16(fr);
+    mod->inst_count = (u8)read16(fr);
     mod->samp_count = mod->inst_count;
-    mod->patt_count = (u8)read16();
+    mod->patt_count = (u8)read16(fr);
 
     for (int x = 0; x < 32; x++)
         mod->channel_volume[x] = 64;
@@ -287,27 +257,27 @@ int Load_S3M(MAS_Module *mod, bool verbose)
     mod->restart_pos = 0;    // restart from beginning
     mod->old_mode = true;
 
-    u16 s3m_flags = read16();
+    u16 s3m_flags = read16(fr);
     (void)s3m_flags;
-    u16 cwt = read16();
+    u16 cwt = read16(fr);
     (void)cwt;
-    u16 ffi = read16();
-    if (read32() != 'MRCS') // "SCRM" mark
+    u16 ffi = read16(fr);
+    if (read32(fr) != 'MRCS') // "SCRM" mark
         return ERR_INVALID_MODULE;
 
-    mod->global_volume = read8()*2;
-    mod->initial_speed = read8();
-    mod->initial_tempo = read8();
+    mod->global_volume = read8(fr)*2;
+    mod->initial_speed = read8(fr);
+    mod->initial_tempo = read8(fr);
 
-    bool stereo = read8() >> 7; // master volume
-    read8(); // ultra click removal
-    u8 dp = read8(); // default pan positions (when 252)
-    skip8(8 + 2); // reserved space + special pointer
+    bool stereo = read8(fr) >> 7; // master volume
+    read8(fr); // ultra click removal
+    u8 dp = read8(fr); // default pan positions (when 252)
+    skip8(8 + 2, fr); // reserved space + special pointer
 
     bool chan_enabled[32];
     for (int x = 0; x < 32; x++)
     {
-        u8 chn = read8();
+        u8 chn = read8(fr);
         chan_enabled[x] = chn >> 7;
         (void)chan_enabled[0]; // TODO: This variable is unused, is that ok?
         if (stereo)
@@ -325,22 +295,22 @@ int Load_S3M(MAS_Module *mod, bool verbose)
 
     for (int x = 0; x < mod->order_count; x++)
     {
-        mod->orders[x] = read8();
+        mod->orders[x] = read8(fr);
     }
 
     u16 *parap_inst = (u16*)malloc(mod->inst_count * sizeof(u16));
     u16 *parap_patt = (u16*)malloc(mod->patt_count * sizeof(u16));
 
     for (int x = 0; x < mod->inst_count; x++)
-        parap_inst[x] = read16();
+        parap_inst[x] = read16(fr);
     for (int x = 0; x < mod->patt_count; x++)
-        parap_patt[x] = read16();
+        parap_patt[x] = read16(fr);
 
     if (dp == 252)
     {
         for (int x = 0; x < 32; x++)
         {
-            u8 a = read8();
+            u8 a = read8(fr);
             if (a & 32)
             {
                 mod->channel_panning[x] = (a & 15) * 16 > 255 ? 255 : (a & 15) * 16;
@@ -410,8 +380,8 @@ int Load_S3M(MAS_Module *mod, bool verbose)
         }
 
         // load sample
-        file_seek_read(parap_inst[x] * 16, SEEK_SET);
-        if (Load_S3M_Sample(&mod->samples[x], verbose))
+        file_seek_read(parap_inst[x] * 16, SEEK_SET, fr);
+        if (Load_S3M_Sample(&mod->samples[x], fr, verbose))
         {
             printf("Error loading sample!\n");
             return ERR_UNKNOWNSAMPLE;
@@ -447,8 +417,8 @@ int Load_S3M(MAS_Module *mod, bool verbose)
             printf(vstr_s3m_pattern, x + 1, ((x + 1) % 15) ? "" : "\n");
         }
         //printf("%i...", x+1);
-        file_seek_read(parap_patt[x] * 16, SEEK_SET);
-        Load_S3M_Pattern(&mod->patterns[x]);
+        file_seek_read(parap_patt[x] * 16, SEEK_SET, fr);
+        Load_S3M_Pattern(&mod->patterns[x], fr);
     }
 
     if (verbose)
@@ -460,8 +430,8 @@ int Load_S3M(MAS_Module *mod, bool verbose)
 
     for (int x = 0; x < mod->samp_count; x++)
     {
-        file_seek_read(mod->samples[x].datapointer, SEEK_SET);
-        Load_S3M_SampleData(&mod->samples[x], (u8)ffi);
+        file_seek_read(mod->samples[x].datapointer, SEEK_SET, fr);
+        Load_S3M_SampleData(&mod->samples[x], fr, (u8)ffi);
     }
 
     if (verbose)
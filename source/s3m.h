@@ -13,6 +13,6 @@
 #ifndef S3M_H__
 #define S3M_H__
 
-int Load_S3M(MAS_Module *mod, bool verbose);
+int Load_S3M(MAS_Module *mod, FileReader *fr, bool verbose);
 
 #endif // S3M_H__
@@ -15,6 +15,7 @@
 
 #define GBA_MIN_LOOP_SIZE       512
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
@@ -22,10 +23,36 @@
 #include "defs.h"
 #include "mas.h"
 #include "errors.h"
+#include "files.h"
 #include "systems.h"
 #include "adpcm.h"
+#include "samplefix.h"
 
-extern int ignore_sflags;
+bool fix_keep_source = false;
+bool fix_resample_sinc = false;
+u32 fix_max_rate = 0;
+bool fix_lazy_load = false;
+
+// SNR of conversions that don't lose any information
+#define SNR_MAX 120.0
+
+// Changes the number of values allocated for the data of a sample. The values
+// that fit in the new size are kept. realloc() can usually grow or shrink the
+// buffer where it is, so long samples aren't copied to a new buffer every time
+// they are padded or unrolled.
+static void Sample_Resize(Sample *samp, u32 length)
+{
+    size_t size = (size_t)length * ((samp->format & SAMPF_16BIT) ? 2 : 1);
+
+    void *data = realloc(samp->data, size > 0 ? size : 1);
+    if (data == NULL)
+    {
+        printf("Not enough memory to convert sample\n");
+        exit(EXIT_FAILURE);
+    }
+
+    samp->data = data;
+}
 
 void Sample_PadStart(Sample *samp, u32 count)
 {
@@ -34,34 +61,28 @@ void Sample_PadStart(Sample *samp, u32 count)
     if (count == 0)
         return; // nothing to do
 
+    Sample_Resize(samp, samp->sample_length + count);
+
     if (samp->format & SAMPF_16BIT)
     {
-        u16 *newdata16 = malloc((samp->sample_length + count) * 2);
+        u16 *data16 = samp->data;
 
+        memmove(&data16[count], data16, samp->sample_length * 2);
         for (u32 x = 0; x < count; x++)
-            newdata16[x] = 32768;
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata16[count + x] = ((u16 *)samp->data)[x];
-
-        free(samp->data);
-        samp->data = (void *)newdata16;
+            data16[x] = 32768;
     }
     else
     {
-        u8 *newdata8 = malloc(samp->sample_length + count);
-
-        for (u32 x = 0; x < count; x++)
-            newdata8[x] = 128;
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata8[count + x] = ((u8 *)samp->data)[x];
+        u8 *data8 = samp->data;
 
-        free(samp->data);
-        samp->data = (void *)newdata8;
+        memmove(&data8[count], data8, samp->sample_length);
+        memset(data8, 128, count);
     }
 
     samp->loop_start    += count;
     samp->loop_end      += count;
     samp->sample_length += count;
+    samp->fix_padding   += count;
 }
 
 void Sample_PadEnd(Sample *samp, u32 count)
@@ -71,32 +92,24 @@ void Sample_PadEnd(Sample *samp, u32 count)
     if (count == 0)
         return; // nothing to do
 
+    Sample_Resize(samp, samp->sample_length + count);
+
     if (samp->format & SAMPF_16BIT)
     {
-        u16 *newdata16 = malloc((samp->sample_length + count) * 2);
+        u16 *data16 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata16[x] = ((u16 *)samp->data)[x];
         for (u32 x = 0; x < count; x++)
-            newdata16[samp->sample_length + x] = 32768;
-
-        free(samp->data);
-        samp->data = (void *)newdata16;
+            data16[samp->sample_length + x] = 32768;
     }
     else
     {
-        u8 *newdata8 = malloc(samp->sample_length + count);
+        u8 *data8 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata8[x] = ((u8 *)samp->data)[x];
-        for (u32 x = 0; x < count; x++)
-            newdata8[samp->sample_length + x] = 128;
-
-        free(samp->data);
-        samp->data = (void *)newdata8;
+        memset(&data8[samp->sample_length], 128, count);
     }
     samp->loop_end      += count;
     samp->sample_length += count;
+    samp->fix_padding   += count;
 }
 
 void Unroll_Sample_Loop(Sample *samp, u32 count)
@@ -107,33 +120,28 @@ void Unroll_Sample_Loop(Sample *samp, u32 count)
     u32 looplen = samp->loop_end-samp->loop_start;
     u32 newlen = samp->sample_length + looplen*count;
 
+    // The copies of the loop are added after the end, the data before it
+    // doesn't change.
+    Sample_Resize(samp, newlen);
+
     if (samp->format & SAMPF_16BIT)
     {
-        u16 *newdata16 = malloc(newlen * 2);
+        u16 *data16 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata16[x] = ((u16 *)samp->data)[x];
         for (u32 x = 0; x < looplen * count; x++)
-            newdata16[samp->sample_length + x] = ((u16 *)samp->data)[samp->loop_start + (x % looplen)];
-
-        free(samp->data);
-        samp->data = (void*)newdata16;
+            data16[samp->sample_length + x] = data16[samp->loop_start + (x % looplen)];
     }
     else
     {
-        u8 *newdata8 = malloc(newlen);
+        u8 *data8 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata8[x] = ((u8 *)samp->data)[x];
         for (u32 x = 0; x < looplen * count; x++)
-            newdata8[samp->sample_length + x] = ((u8 *)samp->data)[samp->loop_start + (x % looplen)];
-
-        free(samp->data);
-        samp->data = (void*)newdata8;
+            data8[samp->sample_length + x] = data8[samp->loop_start + (x % looplen)];
     }
 
     samp->loop_end += looplen*count;
     samp->sample_length += looplen*count;
+    samp->fix_unrolled += looplen*count;
 }
 
 void Unroll_BIDI_Sample(Sample* samp)
@@ -144,34 +152,27 @@ void Unroll_BIDI_Sample(Sample* samp)
     u32 looplen = samp->loop_end-samp->loop_start;
     u32 newlen = (samp->sample_length + looplen);
 
+    Sample_Resize(samp, newlen);
+
     if (samp->format & SAMPF_16BIT)
     {
-        u16 *newdata16 = malloc(newlen * 2);
+        u16 *data16 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata16[x] = ((u16 *)samp->data)[x];
         for (u32 x = 0; x < looplen; x++)
-            newdata16[x + samp->sample_length] = ((u16 *)samp->data)[samp->loop_end - 1 - x];
-
-        free(samp->data);
-        samp->data = (void *)newdata16;
+            data16[x + samp->sample_length] = data16[samp->loop_end - 1 - x];
     }
     else
     {
-        u8 *newdata8 = malloc(newlen);
+        u8 *data8 = samp->data;
 
-        for (u32 x = 0; x < samp->sample_length; x++)
-            newdata8[x] = ((u8 *)samp->data)[x];
         for (u32 x = 0; x < looplen; x++)
-            newdata8[x + samp->sample_length] = ((u8 *)samp->data)[samp->loop_end - 1 - x];
-
-        free(samp->data);
-        samp->data = (void *)newdata8;
+            data8[x + samp->sample_length] = data8[samp->loop_end - 1 - x];
     }
 
     samp->loop_type = 1;
     samp->sample_length += looplen;
     samp->loop_end += looplen;
+    samp->fix_unrolled += looplen;
 }
 
 /*
@@ -183,105 +184,379 @@ thanks reduz!
 NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE NOTICE
 */
 
-void Resample(Sample *samp, u32 newsize)
+// Cubic interpolation. The result has to be rounded with Resample_Round().
+static inline double Cubic_Interpolate(double s0, double s1, double s2, double s3, double mu)
 {
-    // output pointers
-    u8 *dst8 = 0;
-    u16 *dst16 = 0;
-    u8 *src8 = (u8 *)samp->data;
-    u16 *src16 = (u16 *)samp->data;
+    double mu2 = mu * mu;
+    double a0 = s3 - s2 - s0 + s1;
+    double a1 = s0 - s1 - a0;
+    double a2 = s2 - s0;
+    double a3 = s1;
 
-    int oldlength = samp->sample_length;
-    int lpoint = samp->loop_start;
+    return (a0 * mu * mu2) + (a1 * mu2) + (a2 * mu) + a3;
+}
+
+// Same as floor(res + 0.5), but without a call to floor()
+static inline int Resample_Round(double res)
+{
+    double r = res + 0.5;
+    int resi = (int)r;
+
+    if ((double)resi > r)
+        resi--;
+
+    return resi;
+}
+
+static inline u16 Resample_Clamp16(int resi)
+{
+    if (resi < -32768)
+        resi = -32768;
+    if (resi > 32767)
+        resi = 32767;
+    return resi + 32768;
+}
+
+static inline u8 Resample_Clamp8(int resi)
+{
+    if (resi < -128)
+        resi = -128;
+    if (resi > 127)
+        resi = 127;
+    return resi + 128;
+}
+
+// Unsigned value of the source sample at "pos", which may be out of the
+// sample. Before the start it's 0, and after the end it's 0 or the value
+// inside the loop if the sample has a loop.
+static double Resample_Source(const Sample *samp, int pos)
+{
+    int length = samp->sample_length;
+
+    if (pos < 0)
+        return 0;
+
+    if (pos >= length)
+    {
+        if (!samp->loop_type)
+            return 0;
+
+        int looplength = length - (int)samp->loop_start;
+        if (looplength <= 0)
+            return 0;
+        pos = samp->loop_start + (pos - length) % looplength;
+    }
+
+    if (samp->format & SAMPF_16BIT)
+        return ((u16 *)samp->data)[pos];
+    else
+        return ((u8 *)samp->data)[pos];
+}
+
+// Resample a point near the start or the end of the sample
+static int Resample_Edge(const Sample *samp, double posf, double sign_diff)
+{
+    int posi = (int)posf;
+    double mu = posf - (double)posi;
+
+    double s0 = Resample_Source(samp, posi - 1) - sign_diff;
+    double s1 = Resample_Source(samp, posi) - sign_diff;
+    double s2 = Resample_Source(samp, posi + 1) - sign_diff;
+    double s3 = Resample_Source(samp, posi + 2) - sign_diff;
+
+    return Resample_Round(Cubic_Interpolate(s0, s1, s2, s3, mu));
+}
+
+// Points in the range [start, end) only use samples inside of the source
+// sample, so they don't need to check the edges.
+
+static void Resample_Inner16(const u16 *src, u16 *dst, size_t start, size_t end,
+                             double tscale)
+{
+    for (size_t i = start; i < end; i++)
+    {
+        double posf = (double)i * tscale;
+        int posi = (int)posf;
+        double mu = posf - (double)posi;
+
+        double s0 = src[posi - 1] - 32768.0;
+        double s1 = src[posi] - 32768.0;
+        double s2 = src[posi + 1] - 32768.0;
+        double s3 = src[posi + 2] - 32768.0;
+
+        dst[i] = Resample_Clamp16(Resample_Round(Cubic_Interpolate(s0, s1, s2, s3, mu)));
+    }
+}
+
+static void Resample_Inner8(const u8 *src, u8 *dst, size_t start, size_t end,
+                            double tscale)
+{
+    for (size_t i = start; i < end; i++)
+    {
+        double posf = (double)i * tscale;
+        int posi = (int)posf;
+        double mu = posf - (double)posi;
 
+        double s0 = src[posi - 1] - 128.0;
+        double s1 = src[posi] - 128.0;
+        double s2 = src[posi + 1] - 128.0;
+        double s3 = src[posi + 2] - 128.0;
+
+        dst[i] = Resample_Clamp8(Resample_Round(Cubic_Interpolate(s0, s1, s2, s3, mu)));
+    }
+}
+
+static void Resample_Cubic(Sample *samp, u8 *dst8, u16 *dst16, u32 newsize)
+{
+    int oldlength = samp->sample_length;
     bool bit16 = samp->format & SAMPF_16BIT;
-    double sign_diff;
+    double sign_diff = bit16 ? 32768.0 : 128.0;
+
+    double tscale = (double)oldlength / (double)newsize;
+
+    // Positions only go up, so the points that need to check the edges of the
+    // sample are at the start and at the end. Positions are never negative,
+    // so the integer part can be obtained without floor().
+    size_t inner_start = 0;
+    while (inner_start < newsize && (int)((double)inner_start * tscale) < 1)
+        inner_start++;
+
+    size_t inner_end = newsize;
+    while (inner_end > inner_start &&
+           (int)((double)(inner_end - 1) * tscale) + 2 >= oldlength)
+        inner_end--;
 
-    // allocate memory
     if (bit16)
     {
-        dst16 = malloc(newsize * 2);
-        sign_diff = 32768.0;
+        for (size_t i = 0; i < inner_start; i++)
+            dst16[i] = Resample_Clamp16(Resample_Edge(samp, (double)i * tscale, sign_diff));
+
+        Resample_Inner16(samp->data, dst16, inner_start, inner_end, tscale);
+
+        for (size_t i = inner_end; i < newsize; i++)
+            dst16[i] = Resample_Clamp16(Resample_Edge(samp, (double)i * tscale, sign_diff));
     }
     else
     {
-        dst8 = malloc(newsize);
-        sign_diff = 128.0;
+        for (size_t i = 0; i < inner_start; i++)
+            dst8[i] = Resample_Clamp8(Resample_Edge(samp, (double)i * tscale, sign_diff));
+
+        Resample_Inner8(samp->data, dst8, inner_start, inner_end, tscale);
+
+        for (size_t i = inner_end; i < newsize; i++)
+            dst8[i] = Resample_Clamp8(Resample_Edge(samp, (double)i * tscale, sign_diff));
     }
+}
 
-    double tscale = (double)oldlength / (double)newsize;
-    double posf;
+// Band-limited resampler
+//
+// Each output point is the sum of the source samples around its position
+// weighted by a windowed sinc (with a Kaiser window). The cutoff frequency is
+// below the Nyquist frequency of the lowest of both sample rates, so that
+// downsampling doesn't cause aliasing.
+//
+// The weights only depend on the position of the output point between two
+// source samples (its phase), so they are precalculated in a table. When there
+// are few different phases (for example, when the sample rate is halved) the
+// table has one entry for each one. If not, it has SINC_PHASES entries and the
+// results of the two closest ones are interpolated.
+
+#define SINC_ZEROS              32      // Zero crossings at each side of the sinc
+#define SINC_ROLLOFF            0.9     // Cutoff relative to the Nyquist frequency
+#define SINC_BETA               7.0     // Kaiser window (about 70 dB of attenuation)
+#define SINC_PHASES             1024
+#define SINC_MAX_EXACT_PHASES   1024
+#define SINC_BLOCK              8192    // Source samples converted at a time
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+static u32 Sinc_GCD(u32 a, u32 b)
+{
+    while (b != 0)
+    {
+        u32 t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
 
-    for (size_t i = 0; i < newsize; i++)
+// Modified Bessel function of the first kind of order 0
+static double Sinc_BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 100; k++)
     {
-        posf = (double)i * tscale;
-        int posi = (int)floor(posf);
+        double f = x / (2.0 * k);
+        term *= f * f;
+        sum += term;
+        if (term < sum * 1e-15)
+            break;
+    }
 
-        double mu = posf - (double)posi;
-        double s0, s1, s2, s3;
-        double mu2, a0, a1, a2, a3, res;
+    return sum;
+}
 
-        // get previous, current, next, and after next samples
-        if (bit16)
+// Weight of a source sample at distance "t" from the output point
+static double Sinc_Weight(double t, double cutoff, int half)
+{
+    double x = t / half;
+    if (x <= -1.0 || x >= 1.0)
+        return 0.0;
+
+    double window = Sinc_BesselI0(SINC_BETA * sqrt(1.0 - x * x)) /
+                    Sinc_BesselI0(SINC_BETA);
+
+    double a = M_PI * cutoff * t;
+    double sinc = (a == 0.0) ? 1.0 : sin(a) / a;
+
+    return cutoff * sinc * window;
+}
+
+static void Resample_Sinc(Sample *samp, void *dst, u32 newsize)
+{
+    u32 oldlength = samp->sample_length;
+    bool bit16 = samp->format & SAMPF_16BIT;
+    double sign_diff = bit16 ? 32768.0 : 128.0;
+
+    double cutoff = SINC_ROLLOFF;
+    if (newsize < oldlength)
+        cutoff *= (double)newsize / (double)oldlength;
+
+    // Source samples used at each side of the output point
+    int half = (int)ceil(SINC_ZEROS / cutoff);
+    int taps = half * 2;
+
+    u32 gcd = Sinc_GCD(oldlength, newsize);
+    bool exact = (newsize / gcd) <= SINC_MAX_EXACT_PHASES;
+    u32 nphases = exact ? newsize / gcd : SINC_PHASES + 1;
+
+    double *table = malloc((size_t)nphases * taps * sizeof(double));
+
+    // Signed source data. It's converted in blocks of SINC_BLOCK samples (plus
+    // the ones that the last output points of the block need after it), so
+    // long samples don't need a copy of all their data. The samples before the
+    // start and after the end are calculated here too, so that the main loop
+    // doesn't need to check them.
+    size_t window_size = (size_t)SINC_BLOCK + taps;
+    double *src = malloc(window_size * sizeof(double));
+    s64 window_start = 0;
+    s64 window_end = 0;
+
+    if (table == NULL || src == NULL)
+    {
+        printf("Not enough memory to resample sample\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (u32 p = 0; p < nphases; p++)
+    {
+        double frac = exact ? (double)p / nphases : (double)p / SINC_PHASES;
+        double *weights = &table[(size_t)p * taps];
+        double sum = 0.0;
+
+        // The weights of each phase add up to 1 so that there is no gain
+        for (int j = 0; j < taps; j++)
         {
-            s0 = (posi - 1) < 0 ? 0 : ((double)(src16[posi - 1]));
-            s1 =                      ((double)(src16[posi    ]));
-            s2 = (posi + 1) >= oldlength ?
-                        (samp->loop_type ?
-                                      ((double)(src16[lpoint + (posi + 1 - oldlength)])) : 0) :
-                                      ((double)(src16[posi + 1]));
-            s3 = (posi + 1) >= oldlength ?
-                        (samp->loop_type ?
-                                      ((double)(src16[lpoint + (posi + 2 - oldlength)])) : 0) :
-                                      ((double)(src16[posi + 2]));
+            weights[j] = Sinc_Weight(j - half + 1 - frac, cutoff, half);
+            sum += weights[j];
         }
-        else
+        for (int j = 0; j < taps; j++)
+            weights[j] /= sum;
+    }
+
+    u32 step = oldlength / newsize;
+    u32 step_rem = oldlength % newsize;
+    u32 pos = 0;
+    u64 rem = 0;
+
+    for (u32 i = 0; i < newsize; i++)
+    {
+        s64 first = (s64)pos - half + 1;
+
+        if (first + taps > window_end)
         {
-            s0 = (posi - 1) < 0 ? 0 : ((double)(src8[posi - 1]));
-            s1 =                      ((double)(src8[posi    ]));
-            s2 = (posi + 1) >= oldlength ?
-                        (samp->loop_type ?
-                                      ((double)(src8[lpoint + (posi + 1 - oldlength)])) : 0) :
-                                      ((double)(src8[posi + 1]));
-            s3 = (posi + 1) >= oldlength ?
-                        (samp->loop_type ?
-                                      ((double)(src8[lpoint + (posi + 2 - oldlength)])) : 0) :
-                                      ((double)(src8[posi + 2]));
+            window_start = first;
+            window_end = first + window_size;
+            for (size_t x = 0; x < window_size; x++)
+                src[x] = Resample_Source(samp, window_start + x) - sign_diff;
         }
 
-        // sign data
-        s0 -= sign_diff;
-        s1 -= sign_diff;
-        s2 -= sign_diff;
-        s3 -= sign_diff;
+        const double *in = &src[first - window_start];
+        double res;
 
-        mu2 = mu * mu;
-        a0 = s3 - s2 - s0 + s1;
-        a1 = s0 - s1 - a0;
-        a2 = s2 - s0;
-        a3 = s1;
-
-        res = (a0 * mu * mu2) + (a1 * mu2) + (a2 * mu) + a3;
-        int resi = ((int)floor(res + 0.5));
+        if (exact)
+        {
+            const double *weights = &table[(size_t)(rem / gcd) * taps];
 
-        if (bit16)
+            res = 0.0;
+            for (int j = 0; j < taps; j++)
+                res += in[j] * weights[j];
+        }
+        else
         {
-            if (resi < -32768)
-                resi = -32768;
-            if (resi > 32767)
-                resi = 32767;
-            dst16[i] = resi + 32768;
+            double t = (double)rem * SINC_PHASES / newsize;
+            u32 p = (u32)t;
+            double mu = t - p;
+            const double *w0 = &table[(size_t)p * taps];
+            const double *w1 = w0 + taps;
+
+            double r0 = 0.0;
+            double r1 = 0.0;
+            for (int j = 0; j < taps; j++)
+            {
+                r0 += in[j] * w0[j];
+                r1 += in[j] * w1[j];
+            }
+
+            res = r0 + (r1 - r0) * mu;
         }
+
+        int resi = Resample_Round(res);
+
+        if (bit16)
+            ((u16 *)dst)[i] = Resample_Clamp16(resi);
         else
+            ((u8 *)dst)[i] = Resample_Clamp8(resi);
+
+        pos += step;
+        rem += step_rem;
+        if (rem >= newsize)
         {
-            if (resi < -128)
-                resi = -128;
-            if (resi > 127)
-                resi = 127;
-            dst8[i] = resi + 128;
+            rem -= newsize;
+            pos++;
         }
     }
 
+    free(src);
+    free(table);
+}
+
+void Resample(Sample *samp, u32 newsize)
+{
+    // output pointers
+    u8 *dst8 = 0;
+    u16 *dst16 = 0;
+
+    int oldlength = samp->sample_length;
+
+    bool bit16 = samp->format & SAMPF_16BIT;
+
+    // allocate memory
+    if (bit16)
+        dst16 = malloc(newsize * 2);
+    else
+        dst8 = malloc(newsize);
+
+    if (fix_resample_sinc)
+        Resample_Sinc(samp, bit16 ? (void *)dst16 : (void *)dst8, newsize);
+    else
+        Resample_Cubic(samp, dst8, dst16, newsize);
+
     free(samp->data);
     if (bit16)
         samp->data = (void *)dst16;
@@ -300,18 +575,67 @@ void Sample_8bit(Sample *samp)
 {
     if (samp->format & SAMPF_16BIT)
     {
-        u8 *newdata = malloc(samp->sample_length);
+        // Converted in place. Each 8-bit value is stored before the 16-bit
+        // values that haven't been converted yet.
+        const u16 *data16 = samp->data;
+        u8 *data8 = samp->data;
 
         for (u32 t = 0; t < samp->sample_length; t++)
-            newdata[t] = ((u16 * )samp->data)[t] / 256;
+            data8[t] = data16[t] / 256;
 
-        free(samp->data);
-        samp->data = newdata;
 //        samp->bit16 = false;
         samp->format &= ~SAMPF_16BIT;
+        Sample_Resize(samp, samp->sample_length);
     }
 }
 
+void Sample_16bit(Sample *samp)
+{
+    if (!(samp->format & SAMPF_16BIT))
+    {
+        samp->format |= SAMPF_16BIT;
+        Sample_Resize(samp, samp->sample_length);
+
+        // Converted in place from the end, so that the 8-bit values that
+        // haven't been converted yet aren't overwritten.
+        const u8 *data8 = samp->data;
+        u16 *data16 = samp->data;
+
+        for (u32 t = samp->sample_length; t > 0; t--)
+            data16[t - 1] = data8[t - 1] << 8;
+    }
+}
+
+// Resample an unsigned sample to a new sample rate. Anything after the end of
+// the loop is removed, and the loop points are scaled to the new length.
+void Sample_SetRate(Sample *samp, u32 rate)
+{
+    if (samp->sample_length == 0 || samp->frequency == 0 || samp->frequency == rate)
+        return;
+
+    if (samp->loop_type)
+    {
+        if (samp->loop_end < samp->sample_length)
+            samp->sample_length = samp->loop_end;
+        else
+            samp->loop_end = samp->sample_length;
+        if (samp->loop_start >= samp->sample_length)
+            samp->loop_type = 0;
+    }
+
+    u32 oldlength = samp->sample_length;
+    u32 loop_end = samp->loop_end;
+
+    u32 newlength = ((u64)oldlength * rate + samp->frequency / 2) / samp->frequency;
+    if (newlength == 0)
+        newlength = 1;
+
+    Resample(samp, newlength);
+
+    samp->loop_end = ((u64)loop_end * newlength + oldlength / 2) / oldlength;
+    samp->frequency = rate;
+}
+
 void Sample_Sign(Sample *samp)
 {
     // sample must be unsigned
@@ -551,14 +875,217 @@ void FixSample_NDS(Sample *samp)
     }
 }
 
+void *Sample_CopyData(const Sample *samp)
+{
+    size_t size = samp->sample_length * ((samp->format & SAMPF_16BIT) ? 2 : 1);
+    void *data = malloc(size > 0 ? size : 1);
+
+    if (data == NULL)
+    {
+        printf("Not enough memory to copy sample\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (size > 0)
+        memcpy(data, samp->data, size);
+
+    return data;
+}
+
+// Reads the PCM data of a sample from an input file and stores it as unsigned
+// values, which is how FixSample() expects it. "format" can have SAMPF_16BIT
+// and SAMPF_SIGNED set, and "delta" is used for delta-coded data (XM). The
+// data is read in one go and converted in place with simple loops that the
+// compiler can vectorize.
+void Sample_ReadData(Sample *samp, FileReader *fr, u8 format, bool delta)
+{
+    u32 length = samp->sample_length;
+    size_t size = (size_t)length * ((format & SAMPF_16BIT) ? 2 : 1);
+
+    if (fix_lazy_load)
+    {
+        samp->datapointer = file_tell_read(fr);
+        samp->data = NULL;
+        skip8(size, fr);
+        return;
+    }
+
+    samp->data = malloc(size > 0 ? size : 1);
+    if (samp->data == NULL)
+    {
+        printf("Not enough memory to load sample\n");
+        exit(EXIT_FAILURE);
+    }
+
+    read_bytes(samp->data, size, fr);
+
+    if (format & SAMPF_16BIT)
+    {
+        // Samples are stored in little endian order in the files
+        const u8 *src = samp->data;
+        u16 *dst = samp->data;
+        u16 sign = (format & SAMPF_SIGNED) ? 0x8000 : 0;
+
+        if (delta)
+        {
+            u16 value = 0;
+            for (u32 x = 0; x < length; x++)
+            {
+                value += src[x * 2] | (src[x * 2 + 1] << 8);
+                dst[x] = value ^ sign;
+            }
+        }
+        else
+        {
+            for (u32 x = 0; x < length; x++)
+                dst[x] = (src[x * 2] | (src[x * 2 + 1] << 8)) ^ sign;
+        }
+    }
+    else
+    {
+        u8 *dst = samp->data;
+        u8 sign = (format & SAMPF_SIGNED) ? 0x80 : 0;
+
+        if (delta)
+        {
+            u8 value = 0;
+            for (u32 x = 0; x < length; x++)
+            {
+                value += dst[x];
+                dst[x] = value ^ sign;
+            }
+        }
+        else if (sign)
+        {
+            for (u32 x = 0; x < length; x++)
+                dst[x] ^= sign;
+        }
+    }
+}
+
+void Sample_FreeSource(Sample *samp)
+{
+    if (samp->source == NULL)
+        return;
+
+    free(samp->source->data);
+    free(samp->source);
+    samp->source = NULL;
+}
+
+// Convert a sample to "format" (SAMPF_16BIT, 0 for 8 bit, or SAMPF_COMP) and
+// to "rate", convert it back to the original format and rate, and return the
+// signal to noise ratio (in dB) of the result. The sample must be unsigned, as
+// it is before FixSample() is called.
+double Sample_SNR(const Sample *samp, u8 format, u32 rate)
+{
+    // Data after the end of the loop is never played
+    u32 length = samp->sample_length;
+    if (samp->loop_type && samp->loop_end < length)
+        length = samp->loop_end;
+    if (length == 0)
+        return SNR_MAX;
+
+    Sample conv = *samp;
+    conv.data = Sample_CopyData(samp);
+    conv.sample_length = length;
+
+    if (rate != samp->frequency)
+    {
+        Sample_SetRate(&conv, rate);
+        Resample(&conv, length);
+    }
+
+    s16 *decoded = malloc((length + 1) * sizeof(s16));
+    if (decoded == NULL)
+    {
+        printf("Not enough memory to compare samples\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (format & SAMPF_COMP)
+    {
+        // The encoder needs an even number of signed samples
+        Sample_16bit(&conv);
+        if (conv.sample_length & 1)
+            Sample_PadEnd(&conv, 1);
+        Sample_Sign(&conv);
+        adpcm_compress_sample(&conv);
+        adpcm_decode_sample(conv.data, length, decoded);
+    }
+    else
+    {
+        if (!(format & SAMPF_16BIT))
+            Sample_8bit(&conv);
+
+        for (u32 x = 0; x < length; x++)
+        {
+            if (conv.format & SAMPF_16BIT)
+                decoded[x] = ((u16 *)conv.data)[x] - 32768;
+            else
+                decoded[x] = (((u8 *)conv.data)[x] - 128) * 256;
+        }
+    }
+
+    double signal = 0;
+    double noise = 0;
+
+    for (u32 x = 0; x < length; x++)
+    {
+        double s;
+        if (samp->format & SAMPF_16BIT)
+            s = ((u16 *)samp->data)[x] - 32768.0;
+        else
+            s = (((u8 *)samp->data)[x] - 128.0) * 256.0;
+
+        double e = s - decoded[x];
+        signal += s * s;
+        noise += e * e;
+    }
+
+    free(decoded);
+    free(conv.data);
+
+    if (noise == 0 || signal == 0)
+        return SNR_MAX;
+
+    double snr = 10.0 * log10(signal / noise);
+    return snr < SNR_MAX ? snr : SNR_MAX;
+}
+
 void FixSample(Sample *samp)
 {
+    samp->fix_padding = 0;
+    samp->fix_unrolled = 0;
+
+    // There is no data to convert
+    if (fix_lazy_load)
+        return;
+
+    if (fix_keep_source)
+    {
+        Sample *source = malloc(sizeof(Sample));
+        if (source == NULL)
+        {
+            printf("Not enough memory to copy sample\n");
+            exit(EXIT_FAILURE);
+        }
+
+        *source = *samp;
+        source->data = Sample_CopyData(samp);
+        source->source = NULL;
+        samp->source = source;
+    }
+
     // Clamp loop_start and loop_end (f.e. FR_TOWER.MOD)
     if (samp->loop_start > samp->sample_length)
         samp->loop_start = samp->sample_length;
     if (samp->loop_end > samp->sample_length)
         samp->loop_end = samp->sample_length;
 
+    if (fix_max_rate != 0 && samp->frequency > fix_max_rate)
+        Sample_SetRate(samp, fix_max_rate);
+
     if (target_system == SYSTEM_GBA)
         FixSample_GBA(samp);
     else if (target_system == SYSTEM_NDS)
@@ -13,6 +13,32 @@
 #ifndef SAMPLEFIX_H__
 #define SAMPLEFIX_H__
 
+// If set, the flags in the names of samples (like "%c") are ignored
+extern bool ignore_sflags;
+
+// If set, FixSample() keeps a copy of the original sample in samp->source
+extern bool fix_keep_source;
+
+// If set, samples are resampled with a band-limited (windowed sinc) filter
+// instead of with cubic interpolation.
+extern bool fix_resample_sinc;
+
+// If it isn't 0, FixSample() resamples samples with a higher sample rate to it
+extern u32 fix_max_rate;
+
+// If set, loaders only read the headers and patterns of the files. The sample
+// data isn't loaded or converted: samp->data is left as NULL and
+// samp->datapointer is set to the offset of the data in the file.
+extern bool fix_lazy_load;
+
 void FixSample(Sample *samp);
+void *Sample_CopyData(const Sample *samp);
+void Sample_FreeSource(Sample *samp);
+void Sample_ReadData(Sample *samp, FileReader *fr, u8 format, bool delta);
+double Sample_SNR(const Sample *samp, u8 format, u32 rate);
+
+void Sample_8bit(Sample *samp);
+void Sample_16bit(Sample *samp);
+void Sample_SetRate(Sample *samp, u32 rate);
 
 #endif // SAMPLEFIX_H__
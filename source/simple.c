@@ -21,21 +21,38 @@
 #include "files.h"
 #include "samplefix.h"
 
-// Credits to Coda, look at this awesome codes
-u32 readbits(u8 *buffer, unsigned int pos, unsigned int size)
+// 64-bit hash of a block of data. It works on 8 bytes at a time so that it's
+// fast with big samples. The result of a previous call can be used as seed to
+// hash data that is split in several blocks.
+u64 hash_data(const void *data, size_t size, u64 seed)
 {
-    u32 result = 0;
+    const u8 *p = data;
+    u64 h = seed ^ (size * 0x9E3779B97F4A7C15ULL);
 
-    for (u32 i = 0; i < size; i++)
+    while (size >= 8)
     {
-        u32 byte_pos;
-        u32 bit_pos;
-        byte_pos = (pos + i) >> 3;
-        bit_pos = (pos + i) & 7;
-        result |= ((buffer[byte_pos] >> bit_pos) & 1) << i;
+        u64 v = (u64)p[0] | ((u64)p[1] << 8) | ((u64)p[2] << 16) |
+                ((u64)p[3] << 24) | ((u64)p[4] << 32) | ((u64)p[5] << 40) |
+                ((u64)p[6] << 48) | ((u64)p[7] << 56);
+        v *= 0xBF58476D1CE4E5B9ULL;
+        v ^= v >> 31;
+        h = (h ^ v) * 0x94D049BB133111EBULL;
+        h = (h << 27) | (h >> 37);
+        p += 8;
+        size -= 8;
     }
 
-    return result;
+    while (size > 0)
+    {
+        h = (h ^ *p) * 0x100000001B3ULL;
+        p++;
+        size--;
+    }
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
 }
 
 int get_ext(char *filename)
@@ -69,6 +86,7 @@ int get_ext(char *filename)
         case 'wav':
             return INPUT_TYPE_WAV;
         case 'msl':
+        case 'bin':
             return INPUT_TYPE_MSL;
         case 'xm':
             return INPUT_TYPE_XM;
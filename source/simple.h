@@ -29,7 +29,7 @@ u32 calc_samplen(Sample *s);
 u32 calc_samplen_ex2(Sample *s);
 int clamp_s8(int value);
 int clamp_u8(int value);
-u32 readbits(u8* buffer, unsigned int pos, unsigned int size);
+u64 hash_data(const void *data, size_t size, u64 seed);
 
 u8 sample_dsformat(Sample *samp);
 u8 sample_dsreptype(Sample *samp);
@@ -12,6 +12,7 @@
 
 // WAV file loader
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -22,7 +23,126 @@
 #include "simple.h"
 #include "samplefix.h"
 
-int Load_WAV(Sample *samp, bool verbose, bool fix)
+// Values of the format tag of the format chunk. Extensible files have the real
+// format in the first two bytes of the subformat GUID.
+#define WAV_FORMAT_PCM          0x0001
+#define WAV_FORMAT_FLOAT        0x0003
+#define WAV_FORMAT_EXTENSIBLE   0xFFFE
+
+static inline s32 WAV_Get16(const u8 *p)
+{
+    return (s16)(p[0] | (p[1] << 8));
+}
+
+static inline s32 WAV_Get24(const u8 *p)
+{
+    return (s32)(((u32)p[0] << 8) | ((u32)p[1] << 16) | ((u32)p[2] << 24)) >> 8;
+}
+
+static inline s32 WAV_Get32(const u8 *p)
+{
+    return (s32)((u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24));
+}
+
+static inline double WAV_GetFloat(const u8 *p)
+{
+    u32 bits = WAV_Get32(p);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static inline double WAV_GetDouble(const u8 *p)
+{
+    u64 bits = (u32)WAV_Get32(p) | ((u64)(u32)WAV_Get32(p + 4) << 32);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Rounds a value with "shift" extra bits of precision to 16 bits
+static inline u16 WAV_Round16(s64 value, int shift)
+{
+    value = (value + (1 << (shift - 1))) >> shift;
+    if (value > 32767)
+        value = 32767;
+    return value + 32768;
+}
+
+static inline u16 WAV_Float16(double value)
+{
+    value = floor(value * 32768.0 + 0.5);
+    if (value > 32767.0)
+        value = 32767.0;
+    else if (!(value >= -32768.0)) // Also catches NaN
+        value = -32768.0;
+    return (s32)value + 32768;
+}
+
+// Converts the frames of the data chunk to unsigned mono values of 8 bits (for
+// 8-bit files) or 16 bits (for everything else). The channels of each frame are
+// averaged. The data is converted straight from the input file, without reading
+// it value by value.
+static void WAV_ConvertData(void *dst, const u8 *src, u32 length, u32 channels,
+                            u16 format, u32 bits)
+{
+    u8 *dst8 = dst;
+    u16 *dst16 = dst;
+    u32 frame = (bits / 8) * channels;
+
+    if (format == WAV_FORMAT_FLOAT)
+    {
+        for (u32 t = 0; t < length; t++, src += frame)
+        {
+            double value = 0;
+            for (u32 c = 0; c < channels; c++)
+                value += (bits == 32) ? WAV_GetFloat(src + c * 4) : WAV_GetDouble(src + c * 8);
+            dst16[t] = WAV_Float16(value / channels);
+        }
+    }
+    else if (bits == 8)
+    {
+        for (u32 t = 0; t < length; t++, src += frame)
+        {
+            int value = 0;
+            for (u32 c = 0; c < channels; c++)
+                value += src[c] - 128;
+            dst8[t] = value / (int)channels + 128;
+        }
+    }
+    else if (bits == 16)
+    {
+        for (u32 t = 0; t < length; t++, src += frame)
+        {
+            int value = 0;
+            for (u32 c = 0; c < channels; c++)
+                value += WAV_Get16(src + c * 2);
+            dst16[t] = value / (int)channels + 32768;
+        }
+    }
+    else if (bits == 24)
+    {
+        for (u32 t = 0; t < length; t++, src += frame)
+        {
+            s64 value = 0;
+            for (u32 c = 0; c < channels; c++)
+                value += WAV_Get24(src + c * 3);
+            dst16[t] = WAV_Round16(value / channels, 8);
+        }
+    }
+    else // bits == 32
+    {
+        for (u32 t = 0; t < length; t++, src += frame)
+        {
+            s64 value = 0;
+            for (u32 c = 0; c < channels; c++)
+                value += WAV_Get32(src + c * 4);
+            dst16[t] = WAV_Round16(value / channels, 16);
+        }
+    }
+}
+
+int Load_WAV(Sample *samp, FileReader *fr, bool verbose, bool fix)
 {
     if (verbose)
         printf("Loading WAV file...\n");
@@ -30,74 +150,98 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
     // initialize data
     memset(samp, 0, sizeof(Sample));
 
-    int file_size = file_tell_size();
+    int file_size = file_tell_size(fr);
 
-    read32(); // "RIFF"
-    read32(); // filesize-8
-    read32(); // "WAVE"
+    read32(fr); // "RIFF"
+    read32(fr); // filesize-8
+    read32(fr); // "WAVE"
 
     unsigned int bit_depth = 8;
     unsigned int hasformat = 0;
     unsigned int hasdata = 0;
     unsigned int num_channels = 0;
     unsigned int smpl_chunk_pos = 0;
+    u16 format = WAV_FORMAT_PCM;
 
     while (1)
     {
-        // break on end of file
-        if (file_tell_read() >= file_size)
+        // break on end of file (chunks with a wrong size can skip past it)
+        if (fr->pos >= fr->size)
             break;
 
         // read chunk code and length
-        unsigned int chunk_code = read32();
-        unsigned int chunk_size = read32();
+        unsigned int chunk_code = read32(fr);
+        unsigned int chunk_size = read32(fr);
 
         // parse chunk code
         switch (chunk_code)
         {
             case ' tmf': // format chunk
             {
-                // check compression code (1 = PCM)
-                if (read16() != 1)
-                {
-                    if (verbose)
-                        printf("Unsupported WAV format.\n");
+                unsigned int chunk_read = 0x10;
 
-                    return LOADWAV_UNKNOWN_COMP;
-                }
+                format = read16(fr);
 
                 // read # of channels
-                num_channels = read16();
+                num_channels = read16(fr);
 
                 // read sampling frequency
-                samp->frequency = read32();
+                samp->frequency = read32(fr);
 
                 // skip average something, wBlockAlign
-                read32();
-                read16();
+                read32(fr);
+                read16(fr);
+
+                // bits of each value in the file (in extensible files this is
+                // the size of the container, the real bits are at the top)
+                bit_depth = read16(fr);
 
-                // get bit depth, catch unsupported values
-                bit_depth = read16();
-                if (bit_depth != 8 && bit_depth != 16)
+                if (format == WAV_FORMAT_EXTENSIBLE && chunk_size >= 0x28)
+                {
+                    read16(fr); // size of the extension
+                    read16(fr); // valid bits per sample
+                    read32(fr); // channel mask
+                    format = read16(fr);
+                    skip8(14, fr); // rest of the subformat GUID
+                    chunk_read = 0x28;
+                }
+
+                if (format != WAV_FORMAT_PCM && format != WAV_FORMAT_FLOAT)
+                {
+                    if (verbose)
+                        printf("Unsupported WAV format.\n");
+
+                    return LOADWAV_UNKNOWN_COMP;
+                }
+
+                if (num_channels == 0)
+                    return LOADWAV_CORRUPT;
+
+                // catch unsupported bit depths
+                if ((format == WAV_FORMAT_PCM && bit_depth != 8 && bit_depth != 16 &&
+                     bit_depth != 24 && bit_depth != 32) ||
+                    (format == WAV_FORMAT_FLOAT && bit_depth != 32 && bit_depth != 64))
                 {
                     if (verbose)
                         printf("Unsupported bit-depth.\n");
                     return LOADWAV_UNSUPPORTED_BD;
                 }
 
-                if (bit_depth == 16)
+                // Everything that isn't 8-bit is converted to 16-bit
+                if (bit_depth != 8)
                     samp->format |= SAMPF_16BIT;
 
                 // print verbose data
                 if (verbose)
                 {
                     printf("Sample Rate...%i\n", samp->frequency);
-                    printf("Bit Depth.....%i-bit\n", bit_depth);
+                    printf("Bit Depth.....%i-bit%s\n", bit_depth,
+                           format == WAV_FORMAT_FLOAT ? " (float)" : "");
                 }
 
                 // skip the rest of the chunk (if any)
-                if ((chunk_size - 0x10) > 0)
-                    skip8((chunk_size - 0x10));
+                if (chunk_size > chunk_read)
+                    skip8(chunk_size - chunk_read, fr);
 
                 hasformat = 1;
                 break;
@@ -105,9 +249,6 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
 
             case 'atad': // data chunk
             {
-                size_t t, c;
-                int dat;
-
                 if (!hasformat)
                 {
                     return LOADWAV_CORRUPT;
@@ -118,35 +259,33 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
 
                 // clip chunk size against end of file (for some borked wavs...)
                 {
-                    size_t br = file_size - file_tell_read();
+                    size_t br = file_size - file_tell_read(fr);
                     chunk_size = chunk_size > br ? br : chunk_size;
                 }
 
                 samp->sample_length = chunk_size / (bit_depth / 8) / num_channels;
-                samp->data = malloc(chunk_size);
 
-                // read sample data
-                for (t = 0; t < samp->sample_length; t++)
+                if (fix_lazy_load)
                 {
-                    dat = 0;
-
-                    // for multi-channel samples, get average value
-                    for (c = 0; c < num_channels; c++)
-                    {
-                        dat += bit_depth == 8 ? ((int)read8()) - 128 : ((short)read16());
-                    }
-                    dat /= num_channels;
-
-                    if (bit_depth == 8)
-                    {
-                        ((u8*)samp->data)[t] = dat + 128;
-                    }
-                    else
-                    {
-                        ((u16*)samp->data)[t] = dat + 32768;
-                    }
+                    samp->datapointer = file_tell_read(fr);
+                    skip8(chunk_size, fr);
+                    hasdata = 1;
+                    break;
                 }
 
+                // Only the mono data is allocated
+                size_t size = (size_t)samp->sample_length * (bit_depth == 8 ? 1 : 2);
+                samp->data = malloc(size > 0 ? size : 1);
+                if (samp->data == NULL)
+                {
+                    printf("Not enough memory to load sample\n");
+                    exit(EXIT_FAILURE);
+                }
+
+                WAV_ConvertData(samp->data, fr->data + fr->pos, samp->sample_length,
+                                num_channels, format, bit_depth);
+                skip8(chunk_size, fr);
+
                 hasdata = 1;
 
                 break;
@@ -154,14 +293,14 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
 
             case 'lpms': // sampler chunk
             {
-                smpl_chunk_pos = file_tell_read();
-                skip8(chunk_size);
+                smpl_chunk_pos = file_tell_read(fr);
+                skip8(chunk_size, fr);
                 break;
             }
 
             default:
             {
-                skip8(chunk_size);
+                skip8(chunk_size, fr);
             }
         }
     }
@@ -169,7 +308,7 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
     // sampler chunk is processed last because it depends on the sample length being known.
     if (smpl_chunk_pos)
     {
-        file_seek_read(smpl_chunk_pos, SEEK_SET);
+        file_seek_read(smpl_chunk_pos, SEEK_SET, fr);
 
         skip8(4   // manufacturer
               + 4 // product
@@ -178,17 +317,17 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
               + 4 // midi pitch fraction
               + 4 // smpte format
               + 4 // smpte offset
-        );
+        , fr);
 
-        int num_sample_loops = read32();
+        int num_sample_loops = read32(fr);
 
-        read32(); // sample data
+        read32(fr); // sample data
 
         // check for sample looping data
         if (num_sample_loops)
         {
-            read32(); // cue point ID
-            int loop_type = read32();
+            read32(fr); // cue point ID
+            int loop_type = read32(fr);
 
             if (loop_type < 2)
             {
@@ -196,8 +335,8 @@ int Load_WAV(Sample *samp, bool verbose, bool fix)
                 // 0=forward | 1
                 // 1=bidi    | 2
                 samp->loop_type = loop_type + 1;
-                samp->loop_start = read32();
-                samp->loop_end = read32();
+                samp->loop_start = read32(fr);
+                samp->loop_end = read32(fr);
 
                 // clip loop start against sample length
                 if (samp->loop_end > samp->sample_length)
@@ -20,6 +20,6 @@
 #define LOADWAV_UNSUPPORTED_BD  0x13
 #define LOADWAV_BADDATA         0x14
 
-int Load_WAV(Sample *samp, bool verbose, bool fix);
+int Load_WAV(Sample *samp, FileReader *fr, bool verbose, bool fix);
 
 #endif // WAV_H__
@@ -63,36 +63,36 @@ int Get_XM_Frequency(s8 relnote, s8 finetune)
     return (int)freq;
 }
 
-int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool verbose)
+int Load_XM_Instrument(Instrument *inst, FileReader *fr, MAS_Module *mas, u8 *p_nextsample, bool verbose)
 {
     int ns = *p_nextsample;
 
     memset(inst, 0, sizeof(Instrument));
 
-    int inst_headstart = file_tell_read();
-    int inst_size = read32();
+    int inst_headstart = file_tell_read(fr);
+    int inst_size = read32(fr);
 
     for (int x = 0; x < 22; x++)
-        inst->name[x] = read8(); // instrument name
+        inst->name[x] = read8(fr); // instrument name
 
     //if (verbose)
     //    printf("  Name=\"%s\"\n", inst->name);
-    //if (read8() != 0)
+    //if (read8(fr) != 0)
     //    return ERR_UNKNOWNINST;
 
-    read8(); // instrument type, SUPPOSED TO ALWAYS BE 0...
+    read8(fr); // instrument type, SUPPOSED TO ALWAYS BE 0...
 
-    int nsamples = read16();
+    int nsamples = read16(fr);
 
     if (nsamples > 0)
     {
         inst->is_valid = true;
 
-        int samp_headsize = read32();
+        int samp_headsize = read32(fr);
 
         // read sample map
         for (int x = 0; x < 96; x++)
-            inst->notemap[x + 12] = ((read8() + ns + 1) * 256) | (x + 12);
+            inst->notemap[x + 12] = ((read8(fr) + ns + 1) * 256) | (x + 12);
 
         for (int x = 0; x < 12; x++)
             inst->notemap[x] =(inst->notemap[12] & 0xFF00) | x;
@@ -102,28 +102,28 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
 
         for (int x = 0; x < 12; x++)
         {
-            inst->envelope_volume.node_x[x] = read16();
-            inst->envelope_volume.node_y[x] = (u8)read16();
+            inst->envelope_volume.node_x[x] = read16(fr);
+            inst->envelope_volume.node_y[x] = (u8)read16(fr);
         }
 
         for (int x = 0; x < 12; x++)
         {
-            inst->envelope_pan.node_x[x] = read16();
-            inst->envelope_pan.node_y[x] = (u8)read16();
+            inst->envelope_pan.node_x[x] = read16(fr);
+            inst->envelope_pan.node_y[x] = (u8)read16(fr);
         }
 
         inst->global_volume = 128;
-        inst->envelope_volume.node_count = read8();
-        inst->envelope_pan.node_count = read8();
-        inst->envelope_volume.sus_start = inst->envelope_volume.sus_end = read8();
-        inst->envelope_volume.loop_start = read8();
-        inst->envelope_volume.loop_end = read8();
-        inst->envelope_pan.sus_start = inst->envelope_pan.sus_end = read8();
-        inst->envelope_pan.loop_start = read8();
-        inst->envelope_pan.loop_end = read8();
-
-        u8 volbits = read8();
-        u8 panbits = read8();
+        inst->envelope_volume.node_count = read8(fr);
+        inst->envelope_pan.node_count = read8(fr);
+        inst->envelope_volume.sus_start = inst->envelope_volume.sus_end = read8(fr);
+        inst->envelope_volume.loop_start = read8(fr);
+        inst->envelope_volume.loop_end = read8(fr);
+        inst->envelope_pan.sus_start = inst->envelope_pan.sus_end = read8(fr);
+        inst->envelope_pan.loop_start = read8(fr);
+        inst->envelope_pan.loop_end = read8(fr);
+
+        u8 volbits = read8(fr);
+        u8 panbits = read8(fr);
         inst->env_flags = 0;
         if (volbits & 1)
             inst->env_flags |= MAS_INSTR_FLAG_VOL_ENV_EXISTS | MAS_INSTR_FLAG_VOL_ENV_ENABLED;
@@ -140,12 +140,12 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
         if (!(panbits & 4))
             inst->envelope_pan.loop_start=inst->envelope_pan.loop_end = 255;
 
-        u8 vibtype = read8();
-        u8 vibsweep = 32768 / (read8() + 1);
-        u8 vibdepth = read8();
-        u8 vibrate = read8();
-        inst->fadeout = read16()/32;            // apply scalar!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
-        file_seek_read(inst_headstart+inst_size, SEEK_SET);
+        u8 vibtype = read8(fr);
+        u8 vibsweep = 32768 / (read8(fr) + 1);
+        u8 vibdepth = read8(fr);
+        u8 vibrate = read8(fr);
+        inst->fadeout = read16(fr)/32;            // apply scalar!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
+        file_seek_read(inst_headstart+inst_size, SEEK_SET, fr);
 
 /*        if (verbose)
         {
@@ -164,7 +164,7 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
         {
             if (ns+x >= 256)
                 return ERR_TOOMANYSAMPLES;
-            int samp_headstart = file_tell_read();
+            int samp_headstart = file_tell_read(fr);
 
             Sample *samp = &mas->samples[ns + x];
 
@@ -172,10 +172,10 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
 //                printf("  Loading sample %i...\n", x+1);
             memset(samp, 0, sizeof(Sample));
             samp->msl_index = 0xFFFF;
-            samp->sample_length = read32();
-            samp->loop_start = read32();
-            samp->loop_end = read32()+samp->loop_start;
-            samp->default_volume = read8();
+            samp->sample_length = read32(fr);
+            samp->loop_start = read32(fr);
+            samp->loop_end = read32(fr)+samp->loop_start;
+            samp->default_volume = read8(fr);
             samp->global_volume = 64;
 
             samp->vibtype = vibtype;
@@ -183,15 +183,15 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
             samp->vibspeed = vibrate;
             samp->vibrate = vibsweep;
 
-            s8 finetune = (s8)read8();
-            u8 loopbits = read8();
-            samp->default_panning = (read8()>>1) | 128;
-            s8 relnote = (s8)read8();
-            read8(); // reserved
+            s8 finetune = (s8)read8(fr);
+            u8 loopbits = read8(fr);
+            samp->default_panning = (read8(fr)>>1) | 128;
+            s8 relnote = (s8)read8(fr);
+            read8(fr); // reserved
 
             for (int y =0; y < 22; y++)
             {
-                samp->name[y] = read8();
+                samp->name[y] = read8(fr);
                 if (y < 12)
                     samp->filename[y] = samp->name[y];
             }
@@ -207,7 +207,7 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
                 samp->loop_end /= 2;
             }
             samp->loop_type = loopbits & 3;
-            file_seek_read(samp_headstart + samp_headsize, SEEK_SET);
+            file_seek_read(samp_headstart + samp_headsize, SEEK_SET, fr);
 
             /*
             if (verbose)
@@ -235,25 +235,8 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
             if (samp->sample_length == 0)
                 continue;
 
-            int sample_old = 0;
-            if (samp->format & SAMPF_16BIT)
-            {
-                samp->data = (u16 *)malloc(samp->sample_length * 2);
-                for (u32 t = 0; t < samp->sample_length; t++)
-                {
-                    sample_old = (s16)((s16)read16() + sample_old);
-                    ((u16 *)samp->data)[t] = sample_old + 32768;
-                }
-            }
-            else
-            {
-                samp->data = (u8 *)malloc(samp->sample_length);
-                for (u32 t = 0; t < samp->sample_length; t++)
-                {
-                    sample_old = (s8)((s8)read8() + sample_old);
-                    ((u8 *)samp->data)[t] = sample_old + 128;
-                }
-            }
+            // Samples are stored as signed deltas
+            Sample_ReadData(samp, fr, (samp->format & SAMPF_16BIT) | SAMPF_SIGNED, true);
             FixSample(samp);
         }
 
@@ -269,7 +252,7 @@ int Load_XM_Instrument(Instrument *inst, MAS_Module *mas, u8 *p_nextsample, bool
     {
         inst->is_valid = false;
 
-        file_seek_read(inst_headstart + inst_size, SEEK_SET);
+        file_seek_read(inst_headstart + inst_size, SEEK_SET, fr);
         if (verbose)
             printf(vstr_xm_nosamp, inst->name);
     }
@@ -516,30 +499,29 @@ void CONV_XM_EFFECT(u8 *fx, u8 *param)
     *param = wpm;
 }
 
-int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
+int Load_XM_Pattern(Pattern *patt, FileReader *fr, u32 nchannels, bool verbose)
 {
-    u32 headstart = file_tell_read();
-    u32 headsize = read32();
+    u32 headstart = file_tell_read(fr);
+    u32 headsize = read32(fr);
 
-    if (read8() != 0)
+    if (read8(fr) != 0)
         return ERR_UNKNOWNPATTERN;
 
     memset(patt, 0, sizeof(Pattern));
 
-    patt->nrows = read16();
+    u16 nrows = read16(fr);
 
-    u16 clength = read16();
+    u16 clength = read16(fr);
 
     if (verbose)
-        printf("- %i rows, %.2f KB\n", patt->nrows, (float)(clength) / 1000);
+        printf("- %i rows, %.2f KB\n", nrows, (float)(clength) / 1000);
 
-    for (u32 row = 0; row < patt->nrows * MAX_CHANNELS; row++)
-    {
-        patt->data[row].note = 250;
-        patt->data[row].vol = 0;
-    }
+    static const PatternEntry empty = { .note = 250, .vol = 0 };
+
+    // Empty patterns don't need to store any channel
+    Pattern_Alloc(patt, nrows, clength ? nchannels : 0, &empty);
 
-    file_seek_read(headstart + headsize, SEEK_SET);
+    file_seek_read(headstart + headsize, SEEK_SET, fr);
 
     if (clength == 0)
     {
@@ -552,14 +534,14 @@ int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
     {
         for (u32 col = 0; col < nchannels; col++)
         {
-            u32 e = row * MAX_CHANNELS + col;
-            u8 b = read8();
+            u32 e = row * nchannels + col;
+            u8 b = read8(fr);
 
             if (b & 128) // packed
             {
                 if (b & 1) // bit 0 set: Note follows
                 {
-                    patt->data[e].note = read8(); // (byte) Note (1-96, 1 = C-0)
+                    patt->data[e].note = read8(fr); // (byte) Note (1-96, 1 = C-0)
                     if (patt->data[e].note == 97)
                         patt->data[e].note = 255;
                     else
@@ -568,19 +550,19 @@ int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
 
                 if (b & 2) // 1 set: Instrument follows
                 {
-                    patt->data[e].inst = read8(); // (byte) Instrument (1-128)
+                    patt->data[e].inst = read8(fr); // (byte) Instrument (1-128)
                 }
 
                 if (b & 4) // 2 set: Volume column byte follows
                 {
-                    patt->data[e].vol = read8(); // (byte) Volume column byte
+                    patt->data[e].vol = read8(fr); // (byte) Volume column byte
                 }
 
                 u8 fx;
 
                 if (b & 8) // 3 set: Effect type follows
                 {
-                    fx = read8(); // (byte) Effect type
+                    fx = read8(fr); // (byte) Effect type
                 }
                 else
                 {
@@ -591,7 +573,7 @@ int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
 
                 if (b & 16) // 4 set: Guess what!
                 {
-                    param = read8(); // (byte) Effect parameter
+                    param = read8(fr); // (byte) Effect parameter
                 }
                 else
                 {
@@ -614,11 +596,11 @@ int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
                 else
                     patt->data[e].note += 12 - 1;
 
-                patt->data[e].inst = read8(); // (byte) Instrument (1-128)
-                patt->data[e].vol = read8();  // (byte) Volume column byte (see below)
+                patt->data[e].inst = read8(fr); // (byte) Instrument (1-128)
+                patt->data[e].vol = read8(fr);  // (byte) Volume column byte (see below)
 
-                u8 fx = read8();              // (byte) Effect type
-                u8 param = read8();           // (byte) Effect parameter
+                u8 fx = read8(fr);              // (byte) Effect type
+                u8 param = read8(fr);           // (byte) Effect parameter
 
                 CONV_XM_EFFECT(&fx, &param);  // convert effect
                 patt->data[e].fx = fx;
@@ -627,10 +609,12 @@ int Load_XM_Pattern(Pattern *patt, u32 nchannels, bool verbose)
         }
     }
 
+    Pattern_Trim(patt, &empty);
+
     return ERR_NONE;
 }
 
-int Load_XM(MAS_Module *mod, bool verbose)
+int Load_XM(MAS_Module *mod, FileReader *fr, bool verbose)
 {
     memset(mod, 0, sizeof(MAS_Module));
 
@@ -639,14 +623,14 @@ int Load_XM(MAS_Module *mod, bool verbose)
     mod->global_volume = 64;
     mod->old_mode = false;
 
-    if (read32() != 'etxE' || read32() != 'dedn' || read32() != 'doM ' ||
-        read32() != ':elu' || read8() != ' ')
+    if (read32(fr) != 'etxE' || read32(fr) != 'dedn' || read32(fr) != 'doM ' ||
+        read32(fr) != ':elu' || read8(fr) != ' ')
     {
         return ERR_INVALID_MODULE;
     }
 
     for (int x = 0; x < 20; x++)
-        mod->title[x] = read8();
+        mod->title[x] = read8(fr);
 
     if (verbose)
     {
@@ -654,15 +638,15 @@ int Load_XM(MAS_Module *mod, bool verbose)
         printf("Loading XM, \"%s\"\n", mod->title);
     }
 
-    if (read8() != 0x1a)
+    if (read8(fr) != 0x1a)
         return ERR_INVALID_MODULE;
 
-    skip8(20); // tracker name
+    skip8(20, fr); // tracker name
 
-    u16 xm_version = read16();
-    u32 xm_headsize = read32();
+    u16 xm_version = read16(fr);
+    u32 xm_headsize = read32(fr);
 
-    u16 order_count = read16();
+    u16 order_count = read16(fr);
     if (order_count > 255)
     {
         printf("Order count higher than 255: %u\n", order_count);
@@ -670,7 +654,7 @@ int Load_XM(MAS_Module *mod, bool verbose)
     }
     mod->order_count = order_count;
 
-    u16 restart_pos = read16();
+    u16 restart_pos = read16(fr);
     if (restart_pos > 255)
     {
         printf("Restart position higher than 255: %u\n", restart_pos);
@@ -678,9 +662,14 @@ int Load_XM(MAS_Module *mod, bool verbose)
     }
     mod->restart_pos = restart_pos;
 
-    u16 xm_nchannels = read16();
+    u16 xm_nchannels = read16(fr);
+    if (xm_nchannels > MAX_CHANNELS)
+    {
+        printf("Channel count higher than %d: %u\n", MAX_CHANNELS, xm_nchannels);
+        return ERR_INVALID_MODULE;
+    }
 
-    u16 patt_count = read16();
+    u16 patt_count = read16(fr);
     if (patt_count > 255)
     {
         printf("Pattern count higher than 255: %u\n", patt_count);
@@ -688,7 +677,7 @@ int Load_XM(MAS_Module *mod, bool verbose)
     }
     mod->patt_count = patt_count;
 
-    u16 inst_count = read16();
+    u16 inst_count = read16(fr);
     if (inst_count > 255)
     {
         printf("Instrument count higher than 255: %u\n", inst_count);
@@ -696,9 +685,9 @@ int Load_XM(MAS_Module *mod, bool verbose)
     }
     mod->inst_count = inst_count;
 
-    mod->freq_mode = read16() & 1 ? true : false; // flags
+    mod->freq_mode = read16(fr) & 1 ? true : false; // flags
 
-    u16 initial_speed = read16();
+    u16 initial_speed = read16(fr);
     if (initial_speed > 255)
     {
         printf("Initial speed higher than 255: %u\n", initial_speed);
@@ -706,7 +695,7 @@ int Load_XM(MAS_Module *mod, bool verbose)
     }
     mod->initial_speed = initial_speed;
 
-    u16 initial_tempo = read16();
+    u16 initial_tempo = read16(fr);
     if (initial_tempo > 255)
     {
         printf("Initial tempo higher than 255: %u\n", initial_tempo);
@@ -743,17 +732,17 @@ int Load_XM(MAS_Module *mod, bool verbose)
     for (z = 0; z < 200; z++) // read order table
     {
         if (z < mod->order_count)
-            mod->orders[z] = read8();
+            mod->orders[z] = read8(fr);
         else
         {
-            read8();
+            read8(fr);
             mod->orders[z] = 255;
         }
     }
     for ( ; z < 256; z++) // skip 200->255
-        read8();
+        read8(fr);
 
-    file_seek_read(60 + xm_headsize, SEEK_SET); // or maybe 60..
+    file_seek_read(60 + xm_headsize, SEEK_SET, fr); // or maybe 60..
 
     if (verbose)
     {
@@ -768,7 +757,7 @@ int Load_XM(MAS_Module *mod, bool verbose)
         if (verbose)
             printf(vstr_xm_patt, x + 1);
 
-        Load_XM_Pattern(&mod->patterns[x], xm_nchannels, verbose);
+        Load_XM_Pattern(&mod->patterns[x], fr, xm_nchannels, verbose);
     }
 
     mod->instruments = (Instrument*)calloc(mod->inst_count, sizeof(Instrument));
@@ -792,7 +781,7 @@ int Load_XM(MAS_Module *mod, bool verbose)
         if (verbose)
             printf(vstr_xm_samp_prefix, x + 1);
 
-        Load_XM_Instrument(&mod->instruments[x], mod, &next_sample, verbose);
+        Load_XM_Instrument(&mod->instruments[x], fr, mod, &next_sample, verbose);
     }
 
     if (verbose)
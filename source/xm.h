@@ -13,7 +13,7 @@
 #ifndef XM_H__
 #define XM_H__
 
-int Load_XM(MAS_Module *mod, bool verbose);
+int Load_XM(MAS_Module *mod, FileReader *fr, bool verbose);
 void CONV_XM_EFFECT(u8 *fx, u8 *param);
 
 #endif // XM_H__